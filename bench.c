@@ -0,0 +1,710 @@
+#define _POSIX_C_SOURCE 200809L
+#include "synth.h"
+#include "plan.h"
+#include "voice.h"
+#include "wav.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* Headless benchmark. Renders each layout given on the command line and
+ * a few generated stress patches for a fixed number of frames, and
+ * reports ns per sample for each patch and each module type as JSON.
+ * With --baseline it compares against an earlier run and exits non zero
+ * when something got slower.
+ *
+ * Patch timings run the real engine, scheduler included. Module timings
+ * run each step of the plan on its own for the same number of blocks so
+ * the clock is only read twice per step.
+ *
+ * With --verify it checks the output instead. Each patch is rendered with
+ * the same parameter changes and notes at every block size, thread count,
+ * optimize and native setting in verify_configs, and every render must
+ * match the first bit for bit. With --golden the first render is also
+ * compared against the one stored in that directory, or stored there if
+ * there isn't one yet. --update stores them all afresh, for changes that
+ * are meant to change the output. make test checks against tests/golden. */
+
+#define BENCH_MAX_PATCHES 64
+#define BENCH_MAX_TYPES 16
+#define BENCH_NAME_LEN 64
+#define BENCH_PATCH_LEN (64 * 1024)
+// Differences smaller than this are noise whatever the tolerance
+#define BENCH_MIN_DIFF_NS 0.05
+#define VERIFY_SECS 2 // rendered per patch and configuration
+#define VERIFY_MAX_CHANGES 64 // CSTs changed at each step of the script
+
+typedef struct bench_type {
+	char name[8];
+	int instances;
+	double ns; // over all instances for the whole run
+} bench_type;
+
+typedef struct bench_result {
+	char name[BENCH_NAME_LEN];
+	int ok;
+	int nmods;
+	double ns_per_sample;
+	double realtime;
+	bench_type types[BENCH_MAX_TYPES];
+	int ntypes;
+} bench_result;
+
+typedef struct bench_opts {
+	long frames;
+	int block;
+	int repeat;
+	int threads;
+	int size; // modules in the generated patches
+	int synthetic;
+	char *out;
+	char *baseline;
+	double tolerance; // percent
+	int verify;
+	char *golden; // directory of reference renders, NULL for none
+	int update; // rewrite the reference renders
+	double max_diff; // from a reference render, 0 for bit for bit
+} bench_opts;
+
+static double now_ns() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+// Loading a patch is chatty, keep stdout for the results
+static int quiet_fd = -1;
+static void quiet(int on) {
+	fflush(stdout);
+	if(on) {
+		int null = open("/dev/null", O_WRONLY);
+		quiet_fd = dup(STDOUT_FILENO);
+		dup2(null, STDOUT_FILENO);
+		close(null);
+	} else if(quiet_fd >= 0) {
+		dup2(quiet_fd, STDOUT_FILENO);
+		close(quiet_fd);
+		quiet_fd = -1;
+	}
+}
+
+/*************************/
+// Generated patches, built up as layout text
+
+static void line(char *buf, const char *fmt, ...) {
+	int len = strlen(buf);
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buf + len, BENCH_PATCH_LEN - len, fmt, args);
+	va_end(args);
+}
+
+// Sums the signals in mods[0..count) pairwise, returns the final module
+static int add_tree(char *buf, int *next, int *outs, int count) {
+	while(count > 1) {
+		int k = 0;
+		for(int i = 0; i + 1 < count; i += 2) {
+			line(buf, "%i ADD %i/0 %i/0\n", *next, outs[i], outs[i + 1]);
+			outs[k++] = (*next)++;
+		}
+		if(count & 1)
+			outs[k++] = outs[count - 1];
+		count = k;
+	}
+	return outs[0];
+}
+
+static void finish_patch(char *buf, int *next, int sig) {
+	line(buf, "%i CST 0.05 NDS Volume\n", *next);
+	line(buf, "%i VCA %i/0 %i/0\n", *next + 1, *next, sig);
+	line(buf, "%i OUT %i/0\n", *next + 2, *next + 1);
+	*next += 3;
+}
+
+// N oscillators at different pitches
+static void gen_osc(char *buf, int size) {
+	int next = 0, *outs = malloc(size * sizeof(int));
+	for(int i = 0; i < size; i++) {
+		line(buf, "%i CST %f NDS Freq\n", next, 110. + 13. * i);
+		line(buf, "%i OCC %i/0\n", next + 1, next);
+		outs[i] = next + 1;
+		next += 2;
+	}
+	finish_patch(buf, &next, add_tree(buf, &next, outs, size));
+	free(outs);
+}
+
+// N filters in parallel on one saw
+static void gen_vcf(char *buf, int size) {
+	int next = 3, *outs = malloc(size * sizeof(int));
+	line(buf, "0 CST 220 NDS Freq\n1 OCC 0/0\n2 CST 0.5 NDS Res\n");
+	for(int i = 0; i < size; i++) {
+		line(buf, "%i CST %f NDS Cut\n", next, 0.05 + 0.9 * i / size);
+		line(buf, "%i VCF %i/0 2/0 1/2\n", next + 1, next);
+		outs[i] = next + 1;
+		next += 2;
+	}
+	finish_patch(buf, &next, add_tree(buf, &next, outs, size));
+	free(outs);
+}
+
+// One long dependent chain alternating VCA and ADD
+static void gen_chain(char *buf, int size) {
+	int next = 4, sig = 1;
+	line(buf, "0 CST 220 NDS Freq\n1 OCC 0/0\n2 CST 0.99 NDS Gain\n3 CST 0.001 NDS Offset\n");
+	for(int i = 0; i < size; i++) {
+		if(i & 1)
+			line(buf, "%i ADD 3/0 %i/0\n", next, sig);
+		else
+			line(buf, "%i VCA 2/0 %i/0\n", next, sig);
+		sig = next++;
+	}
+	finish_patch(buf, &next, sig);
+}
+
+// A voice of OCC, VCF, ENV and VCA per note
+static void gen_poly(char *buf, int size) {
+	line(buf, "0 KEY\n1 OCC 0/1\n2 CST 0.4 NDS Cut\n3 CST 0.5 NDS Res\n"
+			"4 VCF 2/0 3/0 1/2\n5 CST 0.01 NDS Attack\n6 CST 0.2 NDS Release\n"
+			"7 ENV 5/0 5/0 6/0 6/0 0/0\n8 VCA 7/0 4/0\n");
+	int next = 9;
+	finish_patch(buf, &next, 8);
+}
+
+#define BENCH_NSYNTHETIC 4
+// Generated patch g and its name
+static void synthetic(char *text, char *name, int g, int size) {
+	static const char *names[] = {"osc", "vcf", "chain", "poly"};
+	void (*gens[])(char*, int) = {gen_osc, gen_vcf, gen_chain, gen_poly};
+	text[0] = 0;
+	gens[g](text, size);
+	if(g == 3)
+		snprintf(name, BENCH_NAME_LEN, "synthetic_poly_%i", DEFAULT_VOICES);
+	else
+		snprintf(name, BENCH_NAME_LEN, "synthetic_%s_%i", names[g], size);
+}
+
+/*************************/
+
+static bench_type *find_type(bench_result *r, const char *name, int add) {
+	for(int i = 0; i < r->ntypes; i++)
+		if(0 == strcmp(r->types[i].name, name))
+			return &r->types[i];
+	if(!add || r->ntypes == BENCH_MAX_TYPES)
+		return NULL;
+	bench_type *t = &r->types[r->ntypes++];
+	memset(t, 0, sizeof(bench_type));
+	strncpy(t->name, name, sizeof(t->name) - 1);
+	return t;
+}
+
+static const char *step_type(plan_step *s) {
+	static char type[4];
+	if(s->mod_id < 0)
+		return plan_step_name(s);
+	memcpy(type, get_mod_type(s->mod_id), 3);
+	type[3] = 0;
+	return type;
+}
+
+static void time_patch(bench_result *r, bench_opts *o) {
+	double best = -1.;
+	int poly = synth_is_polyphonic();
+	for(int rep = 0; rep < o->repeat; rep++) {
+		// Chords keep every voice busy
+		for(int v = 0; poly && v < 8; v++)
+			schedule_note_on(48 + 5 * v, 1.0, get_synth_frame());
+		double t0 = now_ns();
+		for(long done = 0; done < o->frames; done += o->block)
+			synth_process_block(o->frames - done < o->block ? o->frames - done : o->block);
+		synth_flush_outputs();
+		double t = now_ns() - t0;
+		if(best < 0. || t < best)
+			best = t;
+	}
+	r->ns_per_sample = best / o->frames;
+	r->realtime = (o->frames / (double)get_rate()) / (best / 1e9);
+}
+
+static void time_modules(bench_result *r, bench_opts *o) {
+	plan *p = get_synth_plan();
+	long nblocks = o->frames / o->block;
+	for(int i = 0; i < p->nsteps; i++) {
+		plan_step *s = &p->steps[i];
+		// Control rate buffers only hold a block's ticks
+		int n = (o->block + s->stride - 1) / s->stride;
+		double best = -1.;
+		for(int rep = 0; rep < o->repeat; rep++) {
+			double t0 = now_ns();
+			for(long b = 0; b < nblocks; b++)
+				s->kernel(s, p->pool, n);
+			double t = now_ns() - t0;
+			if(best < 0. || t < best)
+				best = t;
+		}
+		bench_type *t = find_type(r, step_type(s), 1);
+		if(!t) continue;
+		t->instances++;
+		t->ns += best;
+	}
+	synth_flush_outputs();
+}
+
+// From a file, or from layout text when filename is NULL
+static int load_patch(char *filename, char *text) {
+	set_render_file(NULL);
+	quiet(1);
+	int err;
+	if(filename)
+		err = load_network(filename);
+	else {
+		FILE *f = fmemopen(text, strlen(text), "r");
+		err = f ? load_network_from(f) : -1;
+		if(f) fclose(f);
+	}
+	quiet(0);
+	return err;
+}
+
+static void run_patch(bench_result *r, bench_opts *o, const char *name,
+		char *filename, char *text) {
+	memset(r, 0, sizeof(bench_result));
+	strncpy(r->name, name, BENCH_NAME_LEN - 1);
+	fprintf(stderr, "%-24s ", name);
+
+	int err = load_patch(filename, text);
+
+	// As many channels as the patch plays on
+	wav_file *w = wav_open("/dev/null", get_rate(), err ? 1 : get_channels());
+	set_render_file(w);
+	if(!err) {
+		r->ok = 1;
+		r->nmods = get_nmods();
+		time_patch(r, o);
+		time_modules(r, o);
+		fprintf(stderr, "%4i modules %8.2f ns/sample %8.1fx real time\n",
+				r->nmods, r->ns_per_sample, r->realtime);
+	} else
+		fprintf(stderr, "failed to load, skipped\n");
+
+	quiet(1);
+	unload_network();
+	quiet(0);
+	set_render_file(NULL);
+	wav_close(w);
+}
+
+static int write_json(bench_result *res, int n, bench_opts *o) {
+	FILE *f = o->out ? fopen(o->out, "w") : stdout;
+	if(!f) {
+		printf("ERROR: Can't write %s\n", o->out);
+		return -1;
+	}
+	fprintf(f, "{\n\"rate\": %u,\n\"block_size\": %i,\n\"frames\": %li,\n"
+			"\"threads\": %i,\n\"repeat\": %i,\n\"patches\": [\n",
+			get_rate(), o->block, o->frames, o->threads, o->repeat);
+	for(int i = 0; i < n; i++) {
+		bench_result *r = &res[i];
+		fprintf(f, "{\n\"name\": \"%s\",\n", r->name);
+		if(!r->ok) {
+			fprintf(f, "\"error\": \"failed to load\"\n}%s\n", i + 1 < n ? "," : "");
+			continue;
+		}
+		fprintf(f, "\"modules\": %i,\n\"ns_per_sample\": %.4f,\n\"realtime\": %.2f,\n"
+				"\"types\": {\n", r->nmods, r->ns_per_sample, r->realtime);
+		for(int t = 0; t < r->ntypes; t++)
+			fprintf(f, "\"%s\": {\"instances\": %i, \"ns_per_sample\": %.4f}%s\n",
+					r->types[t].name, r->types[t].instances,
+					r->types[t].ns / r->types[t].instances / o->frames,
+					t + 1 < r->ntypes ? "," : "");
+		fprintf(f, "}\n}%s\n", i + 1 < n ? "," : "");
+	}
+	fprintf(f, "]\n}\n");
+	if(o->out)
+		fclose(f);
+	return 0;
+}
+
+/* Reads back what write_json wrote, a line at a time. Any patch or type
+ * missing from either side is skipped. */
+static int check_regression(const char *what, double base, double cur, double tol) {
+	if(cur - base <= BENCH_MIN_DIFF_NS || cur <= base * (1. + tol / 100.))
+		return 0;
+	printf("REGRESSION %s: %.4f -> %.4f ns/sample (%+.1f%%)\n",
+			what, base, cur, 100. * (cur - base) / base);
+	return 1;
+}
+
+static int compare_baseline(bench_result *res, int n, bench_opts *o) {
+	FILE *f = fopen(o->baseline, "r");
+	if(!f) {
+		printf("ERROR: Can't open baseline %s\n", o->baseline);
+		return -1;
+	}
+
+	char buf[256], name[BENCH_NAME_LEN + 8], what[2 * BENCH_NAME_LEN];
+	bench_result *cur = NULL;
+	int regressions = 0, compared = 0;
+	while(fgets(buf, sizeof(buf), f)) {
+		char type[16];
+		int instances;
+		double ns;
+		if(1 == sscanf(buf, "\"name\": \"%63[^\"]\"", name)) {
+			cur = NULL;
+			for(int i = 0; i < n; i++)
+				if(res[i].ok && 0 == strcmp(res[i].name, name))
+					cur = &res[i];
+		} else if(cur && 1 == sscanf(buf, "\"ns_per_sample\": %lf", &ns)) {
+			regressions += check_regression(cur->name, ns, cur->ns_per_sample, o->tolerance);
+			compared++;
+		} else if(cur && 3 == sscanf(buf, "\"%15[^\"]\": {\"instances\": %i, \"ns_per_sample\": %lf",
+					type, &instances, &ns)) {
+			bench_type *t = find_type(cur, type, 0);
+			if(!t)
+				continue;
+			snprintf(what, sizeof(what), "%s %s", cur->name, type);
+			regressions += check_regression(what, ns,
+					t->ns / t->instances / o->frames, o->tolerance);
+			compared++;
+		}
+	}
+	fclose(f);
+	printf("Compared %i timings against %s with %.0f%% tolerance, %i regressions\n",
+			compared, o->baseline, o->tolerance, regressions);
+	return regressions ? 1 : 0;
+}
+
+/*************************/
+// Output checks
+
+typedef struct verify_config {
+	int block;
+	int threads;
+	int optimize;
+	int native;
+} verify_config;
+
+// The first is what the others and the golden renders are compared with
+static const verify_config verify_configs[] = {
+	{DEFAULT_BLOCK_SIZE, 1, 1, 0}, {DEFAULT_BLOCK_SIZE, 1, 0, 0},
+	{DEFAULT_BLOCK_SIZE, 1, 1, 1}, {DEFAULT_BLOCK_SIZE, 3, 1, 0},
+	{DEFAULT_BLOCK_SIZE, 3, 0, 1}, {1, 1, 1, 0}, {1, 3, 0, 0},
+	{37, 1, 0, 0}, {37, 2, 1, 0}, {37, 3, 1, 1}, {256, 1, 1, 1},
+	{256, 4, 1, 0}, {MAX_BLOCK_SIZE, 2, 0, 0}, {MAX_BLOCK_SIZE, 1, 1, 1},
+};
+#define VERIFY_NCONFIGS (int)(sizeof(verify_configs) / sizeof(verify_config))
+
+typedef struct verify_render {
+	float *samples; // interleaved
+	size_t len; // floats
+	int channels;
+} verify_render;
+
+static void describe(char *buf, int size, const verify_config *c) {
+	snprintf(buf, size, "block %i, %i threads%s%s", c->block, c->threads,
+			c->optimize ? "" : ", no optimize", c->native ? ", native" : "");
+}
+
+/* Notes and CST changes at fixed frames, the same for every render. Each
+ * quarter of the way through, the CSTs drop to a fraction of where they
+ * started, a frame apart so they land all over a block. Changes have to
+ * be queued in frame order. */
+static void verify_script(long frames) {
+	static const float scale[] = {1.0f, 0.5f, 0.8f, 1.0f};
+	static const int chord[] = {48, 55, 60, 64, 67, 72, 76, 79};
+	uint64_t base = get_synth_frame();
+	int poly = synth_is_polyphonic();
+	for(int q = 0; q < 4; q++) {
+		uint64_t at = base + q * (frames / 4);
+		for(int v = 0; poly && v < 8; v++) {
+			if(1 == q || 3 == q)
+				schedule_note_off(chord[v] + (q > 1), at + v);
+			else
+				schedule_note_on(chord[v] + (q > 1), 1.0f - 0.1f * v, at + v);
+		}
+		for(int m = 0, changed = 0; q && m < get_nmods() && changed < VERIFY_MAX_CHANGES; m++)
+			if(0 == strncmp(get_mod_type(m), "CST", 3))
+				schedule_mod_cst_value(m, get_mod_cst_init_value(m) * scale[q],
+						at + 8 + changed++);
+	}
+}
+
+// The patch rendered in memory with c, -1 if it won't load
+static int verify_render_patch(verify_render *out, bench_opts *o,
+		const verify_config *c, char *filename, char *text) {
+	memset(out, 0, sizeof(verify_render));
+	set_block_size(c->block);
+	set_threads(c->threads);
+	set_optimize(c->optimize);
+	set_native(c->native);
+	// Notes from the last render stay in the voices otherwise
+	set_voices(DEFAULT_VOICES);
+	if(load_patch(filename, text)) {
+		quiet(1);
+		unload_network();
+		quiet(0);
+		return -1;
+	}
+
+	char *buf = NULL;
+	size_t bytes = 0;
+	wav_file *w = wav_open_memory(&buf, &bytes, get_rate(), get_channels());
+	if(!w) {
+		quiet(1);
+		unload_network();
+		quiet(0);
+		return -1;
+	}
+	out->channels = get_channels();
+	set_render_file(w);
+
+	verify_script(o->frames);
+	int block = get_block_size();
+	for(long done = 0; done < o->frames; done += block)
+		synth_process_block(o->frames - done < block ? o->frames - done : block);
+	synth_flush_outputs();
+
+	quiet(1);
+	unload_network();
+	quiet(0);
+	set_render_file(NULL);
+	wav_close(w);
+	out->samples = (float*)buf;
+	out->len = bytes / sizeof(float);
+	return 0;
+}
+
+/* Prints where b first differs from a by more than max_diff and by how
+ * much at most, returns 1 if it does */
+static int verify_compare(const char *name, const char *what, verify_render *a,
+		verify_render *b, double max_diff) {
+	if(a->channels != b->channels || a->len != b->len) {
+		printf("DIFF %s %s: %i channels of %zu frames, not %i of %zu\n", name, what,
+				b->channels, b->len / b->channels, a->channels, a->len / a->channels);
+		return 1;
+	}
+	size_t first = a->len, ndiff = 0;
+	double worst = 0.;
+	for(size_t i = 0; i < a->len; i++) {
+		double d = fabs((double)a->samples[i] - b->samples[i]);
+		int same = max_diff > 0. ? d <= max_diff :
+			0 == memcmp(&a->samples[i], &b->samples[i], sizeof(float));
+		if(same) continue;
+		if(first == a->len)
+			first = i;
+		ndiff++;
+		if(d > worst || d != d)
+			worst = d;
+	}
+	if(!ndiff)
+		return 0;
+	printf("DIFF %s %s: %zu samples differ, first at frame %zu channel %zu, "
+			"up to %g\n", name, what, ndiff, first / a->channels,
+			first % a->channels, worst);
+	return 1;
+}
+
+// Named after the patch without its directory or extension
+static void golden_path(char *path, int size, const char *name, bench_opts *o) {
+	const char *base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+	const char *ext = strrchr(base, '.');
+	snprintf(path, size, "%s/%.*s.wav", o->golden,
+			ext ? (int)(ext - base) : (int)strlen(base), base);
+}
+
+// Compares with the stored render, or stores it, returns 1 if they differ
+static int verify_golden(const char *name, verify_render *r, bench_opts *o) {
+	char path[1024];
+	golden_path(path, sizeof(path), name, o);
+
+	if(o->update || 0 != access(path, F_OK)) {
+		wav_file *w = wav_open(path, get_rate(), r->channels);
+		if(!w)
+			return 1;
+		int err = wav_write(w, r->samples, r->len / r->channels);
+		if(wav_close(w) || err) {
+			printf("ERROR: Can't write golden render %s\n", path);
+			return 1;
+		}
+		printf("Wrote golden render %s\n", path);
+		return 0;
+	}
+
+	verify_render g;
+	uint32_t nframes;
+	if(!(g.samples = wav_load(path, &g.channels, &nframes)))
+		return 1;
+	g.len = (size_t)nframes * g.channels;
+	int diff = verify_compare(name, "against golden", &g, r, o->max_diff);
+	free(g.samples);
+	return diff;
+}
+
+/* Returns how many checks failed, -1 if it won't load at all. A patch
+ * with a golden render has to load, it rendered once. */
+static int verify_patch(bench_opts *o, const char *name, char *filename, char *text) {
+	verify_render ref, r;
+	char what[64];
+	fprintf(stderr, "%-24s ", name);
+	if(verify_render_patch(&ref, o, &verify_configs[0], filename, text)) {
+		char path[1024];
+		if(o->golden)
+			golden_path(path, sizeof(path), name, o);
+		if(o->golden && 0 == access(path, F_OK)) {
+			fprintf(stderr, "FAILED\n");
+			printf("FAIL %s: failed to load, but there is a golden render\n", name);
+			return 1;
+		}
+		fprintf(stderr, "failed to load, skipped\n");
+		return -1;
+	}
+
+	int failed = 0;
+	for(int i = 1; i < VERIFY_NCONFIGS; i++) {
+		describe(what, sizeof(what), &verify_configs[i]);
+		if(verify_render_patch(&r, o, &verify_configs[i], filename, text)) {
+			printf("FAIL %s: failed to load with %s\n", name, what);
+			failed++;
+			continue;
+		}
+		failed += verify_compare(name, what, &ref, &r, 0.);
+		free(r.samples);
+	}
+	if(o->golden)
+		failed += verify_golden(name, &ref, o);
+	free(ref.samples);
+	fprintf(stderr, "%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
+
+static int verify(bench_opts *o, char **layouts, int nlayouts) {
+	int failed = 0, n = 0, skipped = 0;
+	char *text = malloc(BENCH_PATCH_LEN);
+	char name[BENCH_NAME_LEN];
+	for(int i = 0; i < nlayouts + BENCH_NSYNTHETIC; i++) {
+		if(i >= nlayouts && !o->synthetic)
+			break;
+		int f;
+		if(i < nlayouts)
+			f = verify_patch(o, layouts[i], layouts[i], NULL);
+		else {
+			synthetic(text, name, i - nlayouts, o->size);
+			f = verify_patch(o, name, NULL, text);
+		}
+		if(f < 0)
+			skipped++;
+		else {
+			failed += f;
+			n++;
+		}
+	}
+	free(text);
+	printf("Verified %i patches in %i configurations over %li frames, "
+			"%i failures, %i skipped\n", n, VERIFY_NCONFIGS, o->frames, failed, skipped);
+	return failed ? 1 : 0;
+}
+
+static void usage() {
+	printf("Usage: synthbench [options] [layout.dat ...]\n"
+			"  --frames N      frames rendered per patch (441000)\n"
+			"  --block N       frames per block (%i)\n"
+			"  --control-period N  frames per control rate tick (%i, 1 for none)\n"
+			"  --no-optimize   no pruning or fusing\n"
+			"  --native        compile patches to native code\n"
+			"  --repeat N      runs per timing, the fastest is kept (3)\n"
+			"  --threads N     most threads per patch (1, 0 for one per core)\n"
+			"  --size N        modules in the generated patches (32)\n"
+			"  --no-synthetic  only the layouts given\n"
+			"  --out FILE      JSON results, stdout if not given\n"
+			"  --baseline FILE compare against an earlier --out\n"
+			"  --tolerance P   percent slower before it counts (10)\n"
+			"  --verify        check the output is the same in every configuration\n"
+			"                  instead of timing, %is per patch unless --frames\n"
+			"  --golden DIR    with --verify, compare against the renders in DIR,\n"
+			"                  writing any that are missing\n"
+			"  --update        rewrite the renders in DIR from this build, for\n"
+			"                  when the output is meant to have changed\n"
+			"  --max-diff X    largest difference from them that passes (0)\n",
+			DEFAULT_BLOCK_SIZE, DEFAULT_CONTROL_PERIOD, VERIFY_SECS);
+}
+
+int main(int argc, char *argv[]) {
+	bench_opts o = {0, DEFAULT_BLOCK_SIZE, 3, 1, 32, 1, NULL, NULL, 10., 0, NULL, 0, 0.};
+	char *layouts[BENCH_MAX_PATCHES];
+	int nlayouts = 0;
+
+	for(int i = 1; i < argc; i++) {
+		if(0 == strcmp(argv[i], "--frames") && i + 1 < argc)
+			o.frames = atol(argv[++i]);
+		else if(0 == strcmp(argv[i], "--block") && i + 1 < argc)
+			o.block = atoi(argv[++i]);
+		else if(0 == strcmp(argv[i], "--control-period") && i + 1 < argc)
+			set_control_period(atoi(argv[++i]));
+		else if(0 == strcmp(argv[i], "--no-optimize"))
+			set_optimize(0);
+		else if(0 == strcmp(argv[i], "--native"))
+			set_native(1);
+		else if(0 == strcmp(argv[i], "--repeat") && i + 1 < argc)
+			o.repeat = atoi(argv[++i]);
+		else if(0 == strcmp(argv[i], "--threads") && i + 1 < argc)
+			o.threads = atoi(argv[++i]);
+		else if(0 == strcmp(argv[i], "--size") && i + 1 < argc)
+			o.size = atoi(argv[++i]);
+		else if(0 == strcmp(argv[i], "--no-synthetic"))
+			o.synthetic = 0;
+		else if(0 == strcmp(argv[i], "--out") && i + 1 < argc)
+			o.out = argv[++i];
+		else if(0 == strcmp(argv[i], "--baseline") && i + 1 < argc)
+			o.baseline = argv[++i];
+		else if(0 == strcmp(argv[i], "--tolerance") && i + 1 < argc)
+			o.tolerance = atof(argv[++i]);
+		else if(0 == strcmp(argv[i], "--verify"))
+			o.verify = 1;
+		else if(0 == strcmp(argv[i], "--golden") && i + 1 < argc)
+			o.golden = argv[++i];
+		else if(0 == strcmp(argv[i], "--update"))
+			o.update = 1;
+		else if(0 == strcmp(argv[i], "--max-diff") && i + 1 < argc)
+			o.max_diff = atof(argv[++i]);
+		else if('-' == argv[i][0]) {
+			usage();
+			return 2;
+		} else if(nlayouts < BENCH_MAX_PATCHES)
+			layouts[nlayouts++] = argv[i];
+	}
+	if(o.frames <= 0)
+		o.frames = o.verify ? VERIFY_SECS * (long)get_rate() : 441000;
+	if(o.repeat < 1) o.repeat = 1;
+	if(o.size < 1) o.size = 1;
+	if(o.verify)
+		return verify(&o, layouts, nlayouts);
+	set_block_size(o.block);
+	o.block = get_block_size();
+	set_threads(o.threads);
+	set_voices(DEFAULT_VOICES);
+
+	bench_result *res = calloc(BENCH_MAX_PATCHES, sizeof(bench_result));
+	int n = 0;
+	for(int i = 0; i < nlayouts; i++)
+		run_patch(&res[n++], &o, layouts[i], layouts[i], NULL);
+
+	char *text = malloc(BENCH_PATCH_LEN);
+	char name[BENCH_NAME_LEN];
+	for(int g = 0; o.synthetic && g < BENCH_NSYNTHETIC && n < BENCH_MAX_PATCHES; g++) {
+		synthetic(text, name, g, o.size);
+		run_patch(&res[n++], &o, name, NULL, text);
+	}
+	free(text);
+
+	int ret = write_json(res, n, &o) ? 2 : 0;
+	if(!ret && o.baseline)
+		ret = compare_baseline(res, n, &o) ? 1 : 0;
+	free(res);
+	return ret;
+}
@@ -0,0 +1,539 @@
+#define _POSIX_C_SOURCE 200809L
+#include "control.h"
+#include "synth.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define CONTROL_LABEL_LEN 256
+#define OSC_MAX_DEPTH 4 // bundles in bundles
+#define CONTROL_MAX_SMOOTH 60 // longest ramp, in seconds
+
+typedef struct client {
+	int fd; // -1 when free
+	char buf[CONTROL_LINE_LEN];
+	int len;
+	int discard; // the rest of a line that was too long is thrown away
+} client;
+
+typedef struct cst_entry {
+	int mod_id;
+	char type[4];
+	char label[CONTROL_LABEL_LEN];
+} cst_entry;
+
+// Everything but running belongs to the server's thread once it starts
+static struct {
+	pthread_t thread;
+	int running;
+	int listen_fd, osc_fd;
+	int wake[2]; // written to stop the thread
+	char *path;
+	client clients[CONTROL_MAX_CLIENTS];
+
+	// The live patch's CSTs, looked up again after a reload
+	cst_entry *csts;
+	int ncsts;
+	unsigned generation;
+
+	// Message being taken apart, and the first thing wrong with it
+	param_event batch[CONTROL_MAX_BATCH];
+	int nbatch;
+	char error[256];
+	char packet[CONTROL_PACKET_LEN];
+} ctl = {.listen_fd = -1, .osc_fd = -1, .wake = {-1, -1}};
+
+static void refresh_csts() {
+	unsigned generation = get_synth_generation();
+	if(ctl.csts && generation == ctl.generation)
+		return;
+	ctl.generation = generation;
+	int nmods = get_nmods();
+	ctl.csts = realloc(ctl.csts, (nmods ? nmods : 1) * sizeof(cst_entry));
+	ctl.ncsts = 0;
+	synth_hold_patch();
+	for(int m = 0; m < nmods; m++) {
+		if(strncmp(get_mod_type(m), "CST", 3)) continue;
+		cst_entry *c = &ctl.csts[ctl.ncsts++];
+		c->mod_id = m;
+		snprintf(c->type, sizeof(c->type), "%.3s", get_mod_cst_type(m));
+		snprintf(c->label, sizeof(c->label), "%s", get_mod_cst_label(m));
+	}
+	synth_release_patch();
+}
+
+/*************************/
+// Batches
+
+static void fail(const char *fmt, ...) {
+	if(ctl.error[0])
+		return;
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(ctl.error, sizeof(ctl.error), fmt, args);
+	va_end(args);
+}
+
+// A module id if target is all digits, else a label
+static int find_cst(const char *target) {
+	char *end;
+	long id = strtol(target, &end, 10);
+	int numeric = *target && !*end && '-' != *target && '+' != *target;
+	for(int i = 0; i < ctl.ncsts; i++)
+		if(numeric ? ctl.csts[i].mod_id == id : 0 == strcmp(ctl.csts[i].label, target))
+			return ctl.csts[i].mod_id;
+	fail("No CST %s", target);
+	return -1;
+}
+
+static void add(int kind, int mod_id, float val) {
+	if(ctl.nbatch == CONTROL_MAX_BATCH) {
+		fail("More than %i changes in one message", CONTROL_MAX_BATCH);
+		return;
+	}
+	param_event *ev = &ctl.batch[ctl.nbatch++];
+	memset(ev, 0, sizeof(param_event));
+	ev->kind = kind;
+	ev->mod_id = mod_id;
+	ev->val = val;
+}
+
+// A new value, or with PARAM_CST_SMOOTH how long it ramps to new values
+static void add_cst(int kind, const char *target, float val) {
+	if(PARAM_CST_SMOOTH == kind && !(val >= 0 && val <= CONTROL_MAX_SMOOTH)) {
+		fail("Smoothing %g is not 0 to %i seconds", val, CONTROL_MAX_SMOOTH);
+		return;
+	}
+	int m = find_cst(target);
+	if(m >= 0)
+		add(kind, m, val);
+}
+
+// Checked as a float, any number can come in
+static void add_note(int kind, float note, float velocity) {
+	if(!(note >= 0 && note <= 127)) {
+		fail("Note %g out of range", note);
+		return;
+	}
+	add(kind, (int)note, velocity);
+}
+
+// Queues the batch unless something was wrong with it, -1 if it wasn't
+static int send_batch() {
+	int ret = 0;
+	if(!ctl.error[0] && ctl.nbatch && queue_remote_params(ctl.batch, ctl.nbatch))
+		fail("Queue full, changes dropped");
+	if(ctl.error[0])
+		ret = -1;
+	ctl.nbatch = 0;
+	return ret;
+}
+
+/*************************/
+// Text on the socket
+
+// Next word or "quoted string", NULL at the end of the line
+static char *token(char **p) {
+	char *s = *p;
+	while(' ' == *s || '\t' == *s)
+		s++;
+	if(!*s)
+		return NULL;
+	char *start = s;
+	if('"' == *s) {
+		start = ++s;
+		while(*s && '"' != *s)
+			s++;
+	} else
+		while(*s && ' ' != *s && '\t' != *s)
+			s++;
+	if(*s)
+		*s++ = 0;
+	*p = s;
+	return start;
+}
+
+static int number(const char *s, float *v) {
+	char *end;
+	*v = strtof(s, &end);
+	if(end == s || *end) {
+		fail("%s is not a number", s);
+		return -1;
+	}
+	return 0;
+}
+
+static void reply(client *c, const char *text) {
+	// Clients that don't read their replies lose them
+	send(c->fd, text, strlen(text), MSG_NOSIGNAL);
+}
+
+static void list_csts(client *c) {
+	char line[CONTROL_LABEL_LEN + 32];
+	for(int i = 0; i < ctl.ncsts; i++) {
+		snprintf(line, sizeof(line), "%i %s %s\n", ctl.csts[i].mod_id,
+				ctl.csts[i].type, ctl.csts[i].label);
+		reply(c, line);
+	}
+	reply(c, "\n");
+}
+
+static void handle_line(client *c, char *line) {
+	char *p = line, *cmd = token(&p), *a, *b;
+	float v, velocity = 1.0f;
+	if(!cmd)
+		return;
+	refresh_csts();
+	ctl.error[0] = 0;
+	int set = 0 == strcmp(cmd, "set");
+	if(set || 0 == strcmp(cmd, "smooth")) {
+		while((a = token(&p))) {
+			if(!(b = token(&p)))
+				fail("No value for %s", a);
+			else if(!number(b, &v))
+				add_cst(set ? PARAM_CST : PARAM_CST_SMOOTH, a, v);
+		}
+		if(!ctl.nbatch)
+			fail("%s needs TARGET VALUE pairs", cmd);
+	} else if(0 == strcmp(cmd, "note") || 0 == strcmp(cmd, "off")) {
+		int on = 0 == strcmp(cmd, "note");
+		if(!(a = token(&p)))
+			fail("%s needs a note", cmd);
+		else if(!number(a, &v) && !(on && (b = token(&p)) && number(b, &velocity)))
+			add_note(on ? PARAM_NOTE_ON : PARAM_NOTE_OFF, v, on ? velocity : 0.0f);
+	} else if(0 == strcmp(cmd, "list")) {
+		list_csts(c);
+		return;
+	} else
+		fail("Unknown command %s", cmd);
+
+	if(send_batch()) {
+		char text[sizeof(ctl.error) + 16];
+		snprintf(text, sizeof(text), "ERROR: %s\n", ctl.error);
+		reply(c, text);
+	}
+}
+
+// Whatever came in, a line at a time, -1 once the client has gone
+static int read_client(client *c) {
+	int n = read(c->fd, c->buf + c->len, CONTROL_LINE_LEN - c->len);
+	if(n <= 0)
+		return n < 0 && (EAGAIN == errno || EINTR == errno) ? 0 : -1;
+	c->len += n;
+
+	char *start = c->buf, *nl;
+	while((nl = memchr(start, '\n', c->buf + c->len - start))) {
+		*nl = 0;
+		if(nl > start && '\r' == nl[-1])
+			nl[-1] = 0;
+		if(!c->discard)
+			handle_line(c, start);
+		c->discard = 0;
+		start = nl + 1;
+	}
+	c->len -= start - c->buf;
+	memmove(c->buf, start, c->len);
+	if(CONTROL_LINE_LEN == c->len) {
+		if(!c->discard)
+			reply(c, "ERROR: Line too long\n");
+		c->discard = 1;
+		c->len = 0;
+	}
+	return 0;
+}
+
+static void accept_client() {
+	int fd = accept(ctl.listen_fd, NULL, NULL);
+	if(fd < 0)
+		return;
+	for(int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+		if(ctl.clients[i].fd < 0) {
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			ctl.clients[i].fd = fd;
+			ctl.clients[i].len = 0;
+			ctl.clients[i].discard = 0;
+			return;
+		}
+	const char *full = "ERROR: Too many clients\n";
+	send(fd, full, strlen(full), MSG_NOSIGNAL);
+	close(fd);
+}
+
+/*************************/
+// OSC
+
+typedef struct osc_reader {
+	const unsigned char *p, *end;
+} osc_reader;
+
+// Fails the message if it runs off the end
+static uint32_t osc_u32(osc_reader *r) {
+	if(r->end - r->p < 4) {
+		fail("Malformed OSC message");
+		r->p = r->end;
+		return 0;
+	}
+	uint32_t v = (uint32_t)r->p[0] << 24 | r->p[1] << 16 | r->p[2] << 8 | r->p[3];
+	r->p += 4;
+	return v;
+}
+
+// Strings are nul terminated and padded to 4 bytes, NULL if it runs off the end
+static const char *osc_string(osc_reader *r) {
+	const unsigned char *nul = memchr(r->p, 0, r->end - r->p);
+	if(!nul)
+		return NULL;
+	const char *s = (const char*)r->p;
+	int len = (nul - r->p) / 4 * 4 + 4;
+	r->p = len <= r->end - r->p ? r->p + len : r->end;
+	return s;
+}
+
+// The next argument as a number
+static int osc_number(osc_reader *r, char type, float *v) {
+	uint32_t bits = osc_u32(r);
+	if(ctl.error[0])
+		return -1;
+	if('i' == type)
+		*v = (float)(int32_t)bits;
+	else if('f' == type)
+		memcpy(v, &bits, sizeof(float));
+	else {
+		fail("OSC argument type %c is not a number", type);
+		return -1;
+	}
+	return 0;
+}
+
+static void osc_message(osc_reader *r) {
+	const char *addr = osc_string(r);
+	const char *types = addr ? osc_string(r) : NULL;
+	if(!types || ',' != types[0]) {
+		fail("Malformed OSC message");
+		return;
+	}
+	types++;
+	int nargs = strlen(types);
+	float v, velocity = 1.0f;
+
+	int set = 0 == strncmp(addr, "/cst/", 5);
+	if(set || 0 == strncmp(addr, "/smooth/", 8)) {
+		if(1 != nargs)
+			fail("%s takes one value", addr);
+		else if(!osc_number(r, types[0], &v))
+			add_cst(set ? PARAM_CST : PARAM_CST_SMOOTH, addr + (set ? 5 : 8), v);
+	} else if(0 == strcmp(addr, "/set")) {
+		if(!nargs || nargs % 2)
+			fail("/set takes TARGET VALUE pairs");
+		for(int i = 0; i + 1 < nargs && !ctl.error[0]; i += 2) {
+			char target[16];
+			const char *t = target;
+			if('s' == types[i]) {
+				if(!(t = osc_string(r)))
+					fail("Malformed OSC string");
+			} else if('i' == types[i])
+				snprintf(target, sizeof(target), "%i", (int32_t)osc_u32(r));
+			else
+				fail("/set targets are ids or labels");
+			if(!ctl.error[0] && !osc_number(r, types[i + 1], &v))
+				add_cst(PARAM_CST, t, v);
+		}
+	} else if(0 == strcmp(addr, "/note") || 0 == strcmp(addr, "/off")) {
+		int on = 0 == strcmp(addr, "/note");
+		if(nargs < 1 || nargs > (on ? 2 : 1))
+			fail("Wrong arguments to %s", addr);
+		else if(!osc_number(r, types[0], &v) &&
+				(1 == nargs || !osc_number(r, types[1], &velocity)))
+			add_note(on ? PARAM_NOTE_ON : PARAM_NOTE_OFF, v, on ? velocity : 0.0f);
+	} else
+		fail("Unknown OSC address %s", addr);
+}
+
+// A message or a bundle of them, the whole packet is one batch
+static void osc_packet(const unsigned char *p, int len, int depth) {
+	osc_reader r = {p, p + len};
+	if(len < 16 || memcmp(p, "#bundle", 8)) {
+		osc_message(&r);
+		return;
+	}
+	if(depth == OSC_MAX_DEPTH) {
+		fail("OSC bundles nested too deep");
+		return;
+	}
+	// Time tags are ignored, everything happens as it arrives
+	r.p += 16;
+	while(r.p < r.end && !ctl.error[0]) {
+		uint32_t size = osc_u32(&r);
+		if(ctl.error[0] || size > (uint32_t)(r.end - r.p) || size % 4) {
+			fail("Malformed OSC bundle");
+			return;
+		}
+		osc_packet(r.p, size, depth + 1);
+		r.p += size;
+	}
+}
+
+static void read_osc() {
+	int n = recv(ctl.osc_fd, ctl.packet, sizeof(ctl.packet), 0);
+	if(n <= 0)
+		return;
+	refresh_csts();
+	ctl.error[0] = 0;
+	osc_packet((unsigned char*)ctl.packet, n, 0);
+	if(send_batch())
+		printf("Control: %s\n", ctl.error);
+}
+
+/*************************/
+
+static void *control_loop(void *data) {
+	(void)data;
+	struct pollfd fds[3 + CONTROL_MAX_CLIENTS];
+	for(;;) {
+		int n = 0;
+		fds[n++] = (struct pollfd){ctl.wake[0], POLLIN, 0};
+		fds[n++] = (struct pollfd){ctl.listen_fd, POLLIN, 0};
+		fds[n++] = (struct pollfd){ctl.osc_fd, POLLIN, 0};
+		for(int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+			fds[n++] = (struct pollfd){ctl.clients[i].fd, POLLIN, 0};
+		// Negative fds are skipped
+		if(poll(fds, n, -1) < 0) {
+			if(EINTR == errno) continue;
+			printf("ERROR: Control server poll failed. %s\n", strerror(errno));
+			return NULL;
+		}
+		if(fds[0].revents)
+			return NULL;
+		if(fds[1].revents & POLLIN)
+			accept_client();
+		if(fds[2].revents & POLLIN)
+			read_osc();
+		for(int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+			client *c = &ctl.clients[i];
+			if(c->fd >= 0 && fds[3 + i].revents && read_client(c)) {
+				close(c->fd);
+				c->fd = -1;
+			}
+		}
+	}
+}
+
+static int open_socket(const char *path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		printf("ERROR: Control socket path %s is too long\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	// Left over from a run that didn't stop cleanly
+	unlink(path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 8)) {
+		printf("ERROR: Can't listen on %s. %s\n", path, strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	printf("Control: listening on %s\n", path);
+	return fd;
+}
+
+static int open_osc(int port) {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+		printf("ERROR: Can't listen for OSC on port %i. %s\n", port, strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	// Room for bursts while the thread catches up
+	int size = 1 << 20;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	printf("Control: OSC on udp port %i of localhost\n", port);
+	return fd;
+}
+
+int control_start(const char *socket_path, int osc_port) {
+	if(!socket_path && !osc_port)
+		return 0;
+	for(int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+		ctl.clients[i].fd = -1;
+	if(socket_path && (ctl.listen_fd = open_socket(socket_path)) < 0)
+		return -1;
+	if(socket_path)
+		ctl.path = strdup(socket_path);
+	if(osc_port && (ctl.osc_fd = open_osc(osc_port)) < 0) {
+		control_stop();
+		return -1;
+	}
+	if(pipe(ctl.wake) || pthread_create(&ctl.thread, NULL, control_loop, NULL)) {
+		printf("ERROR: Can't start the control server\n");
+		control_stop();
+		return -1;
+	}
+	ctl.running = 1;
+	return 0;
+}
+
+void control_stop() {
+	if(ctl.running) {
+		if(1 != write(ctl.wake[1], "", 1))
+			printf("ERROR: Can't stop the control server\n");
+		pthread_join(ctl.thread, NULL);
+		ctl.running = 0;
+		for(int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+			if(ctl.clients[i].fd >= 0)
+				close(ctl.clients[i].fd);
+	}
+	int *fds[] = {&ctl.listen_fd, &ctl.osc_fd, &ctl.wake[0], &ctl.wake[1]};
+	for(int i = 0; i < 4; i++)
+		if(*fds[i] >= 0) {
+			close(*fds[i]);
+			*fds[i] = -1;
+		}
+	if(ctl.path) {
+		unlink(ctl.path);
+		free(ctl.path);
+		ctl.path = NULL;
+	}
+	free(ctl.csts);
+	ctl.csts = NULL;
+}
+
+static sigset_t stop_signals() {
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	return set;
+}
+
+void control_block_signals() {
+	sigset_t set = stop_signals();
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+void control_wait() {
+	sigset_t set = stop_signals();
+	int sig;
+	sigwait(&set, &sig);
+}
@@ -0,0 +1,36 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+/* Control server for driving the synth from other programs, e.g. when it
+ * runs headless with --daemon. It listens on a UNIX stream socket and for
+ * OSC over UDP on localhost, on a thread of its own. Each message is a
+ * batch of changes that the audio thread picks up at the same frame,
+ * through a wait-free queue of their own, see queue_remote_params.
+ *
+ * CSTs are addressed by module id, or by label for those that have one.
+ * The socket takes lines of text:
+ *   set TARGET VALUE [TARGET VALUE ...]  labels with spaces in "quotes"
+ *   smooth TARGET SECS [TARGET SECS ...] ramp time for later values, 0 jumps
+ *   note NOTE [VELOCITY]                 velocity 0 -> 1, default 1
+ *   off NOTE
+ *   list                                 "ID TYPE LABEL" per CST, then a blank line
+ * and otherwise only replies to errors, with a line starting "ERROR". A
+ * message with any error is dropped whole. NDS CSTs never ramp. OSC takes
+ * /cst/TARGET VALUE, /smooth/TARGET SECS, /set TARGET VALUE ...,
+ * /note NOTE [VELOCITY] and /off NOTE, values as int32 or float32. Every
+ * message in a bundle goes in one batch. */
+
+#define CONTROL_MAX_CLIENTS 16
+#define CONTROL_LINE_LEN 4096 // longest line on the socket
+#define CONTROL_MAX_BATCH 256 // changes in one message
+#define CONTROL_PACKET_LEN 65536 // biggest OSC packet
+
+// NULL path or 0 port for none, -1 if either can't be opened
+int control_start(const char *socket_path, int osc_port);
+void control_stop();
+
+/* Headless runs call control_block_signals before starting any threads,
+ * then control_wait returns on SIGINT or SIGTERM. */
+void control_block_signals();
+void control_wait();
+#endif
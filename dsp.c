@@ -0,0 +1,479 @@
+#include "dsp.h"
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+#define PHASE_ONE 4294967296.0f // one cycle of the phase accumulator
+#define PHASE_TO_FLOAT (1.0f / 16777216.0f) // top 24 bits to [0, 1)
+
+// Taylor series of sin(2 pi z), good to float precision for |z| <= 0.25
+#define SIN_C1 6.28318530718f
+#define SIN_C3 -41.3417022404f
+#define SIN_C5 81.6052492761f
+#define SIN_C7 -76.7058597531f
+#define SIN_C9 42.0586939449f
+#define SIN_C11 -15.0946425768f
+
+/*************************/
+/* Scalar versions, also used for the tails of the vector loops */
+static inline uint32_t phase_inc(float freq, float inv_rate) {
+	float r = freq * inv_rate;
+	// Fold to [-0.5, 0.5) cycles per sample so it fits in 32 bits
+	r = r - floorf(r + 0.5f);
+	return (uint32_t)(int32_t)(r * PHASE_ONE);
+}
+
+static inline float sine(float ph) {
+	float z = ph - (ph >= 0.5f ? 1.0f : 0.0f);
+	float a = fabsf(z);
+	float b = 0.5f - a;
+	a = a < b ? a : b;
+	float s = a * a;
+	float y = a * (SIN_C1 + s * (SIN_C3 + s * (SIN_C5 + s * (SIN_C7 +
+						s * (SIN_C9 + s * SIN_C11)))));
+	if(z < 0.0f)
+		y = -y;
+	return 0.5f + 0.5f * y;
+}
+
+// One step of a generator, as two 16 bit uniforms' difference in (-1, 1)
+static inline float tpdf(uint32_t *x) {
+	uint32_t r = *x;
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	*x = r;
+	return (float)((int32_t)(r & 0xffff) - (int32_t)(r >> 16)) * (1.0f / 65536.0f);
+}
+
+static inline int32_t to_int(float x, float scale, float d) {
+	float y = x * scale + d;
+	y = y < scale ? y : scale;
+	y = y > -scale ? y : -scale;
+	return (int32_t)lrintf(y);
+}
+
+static inline float triangle(float ph) { return 1.0f - fabsf(2.0f * ph - 1.0f); }
+static inline float square(float ph) { return ph >= 0.25f && ph < 0.75f; }
+
+static inline float flush(float x) { return fabsf(x) < DSP_LADDER_TINY ? 0.0f : x; }
+
+/* One frame of the ladder, s as in state for a single lane. k is 1 - c
+ * and nc is -c, the feedback has always been worked out in double. */
+static inline void ladder(float *s, float in, float c, float k, double nc, float r) {
+	float a0 = s[0], a1 = s[1], a2 = s[2], a3 = s[3];
+	s[3] = a2 * c + s[7] * k;
+	s[2] = a1 * c + s[6] * k;
+	s[1] = a0 * c + s[5] * k;
+	s[0] = flush(in * c + s[4] * k + (double)(a3 * r) * nc);
+	s[4] = a0;
+	s[5] = a1;
+	s[6] = a2;
+	s[7] = a3;
+}
+
+// Whether width lanes from v keep the same cut and res for all n frames
+static int ladder_constant(const float *cut, const float *res, int n, int lanes,
+		int v, int width) {
+	for(int f = 1; f < n; f++)
+		for(int i = v; i < v + width; i++)
+			if(cut[f * lanes + i] != cut[i] || res[f * lanes + i] != res[i])
+				return 0;
+	return 1;
+}
+
+/*************************/
+#ifdef __SSE2__
+// Exact floor for |x| < 2^31
+static inline __m128 floor_ps(__m128 x) {
+	__m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+	return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, x), _mm_set1_ps(1.0f)));
+}
+
+static inline __m128 tpdf_ps(__m128i *x) {
+	__m128i r = *x;
+	r = _mm_xor_si128(r, _mm_slli_epi32(r, 13));
+	r = _mm_xor_si128(r, _mm_srli_epi32(r, 17));
+	r = _mm_xor_si128(r, _mm_slli_epi32(r, 5));
+	*x = r;
+	__m128i d = _mm_sub_epi32(_mm_and_si128(r, _mm_set1_epi32(0xffff)),
+			_mm_srli_epi32(r, 16));
+	return _mm_mul_ps(_mm_cvtepi32_ps(d), _mm_set1_ps(1.0f / 65536.0f));
+}
+
+// Scale, dither, clip and round four samples, cvtps rounds to nearest like lrintf
+static inline __m128i to_int_ps(__m128 x, __m128 scale, __m128 d) {
+	__m128 y = _mm_add_ps(_mm_mul_ps(x, scale), d);
+	y = _mm_min_ps(y, scale);
+	y = _mm_max_ps(y, _mm_sub_ps(_mm_setzero_ps(), scale));
+	return _mm_cvtps_epi32(y);
+}
+
+// flush() on four floats, NaNs go through like they do there
+static inline __m128 flush_ps(__m128 x) {
+	__m128 a = _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+	return _mm_andnot_ps(_mm_cmplt_ps(a, _mm_set1_ps(DSP_LADDER_TINY)), x);
+}
+
+// Coefficients of ladder_ps for a cut and res
+typedef struct ladder_coef {
+	__m128 c, k, r;
+	__m128d nc_lo, nc_hi; // -c as two pairs of doubles
+} ladder_coef;
+static inline void ladder_coef_ps(ladder_coef *q, __m128 c, __m128 r) {
+	// xor so the sign of 0 matches the scalar code
+	__m128d sign = _mm_set1_pd(-0.0);
+	q->c = c;
+	q->k = _mm_sub_ps(_mm_set1_ps(1.0f), c);
+	q->r = r;
+	q->nc_lo = _mm_xor_pd(_mm_cvtps_pd(c), sign);
+	q->nc_hi = _mm_xor_pd(_mm_cvtps_pd(_mm_movehl_ps(c, c)), sign);
+}
+
+// ladder() on four lanes, a is s(n) and b s(n-1) of each stage
+static inline __m128 ladder_ps(__m128 *a, __m128 *b, __m128 in, ladder_coef *q) {
+	__m128 a3 = _mm_add_ps(_mm_mul_ps(a[2], q->c), _mm_mul_ps(b[3], q->k));
+	__m128 a2 = _mm_add_ps(_mm_mul_ps(a[1], q->c), _mm_mul_ps(b[2], q->k));
+	__m128 a1 = _mm_add_ps(_mm_mul_ps(a[0], q->c), _mm_mul_ps(b[1], q->k));
+	in = _mm_add_ps(_mm_mul_ps(in, q->c), _mm_mul_ps(b[0], q->k));
+	__m128 fb = _mm_mul_ps(a[3], q->r);
+	__m128d lo = _mm_add_pd(_mm_cvtps_pd(in),
+			_mm_mul_pd(_mm_cvtps_pd(fb), q->nc_lo));
+	__m128d hi = _mm_add_pd(_mm_cvtps_pd(_mm_movehl_ps(in, in)),
+			_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(fb, fb)), q->nc_hi));
+	for(int i = 0; i < DSP_LADDER_STAGES; i++)
+		b[i] = a[i];
+	a[0] = flush_ps(_mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi)));
+	a[1] = a1;
+	a[2] = a2;
+	a[3] = a3;
+	return a3;
+}
+#endif
+
+void dsp_phase(uint32_t *state, float *phase_out, const float *freq,
+		float inv_rate, int n) {
+	uint32_t p = *state;
+	int f = 0;
+
+#ifdef __SSE2__
+	__m128 vinv = _mm_set1_ps(inv_rate);
+	__m128 half = _mm_set1_ps(0.5f);
+	__m128 one = _mm_set1_ps(PHASE_ONE);
+	__m128 to_float = _mm_set1_ps(PHASE_TO_FLOAT);
+	__m128i base = _mm_set1_epi32((int32_t)p);
+	for(; f + 4 <= n; f += 4) {
+		__m128 r = _mm_mul_ps(_mm_loadu_ps(freq + f), vinv);
+		r = _mm_sub_ps(r, floor_ps(_mm_add_ps(r, half)));
+		__m128i inc = _mm_cvttps_epi32(_mm_mul_ps(r, one));
+		// Running sum across the four lanes
+		inc = _mm_add_epi32(inc, _mm_slli_si128(inc, 4));
+		inc = _mm_add_epi32(inc, _mm_slli_si128(inc, 8));
+		__m128i ph = _mm_add_epi32(base, inc);
+		_mm_storeu_ps(phase_out + f,
+				_mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(ph, 8)), to_float));
+		base = _mm_shuffle_epi32(ph, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	p = (uint32_t)_mm_cvtsi128_si32(base);
+#endif
+
+	for(; f < n; f++) {
+		p += phase_inc(freq[f], inv_rate);
+		phase_out[f] = (float)(p >> 8) * PHASE_TO_FLOAT;
+	}
+	*state = p;
+}
+
+void dsp_phase_lanes(uint32_t *state, float *phase_out, const float *freq,
+		float inv_rate, int n, int lanes) {
+	int v = 0;
+
+#ifdef __SSE2__
+	__m128 vinv = _mm_set1_ps(inv_rate);
+	__m128 half = _mm_set1_ps(0.5f);
+	__m128 one = _mm_set1_ps(PHASE_ONE);
+	__m128 to_float = _mm_set1_ps(PHASE_TO_FLOAT);
+	for(; v + 4 <= lanes; v += 4) {
+		__m128i p = _mm_loadu_si128((__m128i*)(state + v));
+		for(int f = 0; f < n; f++) {
+			__m128 r = _mm_mul_ps(_mm_loadu_ps(freq + f * lanes + v), vinv);
+			r = _mm_sub_ps(r, floor_ps(_mm_add_ps(r, half)));
+			p = _mm_add_epi32(p, _mm_cvttps_epi32(_mm_mul_ps(r, one)));
+			_mm_storeu_ps(phase_out + f * lanes + v,
+					_mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(p, 8)), to_float));
+		}
+		_mm_storeu_si128((__m128i*)(state + v), p);
+	}
+#endif
+
+	for(; v < lanes; v++) {
+		uint32_t p = state[v];
+		for(int f = 0; f < n; f++) {
+			p += phase_inc(freq[f * lanes + v], inv_rate);
+			phase_out[f * lanes + v] = (float)(p >> 8) * PHASE_TO_FLOAT;
+		}
+		state[v] = p;
+	}
+}
+
+void dsp_sine(float *out, const float *phase, int n) {
+	int f = 0;
+
+#if defined(__AVX__)
+	__m256 half = _mm256_set1_ps(0.5f);
+	__m256 one = _mm256_set1_ps(1.0f);
+	__m256 sign = _mm256_set1_ps(-0.0f);
+	for(; f + 8 <= n; f += 8) {
+		__m256 ph = _mm256_loadu_ps(phase + f);
+		__m256 z = _mm256_sub_ps(ph,
+				_mm256_and_ps(_mm256_cmp_ps(ph, half, _CMP_GE_OQ), one));
+		__m256 a = _mm256_andnot_ps(sign, z);
+		a = _mm256_min_ps(a, _mm256_sub_ps(half, a));
+		__m256 s = _mm256_mul_ps(a, a);
+		__m256 y = _mm256_add_ps(_mm256_set1_ps(SIN_C9),
+				_mm256_mul_ps(s, _mm256_set1_ps(SIN_C11)));
+		y = _mm256_add_ps(_mm256_set1_ps(SIN_C7), _mm256_mul_ps(s, y));
+		y = _mm256_add_ps(_mm256_set1_ps(SIN_C5), _mm256_mul_ps(s, y));
+		y = _mm256_add_ps(_mm256_set1_ps(SIN_C3), _mm256_mul_ps(s, y));
+		y = _mm256_add_ps(_mm256_set1_ps(SIN_C1), _mm256_mul_ps(s, y));
+		y = _mm256_mul_ps(a, y);
+		y = _mm256_xor_ps(y, _mm256_and_ps(sign, z));
+		_mm256_storeu_ps(out + f, _mm256_add_ps(half, _mm256_mul_ps(half, y)));
+	}
+#elif defined(__SSE2__)
+	__m128 half = _mm_set1_ps(0.5f);
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 sign = _mm_set1_ps(-0.0f);
+	for(; f + 4 <= n; f += 4) {
+		__m128 ph = _mm_loadu_ps(phase + f);
+		__m128 z = _mm_sub_ps(ph, _mm_and_ps(_mm_cmpge_ps(ph, half), one));
+		__m128 a = _mm_andnot_ps(sign, z);
+		a = _mm_min_ps(a, _mm_sub_ps(half, a));
+		__m128 s = _mm_mul_ps(a, a);
+		__m128 y = _mm_add_ps(_mm_set1_ps(SIN_C9),
+				_mm_mul_ps(s, _mm_set1_ps(SIN_C11)));
+		y = _mm_add_ps(_mm_set1_ps(SIN_C7), _mm_mul_ps(s, y));
+		y = _mm_add_ps(_mm_set1_ps(SIN_C5), _mm_mul_ps(s, y));
+		y = _mm_add_ps(_mm_set1_ps(SIN_C3), _mm_mul_ps(s, y));
+		y = _mm_add_ps(_mm_set1_ps(SIN_C1), _mm_mul_ps(s, y));
+		y = _mm_mul_ps(a, y);
+		y = _mm_xor_ps(y, _mm_and_ps(sign, z));
+		_mm_storeu_ps(out + f, _mm_add_ps(half, _mm_mul_ps(half, y)));
+	}
+#endif
+
+	for(; f < n; f++)
+		out[f] = sine(phase[f]);
+}
+
+void dsp_triangle(float *out, const float *phase, int n) {
+	int f = 0;
+
+#if defined(__AVX__)
+	__m256 one = _mm256_set1_ps(1.0f);
+	__m256 two = _mm256_set1_ps(2.0f);
+	__m256 sign = _mm256_set1_ps(-0.0f);
+	for(; f + 8 <= n; f += 8) {
+		__m256 t = _mm256_sub_ps(_mm256_mul_ps(two, _mm256_loadu_ps(phase + f)), one);
+		_mm256_storeu_ps(out + f, _mm256_sub_ps(one, _mm256_andnot_ps(sign, t)));
+	}
+#elif defined(__SSE2__)
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 two = _mm_set1_ps(2.0f);
+	__m128 sign = _mm_set1_ps(-0.0f);
+	for(; f + 4 <= n; f += 4) {
+		__m128 t = _mm_sub_ps(_mm_mul_ps(two, _mm_loadu_ps(phase + f)), one);
+		_mm_storeu_ps(out + f, _mm_sub_ps(one, _mm_andnot_ps(sign, t)));
+	}
+#endif
+
+	for(; f < n; f++)
+		out[f] = triangle(phase[f]);
+}
+
+void dsp_square(float *out, const float *phase, int n) {
+	int f = 0;
+
+#if defined(__AVX__)
+	__m256 lo = _mm256_set1_ps(0.25f);
+	__m256 hi = _mm256_set1_ps(0.75f);
+	__m256 one = _mm256_set1_ps(1.0f);
+	for(; f + 8 <= n; f += 8) {
+		__m256 ph = _mm256_loadu_ps(phase + f);
+		__m256 in = _mm256_and_ps(_mm256_cmp_ps(ph, lo, _CMP_GE_OQ),
+				_mm256_cmp_ps(ph, hi, _CMP_LT_OQ));
+		_mm256_storeu_ps(out + f, _mm256_and_ps(in, one));
+	}
+#elif defined(__SSE2__)
+	__m128 lo = _mm_set1_ps(0.25f);
+	__m128 hi = _mm_set1_ps(0.75f);
+	__m128 one = _mm_set1_ps(1.0f);
+	for(; f + 4 <= n; f += 4) {
+		__m128 ph = _mm_loadu_ps(phase + f);
+		__m128 in = _mm_and_ps(_mm_cmpge_ps(ph, lo), _mm_cmplt_ps(ph, hi));
+		_mm_storeu_ps(out + f, _mm_and_ps(in, one));
+	}
+#endif
+
+	for(; f < n; f++)
+		out[f] = square(phase[f]);
+}
+
+void dsp_dither_init(uint32_t *dither) {
+	for(int i = 0; i < DSP_DITHER_LANES; i++)
+		dither[i] = 0x9e3779b9u * (i + 1);
+}
+
+void dsp_to_s16(int16_t *out, int stride, const float *in, int n,
+		uint32_t *dither) {
+	int f = 0;
+
+#ifdef __SSE2__
+	if(1 == stride) {
+		__m128 scale = _mm_set1_ps(DSP_S16_SCALE);
+		__m128 d = _mm_setzero_ps();
+		__m128i x = dither ? _mm_loadu_si128((__m128i*)dither) : _mm_setzero_si128();
+		for(; f + 4 <= n; f += 4) {
+			if(dither)
+				d = tpdf_ps(&x);
+			__m128i v = to_int_ps(_mm_loadu_ps(in + f), scale, d);
+			_mm_storel_epi64((__m128i*)(out + f), _mm_packs_epi32(v, v));
+		}
+		if(dither)
+			_mm_storeu_si128((__m128i*)dither, x);
+	}
+#endif
+
+	for(; f < n; f++)
+		out[f * stride] = (int16_t)to_int(in[f], DSP_S16_SCALE,
+				dither ? tpdf(&dither[f % DSP_DITHER_LANES]) : 0.0f);
+}
+
+void dsp_to_s32(int32_t *out, int stride, const float *in, int n,
+		float scale, uint32_t *dither) {
+	int f = 0;
+
+#ifdef __SSE2__
+	if(1 == stride) {
+		__m128 vscale = _mm_set1_ps(scale);
+		__m128 d = _mm_setzero_ps();
+		__m128i x = dither ? _mm_loadu_si128((__m128i*)dither) : _mm_setzero_si128();
+		for(; f + 4 <= n; f += 4) {
+			if(dither)
+				d = tpdf_ps(&x);
+			_mm_storeu_si128((__m128i*)(out + f),
+					to_int_ps(_mm_loadu_ps(in + f), vscale, d));
+		}
+		if(dither)
+			_mm_storeu_si128((__m128i*)dither, x);
+	}
+#endif
+
+	for(; f < n; f++)
+		out[f * stride] = to_int(in[f], scale,
+				dither ? tpdf(&dither[f % DSP_DITHER_LANES]) : 0.0f);
+}
+
+void dsp_ladder(float *state, float *out, const float *sig, const float *cut,
+		const float *res, int n, int lanes) {
+	int v = 0;
+
+#ifdef __SSE2__
+	for(; v + 4 <= lanes; v += 4) {
+		__m128 a[DSP_LADDER_STAGES], b[DSP_LADDER_STAGES];
+		for(int i = 0; i < DSP_LADDER_STAGES; i++) {
+			a[i] = _mm_loadu_ps(state + i * lanes + v);
+			b[i] = _mm_loadu_ps(state + (DSP_LADDER_STAGES + i) * lanes + v);
+		}
+		int constant = ladder_constant(cut, res, n, lanes, v, 4);
+		ladder_coef q;
+		ladder_coef_ps(&q, _mm_loadu_ps(cut + v), _mm_loadu_ps(res + v));
+		for(int f = 0; f < n; f++) {
+			int x = f * lanes + v;
+			if(!constant && f)
+				ladder_coef_ps(&q, _mm_loadu_ps(cut + x), _mm_loadu_ps(res + x));
+			_mm_storeu_ps(out + x, ladder_ps(a, b, _mm_loadu_ps(sig + x), &q));
+		}
+		for(int i = 0; i < DSP_LADDER_STAGES; i++) {
+			_mm_storeu_ps(state + i * lanes + v, a[i]);
+			_mm_storeu_ps(state + (DSP_LADDER_STAGES + i) * lanes + v, b[i]);
+		}
+	}
+#endif
+
+	for(; v < lanes; v++) {
+		float s[2 * DSP_LADDER_STAGES];
+		for(int i = 0; i < 2 * DSP_LADDER_STAGES; i++)
+			s[i] = state[i * lanes + v];
+		if(ladder_constant(cut, res, n, lanes, v, 1)) {
+			float c = cut[v], k = 1.0f - c, r = res[v];
+			double nc = -(double)c;
+			for(int f = 0; f < n; f++) {
+				ladder(s, sig[f * lanes + v], c, k, nc, r);
+				out[f * lanes + v] = s[DSP_LADDER_STAGES - 1];
+			}
+		} else {
+			for(int f = 0; f < n; f++) {
+				float c = cut[f * lanes + v];
+				ladder(s, sig[f * lanes + v], c, 1.0f - c, -(double)c, res[f * lanes + v]);
+				out[f * lanes + v] = s[DSP_LADDER_STAGES - 1];
+			}
+		}
+		for(int i = 0; i < 2 * DSP_LADDER_STAGES; i++)
+			state[i * lanes + v] = s[i];
+	}
+}
+
+#ifdef __SSE2__
+// Element i of each of four mono buffers as a vector, x[0] lowest
+static inline __m128 gather_ps(const float **x, int i) {
+	return _mm_set_ps(x[3][i], x[2][i], x[1][i], x[0][i]);
+}
+#endif
+
+void dsp_ladder_instances(float **state, float **out, const float **sig,
+		const float **cut, const float **res, int n, int count) {
+	int v = 0;
+
+#ifdef __SSE2__
+	for(; v + 4 <= count; v += 4) {
+		__m128 a[DSP_LADDER_STAGES], b[DSP_LADDER_STAGES];
+		float **st = state + v;
+		for(int i = 0; i < DSP_LADDER_STAGES; i++) {
+			a[i] = _mm_set_ps(st[3][i], st[2][i], st[1][i], st[0][i]);
+			b[i] = _mm_set_ps(st[3][DSP_LADDER_STAGES + i], st[2][DSP_LADDER_STAGES + i],
+					st[1][DSP_LADDER_STAGES + i], st[0][DSP_LADDER_STAGES + i]);
+		}
+		int constant = 1;
+		for(int i = v; i < v + 4; i++)
+			constant &= ladder_constant(cut[i], res[i], n, 1, 0, 1);
+		ladder_coef q;
+		ladder_coef_ps(&q, gather_ps(cut + v, 0), gather_ps(res + v, 0));
+		float o[4];
+		for(int f = 0; f < n; f++) {
+			if(!constant && f)
+				ladder_coef_ps(&q, gather_ps(cut + v, f), gather_ps(res + v, f));
+			_mm_storeu_ps(o, ladder_ps(a, b, gather_ps(sig + v, f), &q));
+			for(int i = 0; i < 4; i++)
+				out[v + i][f] = o[i];
+		}
+		float sa[DSP_LADDER_STAGES][4], sb[DSP_LADDER_STAGES][4];
+		for(int i = 0; i < DSP_LADDER_STAGES; i++) {
+			_mm_storeu_ps(sa[i], a[i]);
+			_mm_storeu_ps(sb[i], b[i]);
+		}
+		for(int k = 0; k < 4; k++)
+			for(int i = 0; i < DSP_LADDER_STAGES; i++) {
+				st[k][i] = sa[i][k];
+				st[k][DSP_LADDER_STAGES + i] = sb[i][k];
+			}
+	}
+#endif
+
+	for(; v < count; v++)
+		dsp_ladder(state[v], out[v], sig[v], cut[v], res[v], n, 1);
+}
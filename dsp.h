@@ -0,0 +1,56 @@
+#ifndef DSP_H
+#define DSP_H
+#include <float.h>
+#include <stdint.h>
+
+/* Block DSP kernels. Each has an SSE2 version, an AVX version where it
+ * pays (build with make native), and a plain C fallback that does the
+ * same float operations in the same order, so results are bit identical
+ * whichever path runs and however a signal is cut into blocks. */
+
+/* Phase accumulator: a 32 bit fixed point fraction of a cycle that wraps
+ * by itself. Integer adds are exact, so vectorising the running sum
+ * doesn't change the result. phase_out gets the phase in [0, 1). */
+void dsp_phase(uint32_t *state, float *phase_out, const float *freq,
+		float inv_rate, int n);
+
+/* The same for several voices interleaved frame by frame, with one phase
+ * per voice in state. lanes must be a multiple of 4. */
+void dsp_phase_lanes(uint32_t *state, float *phase_out, const float *freq,
+		float inv_rate, int n, int lanes);
+
+// Waveforms from a [0, 1) phase, all in 0 -> 1
+void dsp_sine(float *out, const float *phase, int n);
+void dsp_triangle(float *out, const float *phase, int n);
+void dsp_square(float *out, const float *phase, int n);
+
+/* Four pole ladder lowpass over lanes voices interleaved frame by frame.
+ * state holds s(n) of each stage then s(n-1), lanes values each. When a
+ * block's cut and res don't change the coefficients are worked out once.
+ * The first stage, where the feedback comes in, is flushed to 0 when it
+ * goes denormal, so a filter ringing down to silence drains to 0 rather
+ * than crawling through denormals. */
+#define DSP_LADDER_STAGES 4
+#define DSP_LADDER_TINY FLT_MIN // smallest normal float
+void dsp_ladder(float *state, float *out, const float *sig, const float *cut,
+		const float *res, int n, int lanes);
+/* The same for count separate mono filters, each with its own state and
+ * buffers, run four at a time in the lanes of one vector. */
+void dsp_ladder_instances(float **state, float **out, const float **sig,
+		const float **cut, const float **res, int n, int count);
+
+/* Float to integer samples for the sound card, with out every stride
+ * samples. In is scaled by scale, clipped to +-scale and rounded to
+ * nearest. With dither non-NULL, +-1 LSB of triangular noise is added
+ * before rounding from DSP_DITHER_LANES xorshift generators, one per
+ * sample in turn. S24 goes through dsp_to_s32 with a 24 bit scale. */
+#define DSP_DITHER_LANES 4
+#define DSP_S16_SCALE 32767.0f
+#define DSP_S24_SCALE 8388607.0f
+#define DSP_S32_SCALE 2147483520.0f // largest float below 2^31
+void dsp_dither_init(uint32_t *dither);
+void dsp_to_s16(int16_t *out, int stride, const float *in, int n,
+		uint32_t *dither);
+void dsp_to_s32(int32_t *out, int stride, const float *in, int n,
+		float scale, uint32_t *dither);
+#endif
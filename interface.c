@@ -1,9 +1,12 @@
 #include <gtk/gtk.h>
 #include <pthread.h>
+#include <sched.h>
 #include <math.h>
 #include <stdio.h>
 
 #include "synth.h"
+#include "control.h"
+#include "tap.h"
 
 typedef struct freq_adjustment {
 	GtkAdjustment *adj;
@@ -11,6 +14,11 @@ typedef struct freq_adjustment {
 	int mod_id;
 } freq_adjustment;
 
+// The controls go when a reload replaces them
+static void free_adjustment(GtkWidget *widget, gpointer data) {
+	free(data);
+}
+
 float logmap(float min_in, float max_in, float min_out, float max_out, float value) {
 	float unit_val = (value - min_in) / (max_in - min_in);
 	float min_log10 = log10(min_out);
@@ -48,6 +56,7 @@ GtkWidget *high_freq_scale(int mod_id) {
 	high_freq_scale_set_value(NULL, freq_adj);
 
 	g_signal_connect(adj, "value-changed", G_CALLBACK(high_freq_scale_set_value), freq_adj);
+	g_signal_connect(box, "destroy", G_CALLBACK(free_adjustment), freq_adj);
 	return (GtkWidget*)box;
 }
 
@@ -81,6 +90,7 @@ GtkWidget *low_freq_scale(int mod_id) {
 	low_freq_scale_set_value(NULL, freq_adj);
 
 	g_signal_connect(adj, "value-changed", G_CALLBACK(low_freq_scale_set_value), freq_adj);
+	g_signal_connect(box, "destroy", G_CALLBACK(free_adjustment), freq_adj);
 	gtk_adjustment_set_value(adj, get_mod_cst_init_value(mod_id));
 	return (GtkWidget*)box;
 }
@@ -115,16 +125,118 @@ GtkWidget *percentage_scale(int mod_id) {
 	percentage_scale_set_value(NULL, freq_adj);
 
 	g_signal_connect(adj, "value-changed", G_CALLBACK(percentage_scale_set_value), freq_adj);
+	g_signal_connect(box, "destroy", G_CALLBACK(free_adjustment), freq_adj);
 	gtk_adjustment_set_value(adj, get_mod_cst_init_value(mod_id) * 100.);
 	return (GtkWidget*)box;
 }
 
+// One octave of note buttons for patches with a KEY module
+static void key_pressed(GtkButton *button, gpointer data) {
+	synth_note_on(GPOINTER_TO_INT(data), 1.0);
+}
+static void key_released(GtkButton *button, gpointer data) {
+	synth_note_off(GPOINTER_TO_INT(data));
+}
+
+GtkWidget *keyboard(int first_note) {
+	static const char *names[12] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+	GtkBox *box = (GtkBox*)gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 2);
+
+	for(int i = 0; i <= 12; i++) {
+		GtkWidget *key = gtk_button_new_with_label(names[i % 12]);
+		gtk_box_pack_start(box, key, 1, 1, 0);
+		g_signal_connect(key, "pressed", G_CALLBACK(key_pressed), GINT_TO_POINTER(first_note + i));
+		g_signal_connect(key, "released", G_CALLBACK(key_released), GINT_TO_POINTER(first_note + i));
+	}
+	return (GtkWidget*)box;
+}
+
+// DSP load and xruns, read from the audio thread's stats without locking
+static gboolean update_stats_label(gpointer data) {
+	static char text[128];
+	synth_stats *stats = get_synth_stats(), c;
+	stats_read(stats, &c, NULL, 0);
+	if(!c.rate || !c.blocks)
+		return G_SOURCE_CONTINUE;
+
+	double us = stats_ns_per_tick(stats) / 1000.;
+	double budget = 1e6 * c.block_size / c.rate;
+	int len = snprintf(text, sizeof(text), "DSP %.1f%%, worst block %.1f%%, %llu xruns",
+			100. * c.block_last * us / budget, 100. * c.block_worst * us / budget,
+			(unsigned long long)c.xruns);
+	if(c.dropped)
+		snprintf(text + len, sizeof(text) - len, ", %llu frames dropped",
+				(unsigned long long)c.dropped);
+	gtk_label_set_text((GtkLabel*)data, text);
+	return G_SOURCE_CONTINUE;
+}
+
 /*********************************************************/
-static void on_app_activate(GApplication *app, gpointer data) {
-  GtkWidget *window = gtk_application_window_new(GTK_APPLICATION(app));
+// Pull our own options out of argv so GTK doesn't reject them
+int parse_args(int argc, char *argv[], synth_thread_data *synth) {
+	int out = 1;
+	for(int i = 1; i < argc; i++) {
+		if(0 == strcmp(argv[i], "--block") && i + 1 < argc)
+			synth->block_size = atoi(argv[++i]);
+		else if(0 == strcmp(argv[i], "--control-period") && i + 1 < argc)
+			synth->control_period = atoi(argv[++i]);
+		else if(0 == strcmp(argv[i], "--layout") && i + 1 < argc)
+			synth->layout = argv[++i];
+		else if(0 == strcmp(argv[i], "--cache") && i + 1 < argc)
+			synth->cache = argv[++i];
+		else if(0 == strcmp(argv[i], "--no-cache"))
+			synth->cache = "";
+		else if(0 == strcmp(argv[i], "--no-watch"))
+			synth->no_watch = 1;
+		else if(0 == strcmp(argv[i], "--no-optimize"))
+			synth->no_optimize = 1;
+		else if(0 == strcmp(argv[i], "--dump-plan"))
+			synth->dump_plan = 1;
+		else if(0 == strcmp(argv[i], "--native"))
+			synth->native = 1;
+		else if(0 == strcmp(argv[i], "--channels") && i + 1 < argc)
+			synth->channels = atoi(argv[++i]);
+		else if(0 == strcmp(argv[i], "--render") && i + 1 < argc)
+			synth->render_path = argv[++i];
+		else if(0 == strcmp(argv[i], "--seconds") && i + 1 < argc)
+			synth->render_secs = atof(argv[++i]);
+		else if(0 == strcmp(argv[i], "--voices") && i + 1 < argc)
+			synth->voices = atoi(argv[++i]);
+		else if(0 == strcmp(argv[i], "--threads") && i + 1 < argc)
+			synth->threads = atoi(argv[++i]);
+		else if(0 == strcmp(argv[i], "--period") && i + 1 < argc)
+			synth->period = atoi(argv[++i]);
+		else if(0 == strcmp(argv[i], "--periods") && i + 1 < argc)
+			synth->periods = atoi(argv[++i]);
+		else if(0 == strcmp(argv[i], "--rt-priority") && i + 1 < argc)
+			synth->rt_priority = atoi(argv[++i]);
+		else if(0 == strcmp(argv[i], "--smooth") && i + 1 < argc)
+			synth->smooth_secs = atof(argv[++i]);
+		else if(0 == strcmp(argv[i], "--dither"))
+			synth->dither = 1;
+		else if(0 == strcmp(argv[i], "--stats") && i + 1 < argc)
+			synth->stats_path = argv[++i];
+		else if(0 == strcmp(argv[i], "--stats-interval") && i + 1 < argc)
+			synth->stats_secs = atof(argv[++i]);
+		else if(0 == strcmp(argv[i], "--latency") && i + 1 < argc)
+			synth->latency_path = argv[++i];
+		else if(0 == strcmp(argv[i], "--daemon"))
+			synth->daemon = 1;
+		else if(0 == strcmp(argv[i], "--socket") && i + 1 < argc)
+			synth->control_socket = argv[++i];
+		else if(0 == strcmp(argv[i], "--osc") && i + 1 < argc)
+			synth->osc_port = atoi(argv[++i]);
+		else
+			argv[out++] = argv[i];
+	}
+	argv[out] = NULL;
+	return out;
+}
 
+// A control for each CST, and a keyboard if the patch plays notes
+static GtkWidget *patch_controls() {
 	GtkBox *vbox = (GtkBox*)gtk_box_new(GTK_ORIENTATION_VERTICAL, 2);
-	gtk_container_add(GTK_CONTAINER(window), (GtkWidget*)vbox);
+	synth_hold_patch();
 
 	for(int i = 0; i < get_nmods(); i++) {
 		if(strncmp(get_mod_type(i), "CST", 3)) continue;
@@ -144,6 +256,201 @@ static void on_app_activate(GApplication *app, gpointer data) {
 				 get_mod_cst_type(i)[2]);
 	}
 
+	synth_release_patch();
+	if(synth_is_polyphonic())
+		gtk_box_pack_start(vbox, keyboard(60), 0, 1, 2);
+	return (GtkWidget*)vbox;
+}
+
+// Swap the controls over once a reloaded patch is playing
+static struct {
+	GtkBox *box;
+	GtkWidget *controls;
+	unsigned generation;
+} ui;
+static gboolean check_reloaded(gpointer data) {
+	unsigned generation = get_synth_generation();
+	if(generation != ui.generation) {
+		ui.generation = generation;
+		gtk_widget_destroy(ui.controls);
+		ui.controls = patch_controls();
+		gtk_box_pack_start(ui.box, ui.controls, 0, 1, 2);
+		gtk_widget_show_all(ui.controls);
+	}
+	return G_SOURCE_CONTINUE;
+}
+static void reload_clicked(GtkButton *button, gpointer data) {
+	synth_reload();
+}
+
+/* Scope and spectrum of up to TAP_MAX module outputs, read from the taps
+ * the audio thread fills. Taps follow module ids so they live through
+ * reloads, outside the patch controls. */
+#define SCOPE_LEN 1024 // samples across the scope
+#define SPECTRUM_LEN 4096 // FFT size, a power of 2
+#define SCOPE_MS 33
+
+static const double tap_colours[TAP_MAX][3] = {
+	{0.2, 0.9, 0.2}, {0.9, 0.8, 0.2}, {0.3, 0.6, 1.0}, {1.0, 0.4, 0.4}};
+
+static struct {
+	GtkWidget *on[TAP_MAX];
+	GtkAdjustment *mod[TAP_MAX], *port[TAP_MAX];
+	GtkLabel *status[TAP_MAX];
+	GtkAdjustment *decimate;
+	GtkWidget *area;
+	float samples[SPECTRUM_LEN];
+	float db[SPECTRUM_LEN / 2];
+} scope;
+
+static void tap_changed(GtkWidget *widget, gpointer data) {
+	int decimate = gtk_adjustment_get_value(scope.decimate);
+	for(int i = 0; i < TAP_MAX; i++)
+		if(gtk_toggle_button_get_active((GtkToggleButton*)scope.on[i]))
+			tap_set(i, gtk_adjustment_get_value(scope.mod[i]),
+					gtk_adjustment_get_value(scope.port[i]), decimate);
+		else
+			tap_clear(i);
+}
+
+// Newest samples from a rising zero crossing, so a steady wave stands still
+static int scope_window(float *s, int n) {
+	for(int i = n - SCOPE_LEN; i > 0; i--)
+		if(s[i - 1] < 0 && s[i] >= 0)
+			return i;
+	return n > SCOPE_LEN ? n - SCOPE_LEN : 0;
+}
+
+static void draw_scope(cairo_t *cr, int slot, int w, int h) {
+	int n = tap_read(slot, scope.samples, 2 * SCOPE_LEN);
+	if(n < 2)
+		return;
+	int from = scope_window(scope.samples, n), len = n - from < SCOPE_LEN ? n - from : SCOPE_LEN;
+	// Scaled to fit, or to +-1 for anything quieter
+	float peak = 1;
+	for(int i = from; i < from + len; i++)
+		peak = fabsf(scope.samples[i]) > peak ? fabsf(scope.samples[i]) : peak;
+	for(int i = 0; i < len; i++) {
+		double x = (double)i * w / SCOPE_LEN, y = h / 2. * (1 - scope.samples[from + i] / peak);
+		if(i) cairo_line_to(cr, x, y);
+		else cairo_move_to(cr, x, y);
+	}
+	cairo_stroke(cr);
+}
+
+// Log frequency from 20Hz, -100dB to 0dB
+static void draw_spectrum(cairo_t *cr, int slot, int top, int w, int h) {
+	if(tap_read(slot, scope.samples, SPECTRUM_LEN) < SPECTRUM_LEN)
+		return;
+	tap_spectrum(scope.samples, scope.db, SPECTRUM_LEN);
+	double rate = get_rate() / gtk_adjustment_get_value(scope.decimate);
+	double lo = log(20.), hi = log(rate / 2);
+	if(hi <= lo)
+		return;
+	int first = 1;
+	for(int k = 1; k < SPECTRUM_LEN / 2; k++) {
+		double f = k * rate / SPECTRUM_LEN;
+		if(f < 20)
+			continue;
+		double db = scope.db[k] < -100 ? -100 : scope.db[k] > 0 ? 0 : scope.db[k];
+		double x = (log(f) - lo) / (hi - lo) * w, y = top - db / 100. * h;
+		if(first) cairo_move_to(cr, x, y);
+		else cairo_line_to(cr, x, y);
+		first = 0;
+	}
+	cairo_stroke(cr);
+}
+
+static gboolean draw_taps(GtkWidget *widget, cairo_t *cr, gpointer data) {
+	int w = gtk_widget_get_allocated_width(widget), h = gtk_widget_get_allocated_height(widget);
+	cairo_set_source_rgb(cr, 0, 0, 0);
+	cairo_paint(cr);
+	cairo_set_line_width(cr, 1);
+	cairo_set_source_rgb(cr, 0.3, 0.3, 0.3);
+	cairo_move_to(cr, 0, h / 4.);
+	cairo_line_to(cr, w, h / 4.);
+	cairo_move_to(cr, 0, h / 2.);
+	cairo_line_to(cr, w, h / 2.);
+	cairo_stroke(cr);
+	for(int i = 0; i < TAP_MAX; i++) {
+		if(TAP_OK != tap_status(i))
+			continue;
+		cairo_set_source_rgb(cr, tap_colours[i][0], tap_colours[i][1], tap_colours[i][2]);
+		draw_scope(cr, i, w, h / 2);
+		draw_spectrum(cr, i, h / 2, w, h / 2);
+	}
+	return FALSE;
+}
+
+static gboolean update_scope(gpointer data) {
+	static char text[TAP_MAX][32];
+	synth_hold_patch();
+	for(int i = 0; i < TAP_MAX; i++) {
+		int m = gtk_adjustment_get_value(scope.mod[i]), status = tap_status(i);
+		snprintf(text[i], sizeof(text[i]), "%.3s %s", m < get_nmods() ? get_mod_type(m) : "",
+				TAP_OK == status ? "" : TAP_UNAVAILABLE == status ? "unavailable" : "off");
+		gtk_label_set_text(scope.status[i], text[i]);
+	}
+	synth_release_patch();
+	gtk_widget_queue_draw(scope.area);
+	return G_SOURCE_CONTINUE;
+}
+
+static GtkWidget *scope_view() {
+	GtkBox *vbox = (GtkBox*)gtk_box_new(GTK_ORIENTATION_VERTICAL, 2);
+	for(int i = 0; i < TAP_MAX; i++) {
+		GtkBox *row = (GtkBox*)gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 2);
+		scope.on[i] = gtk_check_button_new_with_label("Tap module");
+		gtk_box_pack_start(row, scope.on[i], 0, 1, 2);
+		scope.mod[i] = gtk_adjustment_new(0., 0., 4095., 1., 10., 0.);
+		gtk_box_pack_start(row, gtk_spin_button_new(scope.mod[i], 1, 0), 0, 1, 2);
+		gtk_box_pack_start(row, gtk_label_new("port"), 0, 1, 2);
+		scope.port[i] = gtk_adjustment_new(0., 0., PLAN_MAX_PORTS - 1, 1., 1., 0.);
+		gtk_box_pack_start(row, gtk_spin_button_new(scope.port[i], 1, 0), 0, 1, 2);
+		scope.status[i] = (GtkLabel*)gtk_label_new("off");
+		gtk_box_pack_start(row, (GtkWidget*)scope.status[i], 1, 1, 2);
+		gtk_box_pack_start(vbox, (GtkWidget*)row, 0, 1, 0);
+		g_signal_connect(scope.on[i], "toggled", G_CALLBACK(tap_changed), NULL);
+		g_signal_connect(scope.mod[i], "value-changed", G_CALLBACK(tap_changed), NULL);
+		g_signal_connect(scope.port[i], "value-changed", G_CALLBACK(tap_changed), NULL);
+	}
+
+	GtkBox *row = (GtkBox*)gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 2);
+	gtk_box_pack_start(row, gtk_label_new("Frames per sample"), 0, 1, 2);
+	scope.decimate = gtk_adjustment_new(1., 1., TAP_MAX_DECIMATE, 1., 16., 0.);
+	gtk_box_pack_start(row, gtk_spin_button_new(scope.decimate, 1, 0), 0, 1, 2);
+	gtk_box_pack_start(vbox, (GtkWidget*)row, 0, 1, 0);
+	g_signal_connect(scope.decimate, "value-changed", G_CALLBACK(tap_changed), NULL);
+
+	scope.area = gtk_drawing_area_new();
+	gtk_widget_set_size_request(scope.area, 512, 320);
+	g_signal_connect(scope.area, "draw", G_CALLBACK(draw_taps), NULL);
+	gtk_box_pack_start(vbox, scope.area, 1, 1, 2);
+	g_timeout_add(SCOPE_MS, update_scope, NULL);
+	return (GtkWidget*)vbox;
+}
+
+static void on_app_activate(GApplication *app, gpointer data) {
+  GtkWidget *window = gtk_application_window_new(GTK_APPLICATION(app));
+
+	GtkBox *vbox = (GtkBox*)gtk_box_new(GTK_ORIENTATION_VERTICAL, 2);
+	gtk_container_add(GTK_CONTAINER(window), (GtkWidget*)vbox);
+
+	ui.box = vbox;
+	ui.generation = get_synth_generation();
+	ui.controls = patch_controls();
+	gtk_box_pack_start(vbox, ui.controls, 0, 1, 2);
+	g_timeout_add(200, check_reloaded, NULL);
+
+	GtkWidget *load = gtk_label_new("DSP");
+	gtk_box_pack_end(vbox, load, 0, 1, 2);
+	g_timeout_add(500, update_stats_label, load);
+
+	GtkWidget *reload = gtk_button_new_with_label("Reload");
+	g_signal_connect(reload, "clicked", G_CALLBACK(reload_clicked), NULL);
+	gtk_box_pack_end(vbox, reload, 0, 1, 2);
+	gtk_box_pack_end(vbox, scope_view(), 1, 1, 2);
+
 	gtk_widget_show_all(GTK_WIDGET(window));
 }
 
@@ -152,31 +459,63 @@ int main (int argc, char *argv[]) {
 	pthread_t synth_thread;
 
 	synth_thread_data *synth = malloc(sizeof(synth_thread_data));
-	pthread_mutex_init(&synth->alive_mtx, NULL);
+	memset(synth, 0, sizeof(synth_thread_data));
+	argc = parse_args(argc, argv, synth);
+
+	// Headless, no sound card or display needed
+	if(synth->dump_plan) {
+		int ret = synth_dump_plan(synth) ? 1 : 0;
+		free(synth);
+		return ret;
+	}
+	if(synth->render_path) {
+		int ret = synth_render(synth) ? 1 : 0;
+		free(synth);
+		return ret;
+	}
+
+	if(synth->daemon && !synth->control_socket && !synth->osc_port) {
+		printf("ERROR: --daemon needs --socket or --osc to be controlled by\n");
+		free(synth);
+		return 1;
+	}
+	// Every thread but the one waiting for them ignores the stop signals
+	if(synth->daemon)
+		control_block_signals();
+
 	pthread_create(&synth_thread, NULL, synth_main_loop, (void*)synth);
 
 	// Wait for the synth thread to startup
 	int synth_alive = 0;
-	while(!synth_alive) {
-		pthread_mutex_lock(&synth->alive_mtx);
-		synth_alive = synth->alive;
-		pthread_mutex_unlock(&synth->alive_mtx);
+	while(!(synth_alive = __atomic_load_n(&synth->alive, __ATOMIC_ACQUIRE)))
+		sched_yield();
+	if(synth_alive < 0) {
+		pthread_join(synth_thread, NULL);
+		free(synth);
+		return 1;
 	}
 
-	// Create a new application
-	GtkApplication *app = gtk_application_new ("com.example.GtkApplication",
-			G_APPLICATION_FLAGS_NONE);
-	g_signal_connect(app, "activate", G_CALLBACK (on_app_activate), NULL);
-	int app_ret = g_application_run (G_APPLICATION (app), argc, argv);
+	int app_ret = 0;
+	if(control_start(synth->control_socket, synth->osc_port))
+		app_ret = 1;
+	else if(synth->daemon)
+		control_wait();
+	else {
+		// Create a new application
+		GtkApplication *app = gtk_application_new ("com.example.GtkApplication",
+				G_APPLICATION_FLAGS_NONE);
+		g_signal_connect(app, "activate", G_CALLBACK (on_app_activate), NULL);
+		app_ret = g_application_run (G_APPLICATION (app), argc, argv);
+		g_object_unref(app);
+	}
 
 	printf("Closing\n");
-	pthread_mutex_lock(&synth->alive_mtx);
-	synth->alive = 0;
-	pthread_mutex_unlock(&synth->alive_mtx);
+	control_stop();
+	__atomic_store_n(&synth->alive, 0, __ATOMIC_RELEASE);
 
 	pthread_join(synth_thread, NULL);
 
-	g_object_unref(app);
+	free(synth);
 
 	return app_ret;
 }
@@ -0,0 +1,148 @@
+#define _POSIX_C_SOURCE 200809L
+#include "latency.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define NANO 1000000000ull
+
+typedef struct pending {
+	uint64_t frame;
+	uint64_t queued;
+} pending;
+
+static struct {
+	int on;
+	unsigned rate;
+	int wakeup_frames; // free in the buffer when the card wakes us
+	int buffer_frames;
+	int64_t next_wakeup; // when the card should wake us, 0 if unknown
+	pending events[LATENCY_PENDING]; // ring, in frame order
+	unsigned head, tail;
+	uint64_t dropped; // pending ring was full
+	latency_hist latency, jitter;
+} lat;
+
+uint64_t latency_now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * NANO + t.tv_nsec;
+}
+
+void latency_start(unsigned rate, int wakeup_frames, int buffer_frames) {
+	memset(&lat, 0, sizeof(lat));
+	lat.rate = rate;
+	lat.wakeup_frames = wakeup_frames;
+	lat.buffer_frames = buffer_frames;
+	lat.latency.bucket_ns = LATENCY_BUCKET_NS;
+	lat.jitter.bucket_ns = JITTER_BUCKET_NS;
+	__atomic_store_n(&lat.on, 1, __ATOMIC_RELEASE);
+}
+
+int latency_enabled() { return __atomic_load_n(&lat.on, __ATOMIC_RELAXED); }
+
+uint64_t latency_stamp() { return latency_enabled() ? latency_now() : 0; }
+
+static void hist_add(latency_hist *h, uint64_t ns) {
+	uint64_t b = ns / h->bucket_ns;
+	h->count[b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1]++;
+	h->n++;
+	h->total += ns;
+	if(ns > h->max)
+		h->max = ns;
+}
+
+// Top of the bucket the p'th fraction falls in, never more than the max
+static uint64_t hist_percentile(latency_hist *h, double p) {
+	uint64_t want = (uint64_t)(p * h->n + 0.999999), seen = 0;
+	if(!want)
+		want = 1;
+	for(int b = 0; b < LATENCY_BUCKETS - 1; b++)
+		if((seen += h->count[b]) >= want) {
+			uint64_t top = (uint64_t)(b + 1) * h->bucket_ns;
+			return top < h->max ? top : h->max;
+		}
+	return h->max;
+}
+
+void latency_applied(uint64_t frame, uint64_t queued) {
+	if(lat.tail - lat.head == LATENCY_PENDING) {
+		lat.dropped++;
+		return;
+	}
+	pending *p = &lat.events[lat.tail++ & (LATENCY_PENDING - 1)];
+	p->frame = frame;
+	p->queued = queued;
+}
+
+void latency_played(uint64_t written, long delay, uint64_t at) {
+	while(lat.head != lat.tail) {
+		pending *p = &lat.events[lat.head & (LATENCY_PENDING - 1)];
+		if(p->frame >= written)
+			break;
+		int64_t ahead = (int64_t)(p->frame - written) + delay;
+		int64_t dac = (int64_t)at + ahead * (int64_t)NANO / (int64_t)lat.rate;
+		hist_add(&lat.latency, dac > (int64_t)p->queued ? dac - p->queued : 0);
+		lat.head++;
+	}
+	// Once the delay is down to what leaves wakeup_frames free
+	int64_t drain = delay - (lat.buffer_frames - lat.wakeup_frames);
+	lat.next_wakeup = (int64_t)at + drain * (int64_t)NANO / (int64_t)lat.rate;
+}
+
+void latency_wakeup(uint64_t now) {
+	if(now && lat.next_wakeup) {
+		int64_t off = (int64_t)now - lat.next_wakeup;
+		hist_add(&lat.jitter, off > 0 ? off : -off);
+	}
+	lat.next_wakeup = 0;
+}
+
+static void hist_json(FILE *f, const char *name, latency_hist *h) {
+	fprintf(f, "\"%s\": {\"count\": %llu, \"mean_us\": %.1f, \"p50_us\": %.1f, "
+			"\"p99_us\": %.1f, \"max_us\": %.1f, \"bucket_us\": %.1f,\n\"histogram\": [",
+			name, (unsigned long long)h->n, h->n ? h->total / 1e3 / h->n : 0.,
+			hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.99) / 1e3,
+			h->max / 1e3, h->bucket_ns / 1e3);
+	// Only the buckets with something in, as [from_us, count]
+	int first = 1;
+	for(int b = 0; b < LATENCY_BUCKETS; b++)
+		if(h->count[b]) {
+			fprintf(f, "%s[%.1f, %llu]", first ? "" : ", ",
+					(double)b * h->bucket_ns / 1e3, (unsigned long long)h->count[b]);
+			first = 0;
+		}
+	fprintf(f, "]}");
+}
+
+static void hist_print(const char *what, const char *counted, latency_hist *h) {
+	printf("%s: %llu %s, p50 %.2fms, p99 %.2fms, max %.2fms\n", what,
+			(unsigned long long)h->n, counted, hist_percentile(h, 0.5) / 1e6,
+			hist_percentile(h, 0.99) / 1e6, h->max / 1e6);
+}
+
+int latency_report(const char *path) {
+	if(!latency_enabled())
+		return 0;
+	hist_print("Latency", "changes", &lat.latency);
+	hist_print("Wakeup jitter", "wakeups", &lat.jitter);
+	if(lat.dropped)
+		printf("Latency: %llu changes not measured, too many at once\n",
+				(unsigned long long)lat.dropped);
+
+	FILE *f = fopen(path, "w");
+	if(!f) {
+		printf("ERROR: Can't write latency to %s. %s\n", path, strerror(errno));
+		return -1;
+	}
+	fprintf(f, "{\n\"rate\": %u,\n\"wakeup_frames\": %i,\n\"buffer_frames\": %i,\n"
+			"\"dropped\": %llu,\n", lat.rate, lat.wakeup_frames, lat.buffer_frames,
+			(unsigned long long)lat.dropped);
+	hist_json(f, "latency", &lat.latency);
+	fprintf(f, ",\n");
+	hist_json(f, "jitter", &lat.jitter);
+	fprintf(f, "\n}\n");
+	fclose(f);
+	return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+/* Measurement mode for tuning buffer sizes for live use, off unless
+ * latency_start is called. Parameter changes and notes are timestamped as
+ * they are queued and the audio thread notes the frame each one takes
+ * effect at. Once that frame has gone to the sound card, the card's delay
+ * says when it will reach the DAC, which gives the end to end latency.
+ * The same delay says when the card will next have wakeup_frames free,
+ * and how far each wakeup of the audio thread lands from that is the
+ * jitter. Changes queued for a later frame count the time they were meant
+ * to wait too.
+ *
+ * Everything but latency_stamp is for the audio thread only. Times are
+ * ns on CLOCK_MONOTONIC. */
+
+#define LATENCY_BUCKETS 2048
+#define LATENCY_BUCKET_NS 50000 // 50us, up to ~100ms
+#define JITTER_BUCKET_NS 5000 // 5us, up to ~10ms
+#define LATENCY_PENDING 1024 // changes applied but not yet played, a power of 2
+
+typedef struct latency_hist {
+	int bucket_ns; // width of each bucket, the last takes everything over
+	uint64_t count[LATENCY_BUCKETS];
+	uint64_t n;
+	uint64_t total; // ns
+	uint64_t max;
+} latency_hist;
+
+uint64_t latency_now();
+void latency_start(unsigned rate, int wakeup_frames, int buffer_frames);
+int latency_enabled();
+// For stamping queued changes, 0 when not measuring
+uint64_t latency_stamp();
+
+// A change queued at queued took effect at frame
+void latency_applied(uint64_t frame, uint64_t queued);
+/* Frames before written have gone to the sound card, at time at the next
+ * one to go was delay frames from the DAC */
+void latency_played(uint64_t written, long delay, uint64_t at);
+// The audio thread woke at time now, 0 if the device isn't running
+void latency_wakeup(uint64_t now);
+
+// Prints p50/p99/max and writes both histograms to path as JSON
+int latency_report(const char *path);
+#endif
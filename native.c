@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include "native.h"
+#include "optimize.h"
+#include "patch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <dlfcn.h>
+#include <unistd.h>
+
+// Growing string for the generated source
+typedef struct text {
+	char *buf;
+	size_t len;
+	size_t cap;
+} text;
+static void add(text *t, const char *fmt, ...) {
+	va_list ap;
+	for(;;) {
+		va_start(ap, fmt);
+		int n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+		va_end(ap);
+		if(t->len + n < t->cap) {
+			t->len += n;
+			return;
+		}
+		t->cap = (t->cap + n + 1) * 2;
+		t->buf = realloc(t->buf, t->cap);
+	}
+}
+
+typedef struct gen {
+	plan *p;
+	mod *mods;
+	native *n;
+	int *writer; // step writing each pool float, -1 for none
+	char *fixed; // step outputs a fixed value
+	float *val; // and which
+	text decls; // kernels called by name
+} gen;
+
+// The fixed value the buffer at off always holds, through interps and spreads
+static int value_of(gen *g, int off, float *v) {
+	int i = g->writer[off];
+	if(i < 0)
+		return 0;
+	plan_step *s = &g->p->steps[i];
+	if(g->fixed[i]) {
+		*v = g->val[i];
+		return 1;
+	}
+	const char *name = plan_step_name(s);
+	if(name && (0 == strcmp(name, "interp") || 0 == strcmp(name, "spread")))
+		return value_of(g, s->in[0], v);
+	return 0;
+}
+
+// Input at off, frame or element index idx
+static void operand(gen *g, text *t, int off, const char *idx) {
+	float v;
+	if(value_of(g, off, &v))
+		add(t, "(%af)", (double)v);
+	else
+		add(t, "P[%i + %s]", off, idx);
+}
+
+static void expression(gen *g, text *t, int op, int *args, plan_step *s,
+		char **sub) {
+	char *fmt[] = {"", "(# + #)", "(# * #)", "(# * (1 - @) + # * @)"};
+	int k = 0;
+	for(char *c = fmt[op]; *c; c++) {
+		int a = '#' == *c ? args[k++] : '@' == *c ? args[2] : -1;
+		if('#' != *c && '@' != *c)
+			add(t, "%c", *c);
+		else if(a < 0)
+			add(t, "%s", sub[-1 - a]);
+		else
+			operand(g, t, s->in[a], "i");
+	}
+}
+
+// Name of a kernel in the program, NULL if it isn't exported
+static const char *kernel_name(plan_kernel k) {
+	union {
+		plan_kernel k;
+		void *p;
+	} u = {k};
+	Dl_info info;
+	if(!dladdr(u.p, &info) || !info.dli_sname || info.dli_saddr != u.p)
+		return NULL;
+	return info.dli_sname;
+}
+
+static void add_fixed(native *n, int m, float v) {
+	n->fixed_mods = realloc(n->fixed_mods, (n->nfixed + 1) * sizeof(int));
+	n->fixed_vals = realloc(n->fixed_vals, (n->nfixed + 1) * sizeof(float));
+	n->fixed_mods[n->nfixed] = m;
+	n->fixed_vals[n->nfixed++] = v;
+}
+
+// Code for step i into t, -1 if it can't be written out
+static int emit_step(gen *g, text *t, int i) {
+	plan *p = g->p;
+	plan_step *s = &p->steps[i];
+	mod *m = s->mod_id >= 0 ? &g->mods[s->mod_id] : NULL;
+	const char *name = plan_step_name(s);
+	int cap = (p->block_size + p->control_period - 1) / p->control_period;
+
+	add(t, "\t// %i", i);
+	if(name)
+		add(t, " %s", name);
+	if(m)
+		add(t, " %c%c%c %i", m->type[0], m->type[1], m->type[2], s->mod_id);
+	add(t, "\n");
+	// Self-checks leave out the sound card and the voices, see native_check
+	int skip = m && (s->serial || PLAN_VOICE_SOURCE == m->voicing);
+	if(s->constant)
+		add(t, "\tif(refresh%s) {\n\t\tn = %i;\n", skip ? " && !check" : "", cap);
+	else if(s->stride > 1)
+		add(t, "\tif(nticks%s) {\n\t\tn = nticks;\n", skip ? " && !check" : "");
+	else
+		add(t, "\tif(%s) {\n\t\tn = nframes;\n", skip ? "!check" : "1");
+
+	if(s->kernel == &opt_fused_kernel || (m && m->op && s->kernel == m->process)) {
+		opt_fused one = {1, {{m ? m->op : 0, {0, 1, 2}}}, {s->mod_id}};
+		opt_fused *f = s->kernel == &opt_fused_kernel ? (opt_fused*)s->data : &one;
+		char *sub[OPT_MAX_OPS];
+		for(int k = 0; k < f->nops; k++) {
+			text e = {NULL, 0, 0};
+			add(&e, "");
+			expression(g, &e, f->ops[k].op, f->ops[k].arg, s, sub);
+			sub[k] = e.buf;
+		}
+		add(t, "\t\tfor(int i = 0; i < n * %i; i++)\n\t\t\tP[%i + i] = %s;\n",
+				s->lanes, s->out[0], sub[f->nops - 1]);
+		for(int k = 0; k < f->nops; k++)
+			free(sub[k]);
+	} else if(g->fixed[i]) {
+		add(t, "\t\tfor(int i = 0; i < n; i++)\n\t\t\tP[%i + i] = (%af);\n",
+				s->out[0], (double)g->val[i]);
+	} else if(name && 0 == strcmp(name, "spread")) {
+		add(t, "\t\tfor(int f = 0; f < n; f++)\n\t\t\tfor(int v = 0; v < %i; v++)\n"
+				"\t\t\t\tP[%i + f * %i + v] = ", s->lanes, s->out[0], s->lanes);
+		operand(g, t, s->in[0], "f");
+		add(t, ";\n");
+	} else if(name && 0 == strcmp(name, "mix")) {
+		add(t, "\t\tfor(int f = 0; f < n; f++) {\n\t\t\tfloat sum = 0.;\n"
+				"\t\t\tfor(int v = 0; v < %i; v++)\n\t\t\t\tsum += P[%i + f * %i + v];\n"
+				"\t\t\tP[%i + f] = sum;\n\t\t}\n", p->voices, s->in[0], s->lanes, s->out[0]);
+	} else {
+		const char *fn = kernel_name(s->kernel);
+		if(!fn) {
+			printf("Native: step %i's kernel isn't exported\n", i);
+			return -1;
+		}
+		if(!strstr(g->decls.buf, fn))
+			add(&g->decls, "void %s(struct plan_step *s, float *pool, int nframes);\n", fn);
+		add(t, "\t\t%s(S(%i), P, n);\n", fn, i);
+	}
+	add(t, "\t}\n");
+	return 0;
+}
+
+// The whole plan as C, NULL if some step can't be written out
+static char *generate(plan *p, mod *mods, native *n, native_fixed_fn fixed) {
+	gen g = {p, mods, n};
+	g.writer = malloc((p->pool_len + 1) * sizeof(int));
+	g.fixed = calloc(p->nsteps, 1);
+	g.val = calloc(p->nsteps, sizeof(float));
+	for(int i = 0; i < p->pool_len; i++)
+		g.writer[i] = -1;
+	for(int i = 0; i < p->nsteps; i++) {
+		plan_step *s = &p->steps[i];
+		for(int k = 0; k < PLAN_MAX_PORTS; k++)
+			if(s->used_outs & (1 << k))
+				g.writer[s->out[k]] = i;
+		float v;
+		if(s->mod_id >= 0 && s->kernel == mods[s->mod_id].process && 1 == s->lanes &&
+				fixed(&mods[s->mod_id], &v) && isfinite(v)) {
+			g.fixed[i] = 1;
+			g.val[i] = v;
+			add_fixed(n, s->mod_id, v);
+		}
+	}
+
+	text body = {NULL, 0, 0};
+	add(&g.decls, "/* Generated from a compiled plan, see native.h\n * %s %s */\n"
+			"#include <stddef.h>\nstruct plan_step;\n#define S(i) ((struct plan_step*)(steps + (size_t)(i) * %zu))\n",
+			getenv("CC") ? getenv("CC") : NATIVE_CC, NATIVE_CFLAGS, sizeof(plan_step));
+	add(&body, "\nvoid synth_native(char *steps, float *restrict P, int nframes, int nticks,\n"
+			"\t\tint refresh, int check) {\n\tint n;\n");
+	int ok = 1;
+	for(int i = 0; ok && i < p->nsteps; i++)
+		ok = 0 == emit_step(&g, &body, i);
+	add(&body, "\t(void)n;\n}\n");
+	add(&g.decls, "%s", body.buf);
+
+	free(body.buf);
+	free(g.writer);
+	free(g.fixed);
+	free(g.val);
+	if(!ok) {
+		free(g.decls.buf);
+		return NULL;
+	}
+	return g.decls.buf;
+}
+
+static int write_file(const char *path, const char *src) {
+	FILE *f = fopen(path, "w");
+	if(!f)
+		return -1;
+	int ok = fputs(src, f) >= 0;
+	return 0 == fclose(f) && ok ? 0 : -1;
+}
+
+// dir/<hash>.so, compiled from src unless it is there already
+static void *load(const char *dir, const char *src) {
+	char c_path[1100], so_path[1100], tmp[1200], cmd[4096];
+	uint64_t hash = patch_hash(src, strlen(src));
+	int n = snprintf(c_path, sizeof(c_path), "%s/%016llx.c", dir, (unsigned long long)hash);
+	int m = snprintf(so_path, sizeof(so_path), "%s/%016llx.so", dir, (unsigned long long)hash);
+	if(n < 0 || m < 0 || n >= (int)sizeof(c_path) || m >= (int)sizeof(so_path)) {
+		printf("Native: cache directory name too long, %s\n", dir);
+		return NULL;
+	}
+
+	void *dl = access(so_path, R_OK) ? NULL : dlopen(so_path, RTLD_NOW | RTLD_LOCAL);
+	if(dl) {
+		printf("Native: loaded %s\n", so_path);
+		return dl;
+	}
+	patch_make_dirs(c_path);
+	snprintf(tmp, sizeof(tmp), "%s.%i.tmp", so_path, (int)getpid());
+	if(write_file(c_path, src)) {
+		printf("Native: can't write %s\n", c_path);
+		return NULL;
+	}
+	n = snprintf(cmd, sizeof(cmd), "%s %s -o '%s' '%s'",
+			getenv("CC") ? getenv("CC") : NATIVE_CC, NATIVE_CFLAGS, tmp, c_path);
+	if(n < 0 || n >= (int)sizeof(cmd)) {
+		printf("Native: compiler command too long\n");
+		return NULL;
+	}
+	if(system(cmd) || rename(tmp, so_path)) {
+		printf("Native: no compiler or it failed, \"%s\"\n", cmd);
+		remove(tmp);
+		return NULL;
+	}
+	if(!(dl = dlopen(so_path, RTLD_NOW | RTLD_LOCAL)))
+		printf("Native: can't load %s. %s\n", so_path, dlerror());
+	else
+		printf("Native: compiled %s\n", so_path);
+	return dl;
+}
+
+/* Runs blocks of various sizes from the plan's current state one way,
+ * puts the state back, and hashes the pool after each. The sound card
+ * and voice sources stay out of it, they'd touch or read global state. */
+static void check_run(native *n, plan *p, mod *mods, uint64_t *hashes) {
+	for(int b = 0; b < NATIVE_CHECK_BLOCKS; b++) {
+		int nframes = b % 3 == 1 ? (p->block_size * b / 7) % p->block_size + 1 : p->block_size;
+		plan_begin(p, nframes);
+		if(n) {
+			n->run((char*)p->steps, p->pool, nframes, p->nticks, p->refresh, 1);
+		} else {
+			for(int i = 0; i < p->nsteps; i++) {
+				plan_step *s = &p->steps[i];
+				if(s->mod_id >= 0 && (s->serial ||
+						PLAN_VOICE_SOURCE == mods[s->mod_id].voicing))
+					continue;
+				plan_run_step(p, i, nframes);
+			}
+		}
+		hashes[b] = patch_hash((char*)p->pool, p->pool_len * sizeof(float));
+	}
+}
+static int native_check(native *n, plan *p, mod *mods) {
+	uint64_t got[NATIVE_CHECK_BLOCKS], want[NATIVE_CHECK_BLOCKS];
+	char *saved = malloc(p->bytes);
+	memcpy(saved, p, p->bytes);
+	check_run(n, p, mods, got);
+	memcpy(p, saved, p->bytes);
+	check_run(NULL, p, mods, want);
+	memcpy(p, saved, p->bytes);
+	free(saved);
+	return memcmp(got, want, sizeof(got)) ? -1 : 0;
+}
+
+native *native_build(plan *p, mod *mods, const char *cache_dir,
+		native_fixed_fn fixed) {
+	native *n = calloc(1, sizeof(native));
+	char *src = generate(p, mods, n, fixed);
+	if(!src) {
+		native_free(n);
+		return NULL;
+	}
+
+	// With no cache it gets built in a directory of its own and forgotten
+	char dir[1100];
+	int temp = !cache_dir || !cache_dir[0];
+	if(temp) {
+		snprintf(dir, sizeof(dir), "/tmp/synth-native-XXXXXX");
+		if(!mkdtemp(dir)) {
+			printf("Native: no temporary directory\n");
+			free(src);
+			native_free(n);
+			return NULL;
+		}
+	} else
+		snprintf(dir, sizeof(dir), "%s/native", cache_dir);
+	n->dl = load(dir, src);
+	if(temp) {
+		uint64_t hash = patch_hash(src, strlen(src));
+		char path[1200];
+		snprintf(path, sizeof(path), "%s/%016llx.c", dir, (unsigned long long)hash);
+		remove(path);
+		snprintf(path, sizeof(path), "%s/%016llx.so", dir, (unsigned long long)hash);
+		remove(path);
+		rmdir(dir);
+	}
+	free(src);
+
+	if(n->dl) {
+		union {
+			void *p;
+			native_fn run;
+		} u = {dlsym(n->dl, "synth_native")};
+		n->run = u.run;
+	}
+	if(!n->run) {
+		printf("Native: using the interpreter\n");
+		native_free(n);
+		return NULL;
+	}
+	if(native_check(n, p, mods)) {
+		printf("Native: output differs from the interpreter, using the interpreter\n");
+		native_free(n);
+		return NULL;
+	}
+	return n;
+}
+
+void native_run(native *n, plan *p, int nframes) {
+	plan_begin(p, nframes);
+	n->run((char*)p->steps, p->pool, nframes, p->nticks, p->refresh, 0);
+}
+
+void native_touch(native *n, int mod_id) {
+	for(int i = 0; i < n->nfixed; i++)
+		if(n->fixed_mods[i] == mod_id)
+			n->off = 1;
+}
+
+// After state came over from another patch, the written in values must hold
+void native_check_fixed(native *n, mod *mods, native_fixed_fn fixed) {
+	for(int i = 0; i < n->nfixed; i++) {
+		float v;
+		if(!fixed(&mods[n->fixed_mods[i]], &v) || v != n->fixed_vals[i])
+			n->off = 1;
+	}
+}
+
+void native_free(native *n) {
+	if(!n)
+		return;
+	if(n->dl)
+		dlclose(n->dl);
+	free(n->fixed_mods);
+	free(n->fixed_vals);
+	free(n);
+}
@@ -0,0 +1,48 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+/* A compiled plan as native code. native_build writes the plan out as C,
+ * one function running every step in order, with pool offsets, lanes and
+ * fixed values as immediates. Arithmetic, fused trees, fixed values and
+ * voice spreads and mixes are written out inline, other kernels are
+ * called directly by name, which needs the program linked with -rdynamic.
+ * The system compiler builds it into a .so in the cache directory named
+ * by a hash of the source, so loading the same patch again skips the
+ * compiler.
+ *
+ * The code works on the plan's own pool and state, so any block can go
+ * through the interpreter instead, e.g. when stats time every step. Before
+ * it is used a few blocks run both ways from the same state and the pools
+ * have to come out the same. Anything failing leaves the interpreter to
+ * it. */
+
+#include "plan.h"
+
+#define NATIVE_CC "cc" // unless $CC says otherwise
+#define NATIVE_CFLAGS "-std=c99 -O3 -march=native -ffp-contract=off -fPIC -shared"
+#define NATIVE_CHECK_BLOCKS 8
+
+typedef void (*native_fn)(char *steps, float *pool, int nframes, int nticks,
+		int refresh, int check);
+
+// 1 and m's value if m outputs a value that only changes when set
+typedef int (*native_fixed_fn)(mod *m, float *val);
+
+typedef struct native {
+	void *dl;
+	native_fn run;
+	int off; // a fixed value changed, the interpreter runs it from here on
+	int nfixed;
+	int *fixed_mods; // values written in as immediates
+	float *fixed_vals;
+} native;
+
+// NULL if it can't be compiled or doesn't match the interpreter
+native *native_build(plan *p, mod *mods, const char *cache_dir,
+		native_fixed_fn fixed);
+void native_run(native *n, plan *p, int nframes);
+// A change to module m is due, off if m's value was written in
+void native_touch(native *n, int mod_id);
+void native_check_fixed(native *n, mod *mods, native_fixed_fn fixed);
+void native_free(native *n);
+#endif
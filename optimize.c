@@ -0,0 +1,137 @@
+#include "optimize.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Back from the sinks along the wiring, iterative for huge patches
+void opt_live(mod *mods, int nmods, char *live) {
+	int *stack = malloc(nmods * sizeof(int));
+	int n = 0;
+	memset(live, 0, nmods);
+	for(int m = 0; m < nmods; m++)
+		if(mods[m].serial) {
+			live[m] = 1;
+			stack[n++] = m;
+		}
+	while(n) {
+		int m = stack[--n];
+		for(int i = 0; i < mods[m].nins; i++) {
+			int src = mods[m].inputs[i];
+			if(!live[src]) {
+				live[src] = 1;
+				stack[n++] = src;
+			}
+		}
+	}
+	free(stack);
+}
+
+// Adds op for m and whatever is fused into it, -1 if it doesn't fit
+static int emit(mod *mods, int m, const int *fuse_into, opt_fused *f,
+		int *in_mod, int *in_port, int *nin) {
+	opt_op op = {mods[m].op, {0, 0, 0}};
+	for(int i = 0; i < mods[m].nins; i++) {
+		int src = mods[m].inputs[i];
+		int port = mods[m].input_idxs[i];
+		if(fuse_into[src] == m) {
+			int k = emit(mods, src, fuse_into, f, in_mod, in_port, nin);
+			if(k < 0)
+				return -1;
+			op.arg[i] = -1 - k;
+			continue;
+		}
+		int k = 0;
+		while(k < *nin && (in_mod[k] != src || in_port[k] != port))
+			k++;
+		if(k == *nin) {
+			if(k == PLAN_MAX_PORTS)
+				return -1;
+			in_mod[k] = src;
+			in_port[k] = port;
+			(*nin)++;
+		}
+		op.arg[i] = k;
+	}
+	if(f->nops == OPT_MAX_OPS)
+		return -1;
+	f->ops[f->nops] = op;
+	f->mods[f->nops] = m;
+	return f->nops++;
+}
+
+int opt_program(mod *mods, int root, const int *fuse_into, opt_fused *f,
+		int *in_mod, int *in_port) {
+	int nin = 0;
+	f->nops = 0;
+	if(emit(mods, root, fuse_into, f, in_mod, in_port, &nin) < 0)
+		return -1;
+	return nin;
+}
+
+void opt_fuse(plan *p, mod *mods, const char *live, const int *comp,
+		const int *order, int *fuse_into) {
+	int nmods = p->nmods;
+	int *readers = calloc(nmods, sizeof(int));
+	int *comp_size = calloc(nmods, sizeof(int));
+	for(int m = 0; m < nmods; m++) {
+		fuse_into[m] = -1;
+		comp_size[comp[m]]++;
+		for(int i = 0; live[m] && i < mods[m].nins; i++) {
+			readers[mods[m].inputs[i]]++;
+			if(mods[m].inputs[i] == m) // a self loop is a loop too
+				comp_size[comp[m]]++;
+		}
+	}
+
+	opt_fused f;
+	int in_mod[PLAN_MAX_PORTS], in_port[PLAN_MAX_PORTS];
+	for(int k = 0; k < nmods; k++) {
+		int m = order[k];
+		if(!live[m] || !mods[m].op || comp_size[comp[m]] > 1)
+			continue;
+		for(int i = 0; i < mods[m].nins; i++) {
+			int src = mods[m].inputs[i];
+			if(!mods[src].op || 1 != readers[src] || comp_size[comp[src]] > 1 ||
+					p->rate[src] != p->rate[m] || p->voiced[src] != p->voiced[m])
+				continue;
+			fuse_into[src] = m;
+			if(opt_program(mods, m, fuse_into, &f, in_mod, in_port) < 0)
+				fuse_into[src] = -1;
+		}
+	}
+	free(readers);
+	free(comp_size);
+}
+
+void opt_fused_kernel(plan_step *s, float *pool, int nframes) {
+	opt_fused *f = (opt_fused*)s->data;
+	float tmp[OPT_MAX_OPS - 1][OPT_CHUNK];
+	float *out = pool + s->out[0];
+	int n = nframes * s->lanes;
+
+	for(int c = 0; c < n; c += OPT_CHUNK) {
+		int len = n - c < OPT_CHUNK ? n - c : OPT_CHUNK;
+		for(int k = 0; k < f->nops; k++) {
+			opt_op *op = &f->ops[k];
+			const float *a[3];
+			for(int j = 0; j < 3; j++)
+				a[j] = op->arg[j] >= 0 ? pool + s->in[op->arg[j]] + c : tmp[-1 - op->arg[j]];
+			float *dst = k == f->nops - 1 ? out + c : tmp[k];
+			// As the modules' own kernels do it
+			switch(op->op) {
+				case PLAN_OP_ADD:
+					for(int i = 0; i < len; i++)
+						dst[i] = a[0][i] + a[1][i];
+					break;
+				case PLAN_OP_MUL:
+					for(int i = 0; i < len; i++)
+						dst[i] = a[0][i] * a[1][i];
+					break;
+				case PLAN_OP_MIX:
+					for(int i = 0; i < len; i++)
+						dst[i] = a[0][i] * (1 - a[2][i]) + a[1][i] * a[2][i];
+					break;
+			}
+		}
+	}
+}
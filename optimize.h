@@ -0,0 +1,44 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+/* What plan_compile leaves out or merges before laying a patch out.
+ *
+ * Modules with no path to a sink such as OUT are pruned, they get no step
+ * and no buffers. Elementwise arithmetic (ADD, VCA, FAD) whose output only
+ * one other such module reads, at the same rate and voicing, fuses into
+ * that module. The tree becomes one step working through the block in
+ * chunks small enough for the values in between to stay in L1 rather
+ * than going through the pool. Every value is worked out with the same
+ * operations in the same order, so the output doesn't change. */
+
+#include "plan.h"
+
+#define OPT_MAX_OPS 8 // modules in one fused step
+#define OPT_CHUNK 256 // floats of each value in between
+
+typedef struct opt_op {
+	int op; // PLAN_OP_*
+	int arg[3]; // >= 0 the step's input, < 0 the result of op -1 - arg
+} opt_op;
+
+// Program of a fused step, in running order with its output last
+typedef struct opt_fused {
+	int nops;
+	opt_op ops[OPT_MAX_OPS];
+	int mods[OPT_MAX_OPS]; // module each op stands for
+} opt_fused;
+
+// live[m] set for modules with a path to a serial sink
+void opt_live(mod *mods, int nmods, char *live);
+/* fuse_into[m] gets the module m fused into, or -1. order is running
+ * order and comp the feedback loop of each module, as plan_compile has
+ * them. */
+void opt_fuse(plan *p, mod *mods, const char *live, const int *comp,
+		const int *order, int *fuse_into);
+/* The program for the step running root and everything fused into it,
+ * and the (module, port) read by each of the step's inputs. Returns the
+ * number of inputs, -1 if it needs too many. */
+int opt_program(mod *mods, int root, const int *fuse_into, opt_fused *f,
+		int *in_mod, int *in_port);
+void opt_fused_kernel(plan_step *s, float *pool, int nframes);
+#endif
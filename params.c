@@ -0,0 +1,48 @@
+#include "params.h"
+#include <string.h>
+
+void param_queue_init(param_queue *q, param_event *buf, unsigned int size) {
+	memset(q, 0, sizeof(param_queue));
+	q->events = buf;
+	q->size = size;
+}
+
+// Producer side. Returns -1 and drops the event when the ring is full.
+int param_queue_push(param_queue *q, param_event *ev) {
+	unsigned int tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	unsigned int head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	if(tail - head == q->size)
+		return -1;
+
+	q->events[tail & (q->size - 1)] = *ev;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Producer side, all n events or none. The consumer sees them all at once,
+ * so ones for the same frame land in the same block. */
+int param_queue_push_n(param_queue *q, param_event *evs, int n) {
+	unsigned int tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	unsigned int head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	if(q->size - (tail - head) < (unsigned int)n)
+		return -1;
+
+	for(int i = 0; i < n; i++)
+		q->events[(tail + i) & (q->size - 1)] = evs[i];
+	__atomic_store_n(&q->tail, tail + n, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// Consumer side. The event stays valid until param_queue_pop.
+param_event *param_queue_peek(param_queue *q) {
+	unsigned int head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	unsigned int tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	if(head == tail)
+		return NULL;
+	return &q->events[head & (q->size - 1)];
+}
+
+void param_queue_pop(param_queue *q) {
+	unsigned int head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,38 @@
+#ifndef PARAMS_H
+#define PARAMS_H
+#include <stdint.h>
+
+/* Single producer, single consumer ring of parameter changes and notes. The UI
+ * thread pushes, the audio thread drains at block boundaries. Events must
+ * be pushed in non-decreasing frame order, the consumer stops at the
+ * first event that lies beyond the block being processed. */
+#define PARAM_CST 0 // set CST mod_id to val
+#define PARAM_NOTE_ON 1 // mod_id is the note, val the velocity
+#define PARAM_NOTE_OFF 2
+#define PARAM_CST_SMOOTH 3 // ramp CST mod_id over val seconds from now on
+typedef struct param_event {
+	uint64_t frame; // sample position the change takes effect at
+	int kind;
+	int mod_id;
+	float val;
+	uint64_t queued; // ns it was pushed at when measuring latency, else 0
+} param_event;
+
+#define PARAM_CACHE_LINE 64
+typedef struct param_queue {
+	param_event *events;
+	unsigned int size; // power of 2
+	// Keep the two indices on separate cache lines
+	char pad0[PARAM_CACHE_LINE];
+	unsigned int head; // next to read, written by the consumer only
+	char pad1[PARAM_CACHE_LINE];
+	unsigned int tail; // next to write, written by the producer only
+	char pad2[PARAM_CACHE_LINE];
+} param_queue;
+
+void param_queue_init(param_queue *q, param_event *buf, unsigned int size);
+int param_queue_push(param_queue *q, param_event *ev);
+int param_queue_push_n(param_queue *q, param_event *evs, int n);
+param_event *param_queue_peek(param_queue *q);
+void param_queue_pop(param_queue *q);
+#endif
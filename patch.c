@@ -0,0 +1,445 @@
+#define _POSIX_C_SOURCE 200809L
+#include "patch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PATCH_MAGIC "SYNB"
+
+// Start of a .synb, followed by the mods, inputs and strings arrays
+typedef struct patch_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t hash;
+	int32_t nmods;
+	int32_t ninputs;
+	int32_t nstrings;
+	int32_t pad;
+} patch_header;
+
+// FNV-1a, never 0 as that means any hash to patch_map
+uint64_t patch_hash(const char *src, size_t len) {
+	uint64_t h = 14695981039346656037ull;
+	for(size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)src[i];
+		h *= 1099511628211ull;
+	}
+	return h ? h : 1;
+}
+
+/*************************/
+// Parsing
+
+typedef struct parser {
+	const char *name;
+	const char *p;
+	const char *line_start;
+	int line;
+	int errors;
+	const patch_type *types;
+	patch *out;
+	int mods_cap;
+	int inputs_cap;
+	int strings_cap;
+	int *input_cols; // where each input was written, for later errors
+} parser;
+
+static void parse_error(parser *ps, const char *at, const char *fmt, ...) {
+	va_list args;
+	printf("ERROR: %s:%i:%i: ", ps->name, ps->line, (int)(at - ps->line_start) + 1);
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+	printf("\n");
+	ps->errors++;
+}
+
+static int at_eol(parser *ps) { return '\n' == *ps->p || 0 == *ps->p; }
+static void skip_blank(parser *ps) {
+	while(' ' == *ps->p || '\t' == *ps->p || '\r' == *ps->p)
+		ps->p++;
+}
+static void skip_line(parser *ps) {
+	while(!at_eol(ps))
+		ps->p++;
+}
+
+// Digits up to PATCH_MAX_MODS, -1 if there are none or too many
+static int parse_uint(parser *ps) {
+	if(!isdigit((unsigned char)*ps->p))
+		return -1;
+	long v = 0;
+	while(isdigit((unsigned char)*ps->p)) {
+		if(v < PATCH_MAX_MODS)
+			v = v * 10 + (*ps->p - '0');
+		ps->p++;
+	}
+	return v < PATCH_MAX_MODS ? (int)v : -1;
+}
+
+static const patch_type *find_type(const patch_type *types, const char *name, int len) {
+	for(; types->name; types++)
+		if(3 == len && 0 == strncmp(types->name, name, 3))
+			return types;
+	return NULL;
+}
+
+static patch_mod *mod_slot(parser *ps, int n) {
+	patch *p = ps->out;
+	if(n >= ps->mods_cap) {
+		int cap = ps->mods_cap ? ps->mods_cap : 64;
+		while(cap <= n)
+			cap *= 2;
+		p->mods = realloc(p->mods, cap * sizeof(patch_mod));
+		memset(p->mods + ps->mods_cap, 0, (cap - ps->mods_cap) * sizeof(patch_mod));
+		ps->mods_cap = cap;
+	}
+	if(n >= p->nmods)
+		p->nmods = n + 1;
+	return &p->mods[n];
+}
+
+static void add_input(parser *ps, int mod, int port, int col) {
+	patch *p = ps->out;
+	if(p->ninputs == ps->inputs_cap) {
+		ps->inputs_cap = ps->inputs_cap ? 2 * ps->inputs_cap : 256;
+		p->inputs = realloc(p->inputs, ps->inputs_cap * sizeof(patch_input));
+		ps->input_cols = realloc(ps->input_cols, ps->inputs_cap * sizeof(int));
+	}
+	p->inputs[p->ninputs].mod = mod;
+	p->inputs[p->ninputs].port = port;
+	ps->input_cols[p->ninputs++] = col;
+}
+
+static int add_string(parser *ps, const char *s, int len) {
+	patch *p = ps->out;
+	if(p->nstrings + len + 1 > ps->strings_cap) {
+		while(p->nstrings + len + 1 > ps->strings_cap)
+			ps->strings_cap = ps->strings_cap ? 2 * ps->strings_cap : 1024;
+		p->strings = realloc(p->strings, ps->strings_cap);
+	}
+	int at = p->nstrings;
+	memcpy(p->strings + at, s, len);
+	p->strings[at + len] = 0;
+	p->nstrings += len + 1;
+	return at;
+}
+
+// "value UI-type label", the type is optional as it always has been
+static int parse_cst(parser *ps, patch_mod *m) {
+	char *end = NULL;
+	skip_blank(ps);
+	if(!at_eol(ps))
+		m->val = strtof(ps->p, &end);
+	if(!end || end == ps->p || !(0 == *end || isspace((unsigned char)*end))) {
+		parse_error(ps, ps->p, "expected a value for CST");
+		return -1;
+	}
+	ps->p = end;
+	skip_blank(ps);
+
+	static const char *ui_types[] = {"HFO", "LFO", "PER", "NDS", NULL};
+	int found = 0;
+	for(int i = 0; ui_types[i] && !found; i++)
+		if(0 == strncmp(ps->p, ui_types[i], 3) &&
+				(0 == ps->p[3] || isspace((unsigned char)ps->p[3]))) {
+			memcpy(m->cst_type, ui_types[i], 3);
+			ps->p += 3;
+			found = 1;
+		}
+	if(!found)
+		printf("WARNING: %s:%i:%i: CST UI type should be HFO, LFO, PER or NDS\n",
+				ps->name, ps->line, (int)(ps->p - ps->line_start) + 1);
+	skip_blank(ps);
+
+	const char *label = ps->p;
+	skip_line(ps);
+	const char *end_label = ps->p;
+	while(end_label > label && isspace((unsigned char)end_label[-1]))
+		end_label--;
+	m->label = add_string(ps, label, end_label - label);
+	return 0;
+}
+
+// The rest of the line, e.g. SEQ's sequence
+static int parse_file(parser *ps, patch_mod *m, const patch_type *t, int n) {
+	skip_blank(ps);
+	const char *name = ps->p;
+	skip_line(ps);
+	const char *end = ps->p;
+	while(end > name && isspace((unsigned char)end[-1]))
+		end--;
+	if(end == name) {
+		parse_error(ps, name, "expected a file name for %s %i", t->name, n);
+		return -1;
+	}
+	m->label = add_string(ps, name, end - name);
+	return 0;
+}
+
+static int parse_inputs(parser *ps, patch_mod *m, const patch_type *t, int n) {
+	for(int i = 0; i < t->ninputs; i++) {
+		skip_blank(ps);
+		const char *at = ps->p;
+		int mod = parse_uint(ps);
+		int port = -1;
+		if(mod >= 0 && '/' == *ps->p) {
+			ps->p++;
+			port = parse_uint(ps);
+		}
+		if(port < 0) {
+			if(at_eol(ps) && at == ps->p)
+				parse_error(ps, at, "%s %i needs %i inputs, found %i",
+						t->name, n, t->ninputs, i);
+			else
+				parse_error(ps, at, "input %i of %s %i should be module/port",
+						i, t->name, n);
+			return -1;
+		}
+		add_input(ps, mod, port, at - ps->line_start + 1);
+	}
+	skip_blank(ps);
+	if(t->option && isdigit((unsigned char)*ps->p)) {
+		const char *at = ps->p;
+		int v = parse_uint(ps);
+		if(v < 0 || !(at_eol(ps) || isspace((unsigned char)*ps->p))) {
+			parse_error(ps, at, "bad number after the inputs of %s %i", t->name, n);
+			return -1;
+		}
+		m->val = v;
+		skip_blank(ps);
+	}
+	if(!at_eol(ps)) {
+		parse_error(ps, ps->p, "unexpected '%c' after the inputs of %s %i",
+				*ps->p, t->name, n);
+		return -1;
+	}
+	return 0;
+}
+
+// "number TYPE ...", leaves p at the end of the line
+static int parse_line(parser *ps) {
+	skip_blank(ps);
+	if(at_eol(ps))
+		return 0;
+
+	const char *num = ps->p;
+	int n = parse_uint(ps);
+	if(n < 0) {
+		if(isdigit((unsigned char)*num))
+			parse_error(ps, num, "module number too big, %i at most", PATCH_MAX_MODS - 1);
+		else
+			parse_error(ps, num, "expected a module number");
+		return -1;
+	}
+
+	skip_blank(ps);
+	const char *at = ps->p;
+	while(isalnum((unsigned char)*ps->p))
+		ps->p++;
+	const patch_type *t = find_type(ps->types, at, ps->p - at);
+	if(!t) {
+		if(at == ps->p)
+			parse_error(ps, at, "expected a module type");
+		else
+			parse_error(ps, at, "unknown module type '%.*s'", (int)(ps->p - at), at);
+		return -1;
+	}
+
+	patch_mod *m = mod_slot(ps, n);
+	if(m->type[0]) {
+		parse_error(ps, num, "module %i already defined on line %i", n, m->line);
+		return -1;
+	}
+	memcpy(m->type, t->name, 3);
+	m->line = ps->line;
+	m->first_input = ps->out->ninputs;
+	m->ninputs = t->ninputs;
+	m->label = -1;
+	if(t->file)
+		return parse_file(ps, m, t, n);
+	return t->cst ? parse_cst(ps, m) : parse_inputs(ps, m, t, n);
+}
+
+// Inputs can point forwards, so they are checked once everything is read
+static void check_inputs(parser *ps) {
+	patch *p = ps->out;
+	for(int n = 0; n < p->nmods; n++) {
+		patch_mod *m = &p->mods[n];
+		if(!m->type[0])
+			continue;
+		for(int i = 0; i < m->ninputs; i++) {
+			patch_input *in = &p->inputs[m->first_input + i];
+			const char *reason = NULL;
+			const patch_type *t = NULL;
+			if(in->mod >= p->nmods || !p->mods[in->mod].type[0])
+				reason = "doesn't exist";
+			else if(in->port >= (t = find_type(ps->types, p->mods[in->mod].type, 3))->noutputs)
+				reason = "has no such output";
+			if(reason) {
+				printf("ERROR: %s:%i:%i: input %i of %.3s %i reads %i/%i, module %i %s\n",
+						ps->name, m->line, ps->input_cols[m->first_input + i], i,
+						m->type, n, in->mod, in->port, in->mod, reason);
+				ps->errors++;
+			}
+		}
+	}
+}
+
+patch *patch_parse(const char *name, const char *src, size_t len,
+		const patch_type *types) {
+	parser ps;
+	memset(&ps, 0, sizeof(parser));
+	ps.name = name;
+	ps.p = src;
+	ps.line = 1;
+	ps.types = types;
+	ps.out = malloc(sizeof(patch));
+	memset(ps.out, 0, sizeof(patch));
+	ps.out->hash = patch_hash(src, len);
+
+	while(ps.p < src + len) {
+		ps.line_start = ps.p;
+		if(parse_line(&ps))
+			skip_line(&ps); // carry on with the next line
+		if(0 == *ps.p)
+			break;
+		ps.p++;
+		ps.line++;
+	}
+	if(!ps.errors)
+		check_inputs(&ps);
+	free(ps.input_cols);
+
+	if(ps.errors) {
+		printf("%i errors in %s\n", ps.errors, name);
+		patch_free(ps.out);
+		return NULL;
+	}
+	return ps.out;
+}
+
+/*************************/
+// Binary patches
+
+patch *patch_map(const char *path, uint64_t hash) {
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) || st.st_size < (off_t)sizeof(patch_header)) {
+		close(fd);
+		return NULL;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(MAP_FAILED == map)
+		return NULL;
+
+	patch_header *h = (patch_header*)map;
+	if(memcmp(h->magic, PATCH_MAGIC, 4) || PATCH_VERSION != h->version ||
+			(hash && hash != h->hash) ||
+			h->nmods < 0 || h->nmods > PATCH_MAX_MODS ||
+			h->ninputs < 0 || h->nstrings < 0 ||
+			(size_t)st.st_size != sizeof(patch_header) +
+			h->nmods * sizeof(patch_mod) + h->ninputs * sizeof(patch_input) +
+			h->nstrings) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	patch *p = malloc(sizeof(patch));
+	p->hash = h->hash;
+	p->nmods = h->nmods;
+	p->ninputs = h->ninputs;
+	p->nstrings = h->nstrings;
+	p->mods = (patch_mod*)(h + 1);
+	p->inputs = (patch_input*)(p->mods + p->nmods);
+	p->strings = (char*)(p->inputs + p->ninputs);
+	p->map = map;
+	p->map_len = st.st_size;
+
+	// Nothing in it may point outside it
+	int ok = 0 == p->nstrings || 0 == p->strings[p->nstrings - 1];
+	for(int n = 0; ok && n < p->nmods; n++) {
+		patch_mod *m = &p->mods[n];
+		ok = !m->type[0] || (m->first_input >= 0 && m->ninputs >= 0 &&
+				m->first_input + m->ninputs <= p->ninputs &&
+				m->label >= -1 && m->label < p->nstrings);
+	}
+	for(int i = 0; ok && i < p->ninputs; i++)
+		ok = p->inputs[i].mod >= 0 && p->inputs[i].mod < p->nmods &&
+			p->inputs[i].port >= 0;
+	if(!ok) {
+		printf("ERROR: %s is damaged\n", path);
+		patch_free(p);
+		return NULL;
+	}
+	return p;
+}
+
+// Creates any missing directories on the way to path
+void patch_make_dirs(const char *path) {
+	char dir[1024];
+	snprintf(dir, sizeof(dir), "%s", path);
+	for(char *s = dir + 1; *s; s++)
+		if('/' == *s) {
+			*s = 0;
+			mkdir(dir, 0755);
+			*s = '/';
+		}
+}
+
+// Written to a temporary file and renamed so readers never see half of one
+int patch_save(patch *p, const char *path) {
+	char tmp[1024];
+	patch_header h;
+	memset(&h, 0, sizeof(patch_header));
+	memcpy(h.magic, PATCH_MAGIC, 4);
+	h.version = PATCH_VERSION;
+	h.hash = p->hash;
+	h.nmods = p->nmods;
+	h.ninputs = p->ninputs;
+	h.nstrings = p->nstrings;
+
+	patch_make_dirs(path);
+	snprintf(tmp, sizeof(tmp), "%s.%i.tmp", path, (int)getpid());
+	FILE *f = fopen(tmp, "wb");
+	if(!f) {
+		printf("ERROR: Can't write %s. %s\n", tmp, strerror(errno));
+		return -1;
+	}
+	int ok = 1 == fwrite(&h, sizeof(patch_header), 1, f) &&
+		(size_t)p->nmods == fwrite(p->mods, sizeof(patch_mod), p->nmods, f) &&
+		(size_t)p->ninputs == fwrite(p->inputs, sizeof(patch_input), p->ninputs, f) &&
+		(size_t)p->nstrings == fwrite(p->strings, 1, p->nstrings, f);
+	ok = 0 == fclose(f) && ok;
+	if(!ok || rename(tmp, path)) {
+		printf("ERROR: Can't write %s. %s\n", path, strerror(errno));
+		remove(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+void patch_free(patch *p) {
+	if(p->map) {
+		munmap(p->map, p->map_len);
+	} else {
+		free(p->mods);
+		free(p->inputs);
+		free(p->strings);
+	}
+	free(p);
+}
+
+void patch_cache_path(char *path, size_t len, const char *dir, uint64_t hash) {
+	snprintf(path, len, "%s/%016llx.synb", dir, (unsigned long long)hash);
+}
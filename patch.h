@@ -0,0 +1,71 @@
+#ifndef PATCH_H
+#define PATCH_H
+#include <stdint.h>
+#include <stddef.h>
+
+/* A patch as written in a layout file, before any modules are made.
+ *
+ * Layout text is parsed in one pass over the whole file, every error is
+ * reported as file:line:col and parsing carries on with the next line so
+ * one run shows them all. The result is flat arrays with no pointers, so
+ * it can be saved as a .synb file and later mmap'ed and used as it is.
+ *
+ * .synb files are found by the hash of the source text, an unchanged
+ * layout loads from its .synb without being parsed at all. */
+
+#define PATCH_MAX_MODS (1 << 20) // highest module number + 1
+#define PATCH_VERSION 1 // bump when the .synb layout changes
+
+// What the parser needs to know about each module type
+typedef struct patch_type {
+	const char *name; // 3 letters, as written in the file
+	int ninputs;
+	int noutputs;
+	int cst; // takes a value, UI type and label instead of inputs
+	int option; // may take a number after its inputs, e.g. OUT's channel
+	int file; // takes a file name instead of inputs
+} patch_type;
+
+typedef struct patch_input {
+	int32_t mod;
+	int32_t port;
+} patch_input;
+
+typedef struct patch_mod {
+	char type[4]; // empty for numbers not used in the file
+	int32_t line;
+	int32_t ninputs;
+	int32_t first_input; // into inputs
+	// CST's value, or the number after the inputs of types with an option
+	float val;
+	char cst_type[4];
+	int32_t label; // into strings, CST's label or the file name
+
+} patch_mod;
+
+typedef struct patch {
+	uint64_t hash; // of the source text
+	int nmods;
+	patch_mod *mods;
+	int ninputs;
+	patch_input *inputs;
+	int nstrings;
+	char *strings;
+
+	void *map; // the mapped .synb, NULL when parsed
+	size_t map_len;
+} patch;
+
+uint64_t patch_hash(const char *src, size_t len);
+// types ends with a NULL name, src[len] must be 0
+patch *patch_parse(const char *name, const char *src, size_t len,
+		const patch_type *types);
+// hash of 0 takes any .synb, NULL if missing, stale or damaged
+patch *patch_map(const char *path, uint64_t hash);
+int patch_save(patch *p, const char *path);
+void patch_free(patch *p);
+// Where the .synb for a hash lives in dir
+void patch_cache_path(char *path, size_t len, const char *dir, uint64_t hash);
+// Creates any missing directories on the way to path
+void patch_make_dirs(const char *path);
+#endif
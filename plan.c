@@ -0,0 +1,1044 @@
+#define _POSIX_C_SOURCE 200809L
+#include "plan.h"
+#include "optimize.h"
+#include "voice.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int validate(mod *mods, int nmods) {
+	int errors = 0;
+	for(int m = 0; m < nmods; m++) {
+		if(0 == mods[m].type[0]) {
+			printf("ERROR: Module %i is not defined\n", m);
+			errors++;
+			continue;
+		}
+		for(int i = 0; i < mods[m].nins; i++) {
+			int src = mods[m].inputs[i];
+			int port = mods[m].input_idxs[i];
+			if(src < 0 || src >= nmods || 0 == mods[src].type[0]) {
+				printf("ERROR: Module %i input %i refers to missing module %i\n",
+						m, i, src);
+				errors++;
+			} else if(port < 0 || port >= mods[src].nouts) {
+				printf("ERROR: Module %i input %i refers to port %i of %c%c%c %i which has %i outputs\n",
+						m, i, port, mods[src].type[0], mods[src].type[1], mods[src].type[2],
+						src, mods[src].nouts);
+				errors++;
+			}
+		}
+	}
+	return errors ? -1 : 0;
+}
+
+/* Tarjan's strongly connected components, iterative so that huge patches
+ * can't blow the stack. Edges are followed from consumer to producer so a
+ * component is only emitted after everything it reads from, which makes
+ * the emission order a valid execution order. comp[m] gets the component
+ * number of module m and order[] lists modules component by component. */
+static int find_components(mod *mods, int nmods, int *comp, int *order) {
+	int *index = malloc(nmods * sizeof(int));
+	int *low = malloc(nmods * sizeof(int));
+	int *next_in = malloc(nmods * sizeof(int));
+	char *on_stack = malloc(nmods);
+	int *stack = malloc(nmods * sizeof(int));
+	int *calls = malloc(nmods * sizeof(int));
+	int nstack = 0, ncalls = 0, counter = 0, ncomps = 0, norder = 0;
+
+	for(int m = 0; m < nmods; m++) {
+		index[m] = -1;
+		on_stack[m] = 0;
+	}
+
+	for(int root = 0; root < nmods; root++) {
+		if(index[root] >= 0) continue;
+		calls[ncalls++] = root;
+		index[root] = low[root] = counter++;
+		next_in[root] = 0;
+		stack[nstack++] = root;
+		on_stack[root] = 1;
+
+		while(ncalls) {
+			int v = calls[ncalls - 1];
+			if(next_in[v] < mods[v].nins) {
+				int w = mods[v].inputs[next_in[v]++];
+				if(index[w] < 0) {
+					index[w] = low[w] = counter++;
+					next_in[w] = 0;
+					stack[nstack++] = w;
+					on_stack[w] = 1;
+					calls[ncalls++] = w;
+				} else if(on_stack[w] && index[w] < low[v])
+					low[v] = index[w];
+				continue;
+			}
+
+			ncalls--;
+			if(low[v] == index[v]) {
+				int w;
+				do {
+					w = stack[--nstack];
+					on_stack[w] = 0;
+					comp[w] = ncomps;
+					order[norder++] = w;
+				} while(w != v);
+				ncomps++;
+			}
+			if(ncalls) {
+				int parent = calls[ncalls - 1];
+				if(low[v] < low[parent])
+					low[parent] = low[v];
+			}
+		}
+	}
+
+	free(index);
+	free(low);
+	free(next_in);
+	free(on_stack);
+	free(stack);
+	free(calls);
+	return ncomps;
+}
+
+static int lanes_of(plan *p, int m) { return p->voiced[m] ? p->lanes : 1; }
+
+// Pool floats rounded up to whole cache lines
+static int pad_floats(int n) {
+	int line = PLAN_ALIGN / sizeof(float);
+	return (n + line - 1) / line * line;
+}
+
+// Everything downstream of a voice source runs per voice, up to the mono sinks
+static void classify_voices(plan *p, mod *mods, int nmods) {
+	int changed = 1;
+	for(int m = 0; m < nmods; m++)
+		p->voiced[m] = mods[m].voicing == PLAN_VOICE_SOURCE;
+	while(changed) {
+		changed = 0;
+		for(int m = 0; m < nmods; m++) {
+			if(p->voiced[m] || mods[m].voicing == PLAN_VOICE_NEVER) continue;
+			for(int i = 0; i < mods[m].nins; i++)
+				if(p->voiced[mods[m].inputs[i]]) {
+					p->voiced[m] = changed = 1;
+					break;
+				}
+		}
+	}
+}
+
+/* In running order, so every input has its rate before the modules
+ * reading it. Feedback loops run a frame at a time so they and anything
+ * per voice run at audio rate. */
+static void classify_rates(plan *p, mod *mods, int nmods, int *comp,
+		int *order) {
+	for(int i = 0; i < nmods; i++) {
+		int m = order[i];
+		int fastest = PLAN_RATE_CONST;
+		for(int k = 0; k < mods[m].nins; k++) {
+			int src = mods[m].inputs[k];
+			int r = comp[src] == comp[m] ? PLAN_RATE_AUDIO : p->rate[src];
+			if(r > fastest)
+				fastest = r;
+		}
+		int r = mods[m].rate;
+		if(PLAN_RATE_CONST == fastest && mods[m].rate_if_const > r)
+			r = mods[m].rate_if_const;
+		if(fastest > r)
+			r = fastest;
+		if(p->control_period < 2 || p->voiced[m])
+			r = PLAN_RATE_AUDIO;
+		p->rate[m] = r;
+	}
+}
+
+// Copies a mono signal into every voice
+static void spread_kernel(plan_step *s, float *pool, int nframes) {
+	float *in = pool + s->in[0];
+	float *out = pool + s->out[0];
+	for(int f = 0; f < nframes; f++)
+		for(int v = 0; v < s->lanes; v++)
+			out[f * s->lanes + v] = in[f];
+}
+
+// Sums the voices down to mono, padding lanes are left out
+static void mix_kernel(plan_step *s, float *pool, int nframes) {
+	float *in = pool + s->in[0];
+	float *out = pool + s->out[0];
+	int voices = ((plan*)s->data)->voices;
+	for(int f = 0; f < nframes; f++) {
+		float sum = 0.;
+		for(int v = 0; v < voices; v++)
+			sum += in[f * s->lanes + v];
+		out[f] = sum;
+	}
+}
+
+// Control rate values out to audio rate, a tick late
+typedef struct plan_interp {
+	plan *plan;
+	float from; // the value at the last tick but one
+	float to; // and at the last tick
+	int primed;
+} plan_interp;
+void plan_interp_kernel(plan_step *s, float *pool, int nframes) {
+	plan_interp *in = (plan_interp*)s->data;
+	int period = in->plan->control_period;
+	float *ticks = pool + s->in[0];
+	float *out = pool + s->out[0];
+	float scale = 1.0f / (float)period;
+
+	int pos = in->plan->phase;
+	for(int f = 0; f < nframes; ) {
+		if(0 == pos) {
+			// The plan starts on a tick, so the first one sets both
+			in->from = in->primed ? in->to : *ticks;
+			in->to = *ticks++;
+			in->primed = 1;
+		}
+		int n = period - pos < nframes - f ? period - pos : nframes - f;
+		if(in->from == in->to) {
+			for(int k = 0; k < n; k++)
+				out[f + k] = in->to;
+		} else {
+			float d = in->to - in->from;
+			for(int k = 0; k < n; k++)
+				out[f + k] = in->from + d * ((float)(pos + k) * scale);
+		}
+		f += n;
+		pos = (pos + n) % period;
+	}
+}
+
+// Buffer length of a module in frames, ticks for the slower ones
+static int frames_of(plan *p, int m) {
+	if(PLAN_RATE_AUDIO == p->rate[m])
+		return p->block_size;
+	return (p->block_size + p->control_period - 1) / p->control_period;
+}
+
+static int port_offset(plan *p, int m, int port) {
+	return p->port_base[m] + port * frames_of(p, m) * lanes_of(p, m);
+}
+
+// Where a port's buffer is in the pool, -1 if it has none e.g. pruned or fused
+int plan_port_offset(plan *p, int m, int port) {
+	if(m < 0 || m >= p->nmods || p->port_base[m] < 0)
+		return -1;
+	return port_offset(p, m, port);
+}
+
+// Conversions are kept per producer port, voices then rate
+#define CONV_VOICES(src, port) (((src) * PLAN_MAX_PORTS + (port)) * 2)
+#define CONV_RATE(src, port) (CONV_VOICES(src, port) + 1)
+
+// The conversion m reading port of src goes through last, -1 for none
+static int conv_of(plan *p, int m, int src, int port) {
+	if(p->voiced[src] != p->voiced[m])
+		return CONV_VOICES(src, port);
+	if(PLAN_RATE_AUDIO != p->rate[src] && PLAN_RATE_AUDIO == p->rate[m])
+		return CONV_RATE(src, port);
+	return -1;
+}
+
+static int add_conversion(plan *p, plan_kernel kernel, int lanes, int in,
+		int pred, int *len, int *preds, int *pred_start) {
+	plan_step *s = &p->steps[p->nsteps++];
+	memset(s, 0, sizeof(plan_step));
+	s->kernel = kernel;
+	s->mod_id = -1;
+	s->lanes = lanes;
+	s->stride = 1;
+	s->cost = 3 * lanes;
+	s->used_outs = 1;
+	s->in[0] = in;
+	s->out[0] = *len;
+	*len += pad_floats(p->block_size * lanes);
+
+	int step = s - p->steps;
+	preds[pred_start[step]] = pred;
+	pred_start[step + 1] = pred_start[step] + 1;
+	return step;
+}
+
+/* Inputs crossing between mono and per voice modules go through a spread
+ * or mix step, from control to audio rate through an interp step. One
+ * step of each per producer port, shared by all its readers. Each new
+ * step waits on the step that produces its input. Everything per voice
+ * runs at audio rate, so a spread may read an interp but never the other
+ * way round. */
+static void add_conversions(plan *p, mod *mods, int m, int *conv, int *len,
+		int *step_of, int *conv_step, int *preds, int *pred_start) {
+	for(int i = 0; i < mods[m].nins; i++) {
+		int src = mods[m].inputs[i];
+		int port = mods[m].input_idxs[i];
+		int in = port_offset(p, src, port);
+		int pred = step_of[src];
+
+		int k = CONV_RATE(src, port);
+		if(PLAN_RATE_AUDIO != p->rate[src] && PLAN_RATE_AUDIO == p->rate[m]) {
+			if(conv[k] < 0) {
+				conv_step[k] = add_conversion(p, &plan_interp_kernel, 1, in, pred,
+						len, preds, pred_start);
+				conv[k] = p->steps[conv_step[k]].out[0];
+			}
+			in = conv[k];
+			pred = conv_step[k];
+		}
+
+		k = CONV_VOICES(src, port);
+		if(p->voiced[src] != p->voiced[m] && conv[k] < 0) {
+			conv_step[k] = add_conversion(p,
+					p->voiced[m] ? &spread_kernel : &mix_kernel, p->lanes, in, pred,
+					len, preds, pred_start);
+			conv[k] = p->steps[conv_step[k]].out[0];
+		}
+	}
+}
+
+// Pool offset of what m reads from port of src
+static int input_offset(plan *p, int m, int src, int port, int *conv) {
+	int k = conv_of(p, m, src, port);
+	return k >= 0 ? conv[k] : port_offset(p, src, port);
+}
+
+static void fill_step(plan *p, mod *mods, int m, plan_step *s, int *conv) {
+	memset(s, 0, sizeof(plan_step));
+	s->kernel = mods[m].process;
+	s->mod_id = m;
+	s->used_outs = p->used_outs[m];
+	s->lanes = lanes_of(p, m);
+	s->cost = (mods[m].cost ? mods[m].cost : 1) * s->lanes;
+	s->stride = 1;
+	if(PLAN_RATE_AUDIO != p->rate[m]) {
+		s->stride = p->control_period;
+		s->cost = (s->cost + s->stride - 1) / s->stride;
+		s->constant = PLAN_RATE_CONST == p->rate[m];
+	}
+	s->serial = mods[m].serial;
+	for(int i = 0; i < mods[m].nins; i++)
+		s->in[i] = input_offset(p, m, mods[m].inputs[i], mods[m].input_idxs[i], conv);
+	for(int i = 0; i < mods[m].nouts; i++)
+		s->out[i] = port_offset(p, m, i);
+}
+
+/* The step for root with everything fused into it. It reads what the
+ * members read from outside and writes root's output. */
+static void fill_fused(plan *p, mod *mods, int root, plan_step *s, int *conv,
+		opt_fused *f, int *in_mod, int *in_port, int nin) {
+	fill_step(p, mods, root, s, conv);
+	opt_fused *data = malloc(sizeof(opt_fused));
+	*data = *f;
+	s->kernel = &opt_fused_kernel;
+	s->data = data;
+	s->cost = 0;
+	for(int k = 0; k < f->nops; k++)
+		s->cost += mods[f->mods[k]].cost ? mods[f->mods[k]].cost : 1;
+	s->cost *= s->lanes;
+	if(s->stride > 1)
+		s->cost = (s->cost + s->stride - 1) / s->stride;
+	memset(s->in, 0, sizeof(s->in));
+	for(int k = 0; k < nin; k++)
+		s->in[k] = input_offset(p, root, in_mod[k], in_port[k], conv);
+}
+
+void plan_cycle_kernel(plan_step *s, float *pool, int nframes) {
+	plan_cycle *c = (plan_cycle*)s->data;
+	int lanes = c->lanes;
+
+	// Offsetting the pool moves every port buffer along by one frame
+	for(int f = 0; f < nframes; f++) {
+		float *p = pool + f * lanes;
+		for(int d = 0; d < c->ndelays; d++)
+			memcpy(&p[c->delays[d].out], c->delays[d].state, lanes * sizeof(float));
+		for(int m = 0; m < c->nmembers; m++)
+			c->members[m].kernel(&c->members[m], p, 1);
+		for(int d = 0; d < c->ndelays; d++)
+			memcpy(c->delays[d].state, &p[c->delays[d].in], lanes * sizeof(float));
+	}
+}
+
+/* Order the members of a feedback loop. Members whose inputs from inside
+ * the loop are all available go first. When nothing is ready the lowest
+ * numbered member is forced, and its pending inputs become delays. */
+static plan_cycle *make_cycle(plan *p, mod *mods, int *members, int n,
+		int *comp, int *conv, int *delay_base) {
+	plan_cycle *c = malloc(sizeof(plan_cycle));
+	c->members = malloc(n * sizeof(plan_step));
+	c->nmembers = 0;
+	c->delays = malloc(n * PLAN_MAX_PORTS * sizeof(plan_delay));
+	c->ndelays = 0;
+	// A loop is all voiced or all mono, it can't contain a mono sink
+	c->lanes = lanes_of(p, members[0]);
+
+	char *placed = calloc(n, 1);
+	int cid = comp[members[0]];
+
+	while(c->nmembers < n) {
+		int forced = -1, progress = 0;
+		for(int i = 0; i < n; i++) {
+			if(placed[i]) continue;
+			int m = members[i];
+			int ready = 1;
+			for(int k = 0; k < mods[m].nins && ready; k++) {
+				int src = mods[m].inputs[k];
+				if(comp[src] != cid) continue;
+				for(int j = 0; j < n; j++)
+					if(members[j] == src && !placed[j])
+						ready = 0;
+			}
+			if(ready) {
+				fill_step(p, mods, m, &c->members[c->nmembers++], conv);
+				placed[i] = 1;
+				progress = 1;
+			} else if(forced < 0 || m < members[forced])
+				forced = i;
+		}
+		if(progress) continue;
+
+		int m = members[forced];
+		plan_step *s = &c->members[c->nmembers++];
+		fill_step(p, mods, m, s, conv);
+		for(int k = 0; k < mods[m].nins; k++) {
+			int src = mods[m].inputs[k];
+			if(comp[src] != cid) continue;
+			int pending = 0;
+			for(int j = 0; j < n; j++)
+				if(members[j] == src && !placed[j])
+					pending = 1;
+			if(!pending) continue;
+
+			plan_delay *d = &c->delays[c->ndelays++];
+			d->in = s->in[k];
+			d->out = *delay_base;
+			s->in[k] = *delay_base;
+			*delay_base += pad_floats(p->block_size * c->lanes);
+			printf("Feedback: delaying input %i of module %i from module %i\n",
+					k, m, src);
+		}
+		placed[forced] = 1;
+	}
+
+	free(placed);
+	return c;
+}
+
+// Adds pred to a step's list unless it's the step itself or already there
+static void add_pred(int *preds, int *npreds, int step, int pred) {
+	if(pred == step) return;
+	for(int i = 0; i < *npreds; i++)
+		if(preds[i] == pred) return;
+	preds[(*npreds)++] = pred;
+}
+
+static void add_input_preds(plan *p, mod *mods, int m, int *step_of,
+		int *conv_step, int *preds, int *npreds) {
+	for(int i = 0; i < mods[m].nins; i++) {
+		int k = conv_of(p, m, mods[m].inputs[i], mods[m].input_idxs[i]);
+		if(k >= 0)
+			add_pred(preds, npreds, step_of[m], conv_step[k]);
+		else
+			add_pred(preds, npreds, step_of[m], step_of[mods[m].inputs[i]]);
+	}
+}
+
+// Turns the predecessor lists into successor lists
+static void link_steps(plan *p, int *preds, int *pred_start) {
+	p->npreds = calloc(p->nsteps, sizeof(int));
+	p->succ_start = calloc(p->nsteps + 1, sizeof(int));
+	p->succs = malloc((pred_start[p->nsteps] + 1) * sizeof(int));
+	int *fill = calloc(p->nsteps, sizeof(int));
+
+	for(int i = 0; i < p->nsteps; i++) {
+		p->npreds[i] = pred_start[i + 1] - pred_start[i];
+		for(int k = pred_start[i]; k < pred_start[i + 1]; k++)
+			p->succ_start[preds[k] + 1]++;
+	}
+	for(int i = 0; i < p->nsteps; i++)
+		p->succ_start[i + 1] += p->succ_start[i];
+	for(int i = 0; i < p->nsteps; i++)
+		for(int k = pred_start[i]; k < pred_start[i + 1]; k++)
+			p->succs[p->succ_start[preds[k]] + fill[preds[k]]++] = i;
+	free(fill);
+}
+
+/* Whether step i can go in a batch, the kernel needs every member to have
+ * a step of its own at audio rate */
+static int batchable(plan *p, mod *mods, int i) {
+	plan_step *s = &p->steps[i];
+	return s->mod_id >= 0 && mods[s->mod_id].batch && s->kernel == mods[s->mod_id].process &&
+		1 == s->lanes && 1 == s->stride && !s->serial && !s->constant;
+}
+
+/* Puts steps of the same batchable type that don't depend on each other
+ * into batch steps. A step can't reach any step before its first
+ * successor, steps are in order, so members are taken from before the
+ * first successor of all of them. A batch goes where its last member was,
+ * after all of their predecessors and before all of their successors.
+ * Returns how many steps went into batches. */
+static int batch_steps(plan *p, mod *mods, int *preds, int *pred_start) {
+	int n = p->nsteps;
+	int *first_succ = malloc(n * sizeof(int));
+	int *group = malloc(n * sizeof(int)); // batch step i went into, or i
+	int *from = malloc(n * sizeof(int)); // first member of the batch at i
+	int *members = malloc(PLAN_MAX_BATCH * sizeof(int));
+	for(int i = 0; i < n; i++) {
+		first_succ[i] = n;
+		group[i] = i;
+		from[i] = i;
+	}
+	for(int i = 0; i < n; i++)
+		for(int k = pred_start[i]; k < pred_start[i + 1]; k++)
+			if(i < first_succ[preds[k]])
+				first_succ[preds[k]] = i;
+
+	int nbatched = 0;
+	for(int i = 0; i < n; i++) {
+		if(group[i] != i || !batchable(p, mods, i)) continue;
+		plan_kernel batch = mods[p->steps[i].mod_id].batch;
+		int count = 0, limit = first_succ[i];
+		members[count++] = i;
+		for(int j = i + 1; j < limit && count < PLAN_MAX_BATCH; j++) {
+			if(group[j] != j || !batchable(p, mods, j) ||
+					mods[p->steps[j].mod_id].batch != batch)
+				continue;
+			members[count++] = j;
+			if(first_succ[j] < limit)
+				limit = first_succ[j];
+		}
+		if(count < 2) continue;
+
+		int last = members[count - 1];
+		from[last] = i;
+		plan_batch *b = malloc(sizeof(plan_batch));
+		b->members = malloc(count * sizeof(plan_step));
+		b->nmembers = count;
+		int cost = 0;
+		for(int k = 0; k < count; k++) {
+			b->members[k] = p->steps[members[k]];
+			if(b->members[k].cost > cost)
+				cost = b->members[k].cost;
+			group[members[k]] = last;
+		}
+		plan_step *s = &p->steps[last];
+		memset(s, 0, sizeof(plan_step));
+		s->kernel = batch;
+		s->data = b;
+		s->mod_id = -1;
+		s->lanes = 1;
+		s->stride = 1;
+		// A vector's worth runs in about twice the time of one
+		s->cost = 2 * cost;
+		s->batched = 1;
+		nbatched += count;
+	}
+
+	// Close up the gaps the batches left, preds move with their steps
+	int *index = malloc(n * sizeof(int));
+	int *np = malloc(n * sizeof(int));
+	int *old_start = malloc((n + 1) * sizeof(int));
+	memcpy(old_start, pred_start, (n + 1) * sizeof(int));
+	int nsteps = 0;
+	for(int i = 0; i < n; i++)
+		if(group[i] == i)
+			index[i] = nsteps++;
+	for(int i = 0; i < n; i++)
+		index[i] = index[group[i]];
+	int *merged = malloc((old_start[n] + 1) * sizeof(int));
+	int len = 0;
+	for(int i = 0; i < n; i++) {
+		if(group[i] != i) continue;
+		int step = index[i];
+		pred_start[step] = len;
+		np[step] = 0;
+		// A batch waits for whatever any of its members waited for
+		for(int j = from[i]; j <= i; j++) {
+			if(group[j] != i) continue;
+			for(int k = old_start[j]; k < old_start[j + 1]; k++)
+				add_pred(&merged[len], &np[step], step, index[preds[k]]);
+		}
+		len += np[step];
+		p->steps[step] = p->steps[i];
+	}
+	pred_start[nsteps] = len;
+	memcpy(preds, merged, len * sizeof(int));
+	for(int m = 0; m < p->nmods; m++)
+		if(p->mod_step[m] >= 0)
+			p->mod_step[m] = index[p->mod_step[m]];
+	p->nsteps = nsteps;
+
+	free(first_succ);
+	free(group);
+	free(from);
+	free(members);
+	free(index);
+	free(np);
+	free(old_start);
+	free(merged);
+	return nbatched;
+}
+
+// Bump allocation, every piece starts on a new cache line
+typedef struct arena {
+	char *base; // NULL while only measuring
+	size_t used;
+} arena;
+static void *take(arena *a, size_t n) {
+	void *p = a->base ? a->base + a->used : NULL;
+	a->used += (n + PLAN_ALIGN - 1) / PLAN_ALIGN * PLAN_ALIGN;
+	return p;
+}
+
+// Where a step's kernel finds its settings or running state
+static void *step_data(plan *p, mod *mods, plan_step *s) {
+	if(s->mod_id < 0) // spread and mix
+		return p;
+	return p->states[s->mod_id] ? p->states[s->mod_id] : mods[s->mod_id].data;
+}
+
+/* Copies a plan built in scratch memory into a's block, mods[].data ends
+ * up there too. With no block it only adds up what it would take. */
+static plan *pack(plan *s, mod *mods, arena *a) {
+	int nmods = s->nmods, nsteps = s->nsteps;
+	plan *p = take(a, sizeof(plan));
+	plan_step *steps = take(a, nsteps * sizeof(plan_step));
+	int *port_base = take(a, nmods * sizeof(int));
+	int *used_outs = take(a, nmods * sizeof(int));
+	int *mod_step = take(a, nmods * sizeof(int));
+	char *voiced = take(a, nmods);
+	char *rate = take(a, nmods);
+	void **states = take(a, nmods * sizeof(void*));
+	int *npreds = take(a, nsteps * sizeof(int));
+	int *succ_start = take(a, (nsteps + 1) * sizeof(int));
+	int *succs = take(a, (s->succ_start[nsteps] + 1) * sizeof(int));
+	uint64_t *ticks = take(a, nsteps * sizeof(uint64_t));
+	if(a->base) {
+		*p = *s;
+		memcpy(steps, s->steps, nsteps * sizeof(plan_step));
+		memcpy(port_base, s->port_base, nmods * sizeof(int));
+		memcpy(used_outs, s->used_outs, nmods * sizeof(int));
+		memcpy(mod_step, s->mod_step, nmods * sizeof(int));
+		memcpy(voiced, s->voiced, nmods);
+		memcpy(rate, s->rate, nmods);
+		memcpy(npreds, s->npreds, nsteps * sizeof(int));
+		memcpy(succ_start, s->succ_start, (nsteps + 1) * sizeof(int));
+		memcpy(succs, s->succs, s->succ_start[nsteps] * sizeof(int));
+		p->steps = steps;
+		p->port_base = port_base;
+		p->used_outs = used_outs;
+		p->mod_step = mod_step;
+		p->voiced = voiced;
+		p->rate = rate;
+		p->states = states;
+		p->npreds = npreds;
+		p->succ_start = succ_start;
+		p->succs = succs;
+		p->ticks = ticks;
+	}
+
+	for(int m = 0; m < nmods; m++) {
+		void *data = mods[m].data_size ? take(a, mods[m].data_size) : NULL;
+		void *state = mods[m].state_size ?
+			take(a, mods[m].state_size(lanes_of(s, m))) : NULL;
+		if(a->base) {
+			mods[m].data = data;
+			states[m] = state;
+		}
+	}
+
+	for(int i = 0; i < nsteps; i++) {
+		if(s->steps[i].kernel == &plan_interp_kernel) {
+			plan_interp *in = take(a, sizeof(plan_interp));
+			if(a->base) {
+				in->plan = p;
+				steps[i].data = in;
+			}
+			continue;
+		}
+		if(s->steps[i].kernel == &opt_fused_kernel) {
+			opt_fused *f = take(a, sizeof(opt_fused));
+			if(a->base) {
+				*f = *(opt_fused*)s->steps[i].data;
+				steps[i].data = f;
+			}
+			continue;
+		}
+		if(s->steps[i].batched) {
+			plan_batch *sb = (plan_batch*)s->steps[i].data;
+			plan_batch *b = take(a, sizeof(plan_batch));
+			plan_step *members = take(a, sb->nmembers * sizeof(plan_step));
+			if(a->base) {
+				*b = *sb;
+				memcpy(members, sb->members, sb->nmembers * sizeof(plan_step));
+				for(int k = 0; k < sb->nmembers; k++)
+					members[k].data = step_data(p, mods, &members[k]);
+				b->members = members;
+				steps[i].data = b;
+			}
+			continue;
+		}
+		if(s->steps[i].kernel != &plan_cycle_kernel) {
+			if(a->base)
+				steps[i].data = step_data(p, mods, &steps[i]);
+			continue;
+		}
+		plan_cycle *sc = (plan_cycle*)s->steps[i].data;
+		plan_cycle *c = take(a, sizeof(plan_cycle));
+		plan_step *members = take(a, sc->nmembers * sizeof(plan_step));
+		plan_delay *delays = take(a, sc->ndelays * sizeof(plan_delay));
+		if(a->base) {
+			*c = *sc;
+			memcpy(members, sc->members, sc->nmembers * sizeof(plan_step));
+			memcpy(delays, sc->delays, sc->ndelays * sizeof(plan_delay));
+			for(int k = 0; k < sc->nmembers; k++)
+				members[k].data = step_data(p, mods, &members[k]);
+			c->members = members;
+			c->delays = delays;
+			steps[i].data = c;
+		}
+		for(int d = 0; d < sc->ndelays; d++) {
+			float *state = take(a, sc->lanes * sizeof(float));
+			if(a->base)
+				delays[d].state = state;
+		}
+	}
+
+	float *pool = take(a, (s->pool_len ? s->pool_len : 1) * sizeof(float));
+	if(a->base)
+		p->pool = pool;
+	return p;
+}
+
+// Everything plan_compile built before packing
+static void free_scratch(plan *p) {
+	for(int i = 0; i < p->nsteps; i++) {
+		if(p->steps[i].kernel == &opt_fused_kernel)
+			free(p->steps[i].data);
+		if(p->steps[i].batched) {
+			plan_batch *b = (plan_batch*)p->steps[i].data;
+			free(b->members);
+			free(b);
+		}
+		if(p->steps[i].kernel != &plan_cycle_kernel) continue;
+		plan_cycle *c = (plan_cycle*)p->steps[i].data;
+		free(c->members);
+		free(c->delays);
+		free(c);
+	}
+	free(p->steps);
+	free(p->port_base);
+	free(p->used_outs);
+	free(p->mod_step);
+	free(p->voiced);
+	free(p->rate);
+	free(p->npreds);
+	free(p->succ_start);
+	free(p->succs);
+	free(p);
+}
+
+plan *plan_compile(mod *mods, int nmods, int block_size, int voices,
+		int control_period, int optimize) {
+	if(nmods < 0)
+		return NULL;
+	if(validate(mods, nmods))
+		return NULL;
+
+	plan *p = malloc(sizeof(plan));
+	memset(p, 0, sizeof(plan));
+	p->nmods = nmods;
+	p->block_size = block_size;
+	p->voices = voices;
+	p->lanes = voice_lanes(voices);
+	p->control_period = control_period > 1 ? control_period : 1;
+	p->dirty = 2;
+
+	p->voiced = calloc(nmods, 1);
+	classify_voices(p, mods, nmods);
+
+	int *comp = malloc(nmods * sizeof(int));
+	int *order = malloc(nmods * sizeof(int));
+	int ncomps = find_components(mods, nmods, comp, order);
+	p->rate = calloc(nmods, 1);
+	classify_rates(p, mods, nmods, comp, order);
+
+	char *live = malloc(nmods);
+	int *fuse_into = malloc(nmods * sizeof(int));
+	if(optimize) {
+		opt_live(mods, nmods, live);
+		opt_fuse(p, mods, live, comp, order, fuse_into);
+	} else {
+		memset(live, 1, nmods);
+		for(int m = 0; m < nmods; m++)
+			fuse_into[m] = -1;
+	}
+
+	// Pruned and fused modules get no buffers
+	p->port_base = malloc(nmods * sizeof(int));
+	p->used_outs = calloc(nmods, sizeof(int));
+	p->mod_step = malloc(nmods * sizeof(int));
+	int len = 0, nins = 0;
+	for(int m = 0; m < nmods; m++) {
+		p->port_base[m] = -1;
+		p->mod_step[m] = -1;
+		if(!live[m]) continue;
+		if(fuse_into[m] < 0) {
+			p->port_base[m] = len;
+			len += pad_floats(mods[m].nouts * frames_of(p, m) * lanes_of(p, m));
+		}
+		nins += mods[m].nins;
+		for(int i = 0; i < mods[m].nins; i++)
+			p->used_outs[mods[m].inputs[i]] |= 1 << mods[m].input_idxs[i];
+	}
+
+	int *conv = malloc(2 * nmods * PLAN_MAX_PORTS * sizeof(int));
+	for(int i = 0; i < 2 * nmods * PLAN_MAX_PORTS; i++)
+		conv[i] = -1;
+	int *step_of = p->mod_step;
+	int *conv_step = malloc(2 * nmods * PLAN_MAX_PORTS * sizeof(int));
+	int *preds = malloc((3 * nins + 1) * sizeof(int));
+	int *pred_start = malloc((ncomps + 2 * nins + 1) * sizeof(int));
+	pred_start[0] = 0;
+
+	// Conversion and delay buffers go after the port buffers
+	p->steps = malloc((ncomps + 2 * nins) * sizeof(plan_step));
+	p->nsteps = 0;
+	int nfused = 0, nfused_steps = 0;
+	for(int i = 0; i < nmods; ) {
+		int n = 1;
+		while(i + n < nmods && comp[order[i + n]] == comp[order[i]])
+			n++;
+
+		int m = order[i];
+		if(!live[m]) {
+			i += n;
+			continue;
+		}
+		int self_loop = 0;
+		for(int k = 0; k < mods[m].nins; k++)
+			self_loop |= mods[m].inputs[k] == m;
+
+		for(int k = 0; k < n; k++)
+			add_conversions(p, mods, order[i + k], conv, &len,
+					step_of, conv_step, preds, pred_start);
+		// Runs as part of the step of the module it is fused into
+		if(fuse_into[m] >= 0) {
+			i += n;
+			continue;
+		}
+
+		opt_fused f = {0};
+		int in_mod[PLAN_MAX_PORTS], in_port[PLAN_MAX_PORTS], nin = 0;
+		if(optimize && mods[m].op)
+			nin = opt_program(mods, m, fuse_into, &f, in_mod, in_port);
+
+		int step = p->nsteps++;
+		plan_step *s = &p->steps[step];
+		for(int k = 0; k < n; k++)
+			step_of[order[i + k]] = step;
+		if(f.nops > 1) {
+			fill_fused(p, mods, m, s, conv, &f, in_mod, in_port, nin);
+			for(int k = 0; k < f.nops; k++)
+				step_of[f.mods[k]] = step;
+			nfused += f.nops - 1;
+			nfused_steps++;
+		} else if(n == 1 && !self_loop)
+			fill_step(p, mods, m, s, conv);
+		else {
+			memset(s, 0, sizeof(plan_step));
+			s->kernel = &plan_cycle_kernel;
+			plan_cycle *c = make_cycle(p, mods, &order[i], n, comp, conv, &len);
+			s->data = c;
+			s->mod_id = -1;
+			s->lanes = lanes_of(p, m);
+			s->stride = 1;
+			// Every frame goes through all the members one at a time
+			for(int k = 0; k < c->nmembers; k++)
+				s->cost += 4 * c->members[k].cost;
+		}
+		int np = 0;
+		for(int k = 0; k < n; k++)
+			add_input_preds(p, mods, order[i + k], step_of, conv_step,
+					&preds[pred_start[step]], &np);
+		for(int k = 0; k < f.nops - 1; k++)
+			add_input_preds(p, mods, f.mods[k], step_of, conv_step,
+					&preds[pred_start[step]], &np);
+		pred_start[step + 1] = pred_start[step] + np;
+		i += n;
+	}
+	int nbatched = optimize ? batch_steps(p, mods, preds, pred_start) : 0;
+	link_steps(p, preds, pred_start);
+	p->pool_len = len;
+
+	int nvoiced = 0, nslow = 0, nconst = 0, npruned = 0;
+	for(int m = 0; m < nmods; m++) {
+		nvoiced += p->voiced[m];
+		nslow += PLAN_RATE_AUDIO != p->rate[m];
+		nconst += PLAN_RATE_CONST == p->rate[m];
+		npruned += !live[m];
+	}
+	free(comp);
+	free(order);
+	free(live);
+	free(fuse_into);
+	free(conv);
+	free(conv_step);
+	free(preds);
+	free(pred_start);
+
+	// Measure, then move it all into one block
+	arena a = {NULL, 0};
+	pack(p, mods, &a);
+	size_t bytes = a.used;
+	void *block;
+	if(posix_memalign(&block, PLAN_ALIGN, bytes)) {
+		printf("ERROR: No memory for a %zu byte plan\n", bytes);
+		free_scratch(p);
+		return NULL;
+	}
+	memset(block, 0, bytes);
+	a.base = block;
+	a.used = 0;
+	plan *packed = pack(p, mods, &a);
+	packed->bytes = bytes;
+	free_scratch(p);
+
+	printf("Plan: %i modules in %i steps, %i frames of port buffers, %zu KB\n",
+			nmods, packed->nsteps, packed->pool_len, (bytes + 1023) / 1024);
+	if(nvoiced)
+		printf("Plan: %i modules run per voice, %i voices in %i lanes\n",
+				nvoiced, packed->voices, packed->lanes);
+	if(nslow)
+		printf("Plan: %i modules run once every %i frames, %i of them constant\n",
+				nslow, packed->control_period, nconst);
+	if(npruned || nfused)
+		printf("Plan: %i modules pruned, %i fused into %i steps\n",
+				npruned, nfused, nfused_steps);
+	if(nbatched)
+		printf("Plan: %i modules batched into vector lanes\n", nbatched);
+	return packed;
+}
+
+// What a step the plan added itself does, NULL for module steps
+const char *plan_step_name(plan_step *s) {
+	if(s->kernel == &spread_kernel) return "spread";
+	if(s->kernel == &mix_kernel) return "mix";
+	if(s->kernel == &plan_cycle_kernel) return "cycle";
+	if(s->kernel == &plan_interp_kernel) return "interp";
+	if(s->kernel == &opt_fused_kernel) return "fused";
+	if(s->batched) return "batch";
+	return NULL;
+}
+
+// Where the ticks fall in the next block, before running any of it
+void plan_begin(plan *p, int nframes) {
+	p->phase = p->frame % p->control_period;
+	int first = p->phase ? p->control_period - p->phase : 0;
+	p->nticks = first < nframes ? (nframes - first - 1) / p->control_period + 1 : 0;
+	p->frame += nframes;
+	p->refresh = p->dirty > 0 && p->nticks > 0;
+	if(p->refresh)
+		p->dirty--;
+}
+
+/* Something a constant module reads or holds changed in the block about
+ * to run. That block and the next rerun the constant steps, the second
+ * time clears what the change left over from before it. */
+void plan_touch(plan *p) {
+	p->dirty = 2;
+}
+
+/* Which of module m's frames the frame at offset into the next block
+ * lands on. For control rate modules that is the first tick at or after
+ * it, which may be in the block after. */
+int plan_frame_index(plan *p, int m, int offset) {
+	if(PLAN_RATE_AUDIO == p->rate[m])
+		return offset;
+	int phase = p->frame % p->control_period;
+	int first = phase ? p->control_period - phase : 0;
+	if(offset <= first)
+		return 0;
+	return (offset - first + p->control_period - 1) / p->control_period;
+}
+
+void plan_run_step(plan *p, int i, int nframes) {
+	/* Control rate steps work on the ticks instead of the frames, constant
+	 * ones fill every tick a block can have when they run at all */
+	if(p->steps[i].constant) {
+		if(!p->refresh)
+			return;
+		nframes = (p->block_size + p->control_period - 1) / p->control_period;
+	} else if(p->steps[i].stride > 1 && 0 == (nframes = p->nticks))
+		return;
+	if(!p->timed) {
+		p->steps[i].kernel(&p->steps[i], p->pool, nframes);
+		return;
+	}
+	uint64_t t0 = stats_ticks();
+	p->steps[i].kernel(&p->steps[i], p->pool, nframes);
+	p->ticks[i] = stats_ticks() - t0;
+}
+
+void plan_run(plan *p, int nframes) {
+	plan_begin(p, nframes);
+	for(int i = 0; i < p->nsteps; i++)
+		plan_run_step(p, i, nframes);
+}
+
+static const char *rate_names[] = {"const", "control", "audio"};
+
+// What got run how, and what the optimizer did to it
+void plan_dump(plan *p, mod *mods, FILE *f) {
+	fprintf(f, "Plan for %i modules, %i frame blocks, %i voices, a tick every %i frames\n",
+			p->nmods, p->block_size, p->voices, p->control_period);
+	for(int i = 0; i < p->nsteps; i++) {
+		plan_step *s = &p->steps[i];
+		const char *name = plan_step_name(s);
+		fprintf(f, "%4i ", i);
+		if(s->mod_id >= 0)
+			fprintf(f, "%c%c%c %-4i %-7s", mods[s->mod_id].type[0],
+					mods[s->mod_id].type[1], mods[s->mod_id].type[2], s->mod_id,
+					rate_names[(int)p->rate[s->mod_id]]);
+		else
+			fprintf(f, "%-8s %-7s", name, s->stride > 1 ? "control" : "audio");
+		fprintf(f, " lanes %i cost %i%s%s", s->lanes, s->cost,
+				s->constant ? " constant" : "", s->serial ? " serial" : "");
+		if(s->kernel == &opt_fused_kernel) {
+			opt_fused *o = (opt_fused*)s->data;
+			fprintf(f, " fused");
+			for(int k = 0; k < o->nops; k++)
+				fprintf(f, " %c%c%c %i", mods[o->mods[k]].type[0],
+						mods[o->mods[k]].type[1], mods[o->mods[k]].type[2], o->mods[k]);
+		} else if(s->kernel == &plan_cycle_kernel) {
+			plan_cycle *c = (plan_cycle*)s->data;
+			fprintf(f, " of");
+			for(int k = 0; k < c->nmembers; k++)
+				fprintf(f, " %i", c->members[k].mod_id);
+			fprintf(f, ", %i delays", c->ndelays);
+		} else if(s->batched) {
+			plan_batch *b = (plan_batch*)s->data;
+			fprintf(f, " of");
+			for(int k = 0; k < b->nmembers; k++)
+				fprintf(f, " %c%c%c %i", mods[b->members[k].mod_id].type[0],
+						mods[b->members[k].mod_id].type[1],
+						mods[b->members[k].mod_id].type[2], b->members[k].mod_id);
+		}
+		fprintf(f, "\n");
+	}
+	int pruned = 0;
+	for(int m = 0; m < p->nmods; m++)
+		if(p->mod_step[m] < 0) {
+			if(!pruned++)
+				fprintf(f, "Pruned, nothing reaches a sink from:");
+			fprintf(f, " %c%c%c %i", mods[m].type[0], mods[m].type[1], mods[m].type[2], m);
+		}
+	if(pruned)
+		fprintf(f, "\n");
+	fprintf(f, "%i frames of port buffers, %zu bytes in all\n", p->pool_len, p->bytes);
+}
+
+void plan_free(plan *p) {
+	free(p);
+}
@@ -0,0 +1,161 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+/* A loaded patch is a list of modules wired together by (module, port)
+ * references. plan_compile validates the wiring, orders the modules so
+ * every module runs after the modules it reads from, and lays all port
+ * buffers out in one pool. The engine then just walks a flat array of
+ * steps, each holding its kernel and the pool offsets of its ports.
+ *
+ * A compiled plan is a single block of memory holding the plan, its
+ * steps, the settings and running state of every module and the pool.
+ * Each module's pieces start on a cache line of their own so modules run
+ * by different threads never share one. plan_free is one free.
+ *
+ * Slow moving parts of a patch run at control rate, once every
+ * control_period frames counted from the plan's first frame, so where
+ * blocks start makes no difference. A control rate module's buffers hold
+ * one value per tick, audio rate modules reading it get a straight line
+ * from one tick's value to the next, a tick late.
+ *
+ * Constant modules run in the first two blocks with ticks, then only
+ * again after plan_touch, their buffers keep the values in between. With
+ * optimize set plan_compile also prunes and fuses, see optimize.h, and
+ * puts mono steps that don't depend on each other and have a batch kernel
+ * into one step, so they can share the lanes of a vector. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define PLAN_MAX_PORTS 5
+#define PLAN_ALIGN 64 // bytes, a cache line
+#define PLAN_MAX_BATCH 4 // steps in a batch, the floats in a vector
+
+// How often a module must run, each is faster than the one before
+#define PLAN_RATE_CONST 0 // output never changes on its own
+#define PLAN_RATE_CONTROL 1 // once per tick
+#define PLAN_RATE_AUDIO 2 // every frame
+
+// Elementwise arithmetic the optimizer can fuse, see optimize.h
+#define PLAN_OP_NONE 0
+#define PLAN_OP_ADD 1 // in 0 + in 1
+#define PLAN_OP_MUL 2 // in 0 * in 1
+#define PLAN_OP_MIX 3 // in 0 * (1 - in 2) + in 1 * in 2
+
+// How a module takes part in polyphony
+#define PLAN_VOICE_ANY 0 // per voice if anything it reads is
+#define PLAN_VOICE_SOURCE 1 // always per voice, e.g. KEY
+#define PLAN_VOICE_NEVER 2 // always mono, voices get summed into it
+
+struct plan_step;
+typedef void (*plan_kernel)(struct plan_step *s, float *pool, int nframes);
+
+typedef struct mod {
+	char type[3];
+	int nins;
+	int nouts;
+	int *inputs; // producing module for each input
+	int *input_idxs; // and which of its output ports
+	plan_kernel process;
+	void *data; // settings, shared by all voices, made by plan_compile
+	int data_size; // bytes of them, they start zeroed
+	int voicing;
+	/* PLAN_RATE_* it runs at, at least, it runs as fast as its fastest
+	 * input too. When every input is constant it runs at rate_if_const if
+	 * that is faster, e.g. an oscillator at a fixed pitch. */
+	int rate;
+	int rate_if_const;
+	// Size of the running state for this many voices, the plan allocates it
+	int (*state_size)(int lanes);
+	int cost; // rough tenths of a ns per frame per voice, 0 for trivial
+	int serial; // touches global state e.g. the sound card, must be a sink
+	int op; // PLAN_OP_* it works out, if any
+	plan_kernel batch; // runs several mono steps of it at once, see plan_batch
+} mod;
+
+typedef struct plan_step {
+	plan_kernel kernel;
+	void *data;
+	int mod_id;
+	int used_outs; // bit per output port that something reads
+	int lanes; // voices interleaved in each buffer, 1 for mono
+	int stride; // frames each frame it works on stands for, 1 at audio rate
+	int cost; // estimated tenths of a ns per frame
+	int serial; // run on the audio thread after everything else
+	int constant; // only reruns after plan_touch
+	int batched; // data is a plan_batch
+	int in[PLAN_MAX_PORTS]; // pool offsets of the input buffers
+	int out[PLAN_MAX_PORTS]; // pool offsets of the output buffers
+} plan_step;
+
+// Feedback edge, the consumer sees the producer's previous sample
+typedef struct plan_delay {
+	int in;
+	int out;
+	float *state; // one per lane
+} plan_delay;
+
+/* Modules in a feedback loop can't run a block at a time, they are run
+ * together one frame at a time with delays on the edges that close the
+ * loop. */
+typedef struct plan_cycle {
+	plan_step *members;
+	int nmembers;
+	plan_delay *delays;
+	int ndelays;
+	int lanes;
+} plan_cycle;
+
+// Independent mono steps of one module type run by its batch kernel
+typedef struct plan_batch {
+	plan_step *members;
+	int nmembers;
+} plan_batch;
+
+typedef struct plan {
+	plan_step *steps;
+	int nsteps;
+	float *pool;
+	int pool_len;
+	int *port_base; // pool offset of output port 0 of each module
+	int *used_outs; // bit per output port of each module that is read
+	int *mod_step; // step running each module, -1 if it was pruned
+	int nmods;
+	void **states; // running state of each module, NULL if it has none
+	char *voiced; // module runs once per voice
+	char *rate; // PLAN_RATE_* each module runs at
+	int control_period; // frames per tick, 1 runs everything at audio rate
+	// Where the block being run falls
+	uint64_t frame; // frames run before it
+	int phase; // its first frame's distance from the last tick
+	int nticks; // ticks in it
+	int dirty; // blocks left that rerun constant steps
+	int refresh; // this block does
+	int block_size;
+	int voices;
+	int lanes; // voices padded for SIMD
+	// Dependencies between steps, for running independent ones in parallel
+	int *npreds; // steps each step waits for
+	int *succ_start; // successors of step i are succs[succ_start[i]..succ_start[i+1]]
+	int *succs;
+	int timed; // set to have the next run time every step into ticks
+	uint64_t *ticks;
+	size_t bytes; // of the whole block
+} plan;
+
+plan *plan_compile(mod *mods, int nmods, int block_size, int voices,
+		int control_period, int optimize);
+void plan_begin(plan *p, int nframes);
+void plan_touch(plan *p);
+void plan_run(plan *p, int nframes);
+void plan_run_step(plan *p, int i, int nframes);
+void plan_free(plan *p);
+const char *plan_step_name(plan_step *s);
+int plan_frame_index(plan *p, int m, int offset);
+int plan_port_offset(plan *p, int m, int port);
+void plan_dump(plan *p, mod *mods, FILE *f);
+// Kernels of steps the plan adds itself, for code calling them by name
+void plan_interp_kernel(plan_step *s, float *pool, int nframes);
+void plan_cycle_kernel(plan_step *s, float *pool, int nframes);
+#endif
@@ -0,0 +1,282 @@
+#define _GNU_SOURCE
+#include "schedule.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do {} while(0)
+#endif
+
+#define EMPTY -1
+
+static void deque_init(sched_deque *d, int capacity) {
+	int size = 1;
+	while(size < capacity)
+		size <<= 1;
+	memset(d, 0, sizeof(sched_deque));
+	d->tasks = malloc(size * sizeof(int));
+	d->mask = size - 1;
+}
+
+static void deque_push(sched_deque *d, int task) {
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->tasks[b & d->mask], task, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+static int deque_pop(sched_deque *d) {
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+	int task = EMPTY;
+
+	if(t <= b) {
+		task = __atomic_load_n(&d->tasks[b & d->mask], __ATOMIC_RELAXED);
+		if(t == b) {
+			// Last one, race the thieves for it
+			if(!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+						__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				task = EMPTY;
+			__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	} else
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	return task;
+}
+
+static int deque_steal(sched_deque *d) {
+	long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if(t >= b)
+		return EMPTY;
+
+	int task = __atomic_load_n(&d->tasks[t & d->mask], __ATOMIC_RELAXED);
+	if(!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return EMPTY;
+	return task;
+}
+
+static void run_step(sched *s, sched_worker *w, int i) {
+	plan *p = s->plan;
+	plan_run_step(p, i, s->nframes);
+	for(int k = p->succ_start[i]; k < p->succ_start[i + 1]; k++) {
+		int j = p->succs[k];
+		if(p->steps[j].serial) continue;
+		if(1 == __atomic_fetch_sub(&s->pending[j], 1, __ATOMIC_ACQ_REL))
+			deque_push(&w->deque, j);
+	}
+	__atomic_fetch_sub(&s->remaining, 1, __ATOMIC_RELEASE);
+}
+
+// Work until every parallel step of the block is done
+static void work(sched *s, sched_worker *w) {
+	int victim = w->id, idle = 0;
+
+	// Each thread starts on its share of the roots
+	for(int k = w->id; k < s->nroots; k += s->nthreads)
+		deque_push(&w->deque, s->roots[k]);
+
+	while(__atomic_load_n(&s->remaining, __ATOMIC_ACQUIRE) > 0) {
+		int task = deque_pop(&w->deque);
+		for(int k = 1; task == EMPTY && k < s->nthreads; k++) {
+			victim = (victim + 1) % s->nthreads;
+			if(victim != w->id)
+				task = deque_steal(&s->workers[victim].deque);
+		}
+		if(task != EMPTY) {
+			run_step(s, w, task);
+			idle = 0;
+		} else if(++idle % SCHED_YIELD == 0)
+			sched_yield(); // more threads than cores, let the busy one finish
+		else
+			cpu_relax();
+	}
+}
+
+/* Parked workers sleep on the generation itself. The kernel only puts
+ * them to sleep while it still holds seen, so a wake can't be missed, and
+ * waking them never blocks the audio thread. */
+static void park(sched *s, unsigned seen) {
+	syscall(SYS_futex, &s->generation, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+static void unpark(sched *s) {
+	syscall(SYS_futex, &s->generation, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Between blocks a worker spins for a while, then parks so an idle synth
+ * doesn't keep every core busy. */
+static void *worker_main(void *arg) {
+	sched_worker *w = (sched_worker*)arg;
+	sched *s = w->sched;
+	unsigned seen = 0;
+
+	while(1) {
+		unsigned gen;
+		int spins = 0;
+		while((gen = __atomic_load_n(&s->generation, __ATOMIC_ACQUIRE)) == seen) {
+			if(++spins < SCHED_SPIN) {
+				if(spins % SCHED_YIELD == 0)
+					sched_yield();
+				else
+					cpu_relax();
+				continue;
+			}
+			__atomic_add_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+			while(__atomic_load_n(&s->generation, __ATOMIC_SEQ_CST) == seen)
+				park(s, seen);
+			__atomic_sub_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+		}
+		seen = gen;
+		if(__atomic_load_n(&s->quit, __ATOMIC_ACQUIRE))
+			break;
+
+		work(s, w);
+		__atomic_add_fetch(&s->finished, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static void start_workers(sched *s) {
+	__atomic_add_fetch(&s->generation, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&s->sleepers, __ATOMIC_SEQ_CST))
+		unpark(s);
+}
+
+/* Estimated ns per block with n threads: the work shared out, but never
+ * faster than the longest chain of dependent steps, plus the cost of
+ * getting the extra threads through the block. */
+static int pick_threads(plan *p, int max_threads, double *work, double *path) {
+	double *finish = calloc(p->nsteps, sizeof(double));
+	double *start = calloc(p->nsteps, sizeof(double));
+	*work = *path = 0.;
+
+	// Steps are in execution order so predecessors are always done first
+	for(int i = 0; i < p->nsteps; i++) {
+		double cost = p->steps[i].cost * p->block_size / 10.;
+		*work += cost;
+		finish[i] = start[i] + cost;
+		if(finish[i] > *path)
+			*path = finish[i];
+		for(int k = p->succ_start[i]; k < p->succ_start[i + 1]; k++)
+			if(finish[i] > start[p->succs[k]])
+				start[p->succs[k]] = finish[i];
+	}
+	free(finish);
+	free(start);
+
+	int best = 1;
+	double best_ns = *work;
+	for(int n = 2; n <= max_threads; n++) {
+		double ns = *work / n > *path ? *work / n : *path;
+		ns += (n - 1) * SCHED_SYNC_COST;
+		if(ns < best_ns) {
+			best = n;
+			best_ns = ns;
+		}
+	}
+	return best;
+}
+
+sched *sched_create(plan *p, int max_threads) {
+	sched *s = malloc(sizeof(sched));
+	memset(s, 0, sizeof(sched));
+	s->plan = p;
+	if(max_threads < 1) max_threads = 1;
+	if(max_threads > SCHED_MAX_WORKERS) max_threads = SCHED_MAX_WORKERS;
+
+	double work, path;
+	s->nthreads = pick_threads(p, max_threads, &work, &path);
+	for(int i = 0; i < p->nsteps; i++)
+		if(p->steps[i].serial && p->succ_start[i + 1] > p->succ_start[i]) {
+			printf("Sched: step %i is serial but feeds other steps, running single threaded\n", i);
+			s->nthreads = 1;
+		}
+	printf("Sched: %i of %i threads, %.1f us of work per block, longest chain %.1f us\n",
+			s->nthreads, max_threads, work / 1000., path / 1000.);
+	if(s->nthreads == 1)
+		return s;
+
+	s->pending = calloc(p->nsteps, sizeof(int));
+	s->roots = malloc(p->nsteps * sizeof(int));
+	s->serial = malloc(p->nsteps * sizeof(int));
+	for(int i = 0; i < p->nsteps; i++) {
+		if(p->steps[i].serial)
+			s->serial[s->nserial++] = i;
+		else if(0 == p->npreds[i])
+			s->roots[s->nroots++] = i;
+	}
+	s->nparallel = p->nsteps - s->nserial;
+
+	s->workers = calloc(s->nthreads, sizeof(sched_worker));
+	for(int t = 0; t < s->nthreads; t++) {
+		s->workers[t].sched = s;
+		s->workers[t].id = t;
+		deque_init(&s->workers[t].deque, s->nparallel);
+	}
+	// Thread 0 is whoever calls sched_run
+	for(int t = 1; t < s->nthreads; t++)
+		if(pthread_create(&s->workers[t].thread, NULL, worker_main, &s->workers[t])) {
+			printf("ERROR: Can't start worker thread %i\n", t);
+			s->nthreads = t;
+			break;
+		}
+	return s;
+}
+
+void sched_run(sched *s, int nframes) {
+	plan *p = s->plan;
+	if(s->nthreads == 1) {
+		plan_run(p, nframes);
+		return;
+	}
+	plan_begin(p, nframes);
+
+	// Every worker is waiting on the next generation, nothing is in flight
+	for(int i = 0; i < p->nsteps; i++)
+		s->pending[i] = p->npreds[i];
+	for(int t = 0; t < s->nthreads; t++) {
+		s->workers[t].deque.top = 0;
+		s->workers[t].deque.bottom = 0;
+	}
+	s->nframes = nframes;
+	s->remaining = s->nparallel;
+	s->finished = 0;
+	start_workers(s);
+
+	work(s, &s->workers[0]);
+	for(int idle = 1; __atomic_load_n(&s->finished, __ATOMIC_ACQUIRE) < s->nthreads - 1; idle++)
+		if(idle % SCHED_YIELD == 0)
+			sched_yield();
+		else
+			cpu_relax();
+
+	for(int i = 0; i < s->nserial; i++)
+		plan_run_step(p, s->serial[i], nframes);
+}
+
+void sched_free(sched *s) {
+	if(s->nthreads > 1) {
+		__atomic_store_n(&s->quit, 1, __ATOMIC_RELEASE);
+		start_workers(s);
+		for(int t = 1; t < s->nthreads; t++)
+			pthread_join(s->workers[t].thread, NULL);
+		for(int t = 0; t < s->nthreads; t++)
+			free(s->workers[t].deque.tasks);
+	}
+	free(s->workers);
+	free(s->pending);
+	free(s->roots);
+	free(s->serial);
+	free(s);
+}
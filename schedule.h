@@ -0,0 +1,68 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <pthread.h>
+#include "plan.h"
+
+/* Runs the steps of a plan on a pool of worker threads. Each block every
+ * step waits for the steps it reads from, ready steps go on the deque of
+ * the worker that readied them and idle workers steal from the others.
+ * The thread calling sched_run works too and runs the serial steps (the
+ * sound card) once the rest are done, so the output never leaves the
+ * audio thread.
+ *
+ * A cost model picks how many threads are worth it for the patch, small
+ * patches just call plan_run and never touch the pool. */
+
+#define SCHED_MAX_WORKERS 32
+// Rough ns lost per block for each extra thread waking up and joining
+#define SCHED_SYNC_COST 4000
+// Spins waiting for the next block before parking
+#define SCHED_SPIN 20000
+// Spins with nothing to do before giving the core away
+#define SCHED_YIELD 64
+
+// Chase-Lev deque, only the owner pushes and pops, anyone can steal
+typedef struct sched_deque {
+	int *tasks;
+	int mask;
+	char pad0[64];
+	long top;
+	char pad1[64];
+	long bottom;
+	char pad2[64];
+} sched_deque;
+
+struct sched;
+typedef struct sched_worker {
+	struct sched *sched;
+	int id;
+	pthread_t thread;
+	sched_deque deque;
+} sched_worker;
+
+typedef struct sched {
+	plan *plan;
+	int nthreads; // including the caller, 1 runs everything in place
+	sched_worker *workers;
+	int *pending; // unfinished predecessors of each step this block
+	int *roots; // steps with no predecessors, shared out at the start
+	int nroots;
+	int *serial; // serial steps in plan order
+	int nserial;
+	int nparallel; // steps the pool runs each block
+	int nframes;
+	char pad0[64];
+	int remaining; // parallel steps not yet finished this block
+	char pad1[64];
+	int finished; // workers that have seen the block end
+	char pad2[64];
+	unsigned generation; // bumped to start a block
+	int quit;
+	int sleepers; // workers parked on generation, see park
+} sched;
+
+sched *sched_create(plan *p, int max_threads);
+void sched_run(sched *s, int nframes);
+void sched_free(sched *s);
+#endif
@@ -0,0 +1,248 @@
+#include "seq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SEQ_DEFAULT_TEMPO 500000 // us per quarter note, 120 bpm
+#define SEQ_LOG_HEADER 8
+#define SEQ_LOG_EVENT 8
+
+// An event in file units, ticks for MIDI and the log's own frames
+typedef struct seq_raw {
+	uint64_t time;
+	int order; // in the file, keeps same time events in order
+	int tempo; // us per quarter note, 0 for a note
+	int status;
+	int note;
+	int velocity;
+} seq_raw;
+
+typedef struct seq_list {
+	seq_raw *ev;
+	int n, cap;
+} seq_list;
+
+typedef struct reader {
+	const unsigned char *p, *end;
+	int bad; // ran off the end
+} reader;
+
+static void add(seq_list *l, seq_raw *r) {
+	if(l->n == l->cap) {
+		l->cap = l->cap ? 2 * l->cap : 1024;
+		l->ev = realloc(l->ev, l->cap * sizeof(seq_raw));
+	}
+	r->order = l->n;
+	l->ev[l->n++] = *r;
+}
+
+static int by_time(const void *a, const void *b) {
+	const seq_raw *x = a, *y = b;
+	if(x->time != y->time)
+		return x->time < y->time ? -1 : 1;
+	return x->order - y->order;
+}
+
+static int byte(reader *r) {
+	if(r->p >= r->end) {
+		r->bad = 1;
+		return 0;
+	}
+	return *r->p++;
+}
+static uint32_t be(reader *r, int len) {
+	uint32_t v = 0;
+	while(len--)
+		v = v << 8 | byte(r);
+	return v;
+}
+static uint32_t le32(const unsigned char *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+// MIDI's variable length numbers, 7 bits a byte, at most 4 bytes
+static uint32_t varlen(reader *r) {
+	uint32_t v = 0;
+	for(int i = 0; i < 4; i++) {
+		int b = byte(r);
+		v = v << 7 | (b & 0x7f);
+		if(!(b & 0x80))
+			return v;
+	}
+	r->bad = 1;
+	return v;
+}
+static void skip(reader *r, uint32_t len) {
+	if(len > (uint32_t)(r->end - r->p)) {
+		r->bad = 1;
+		len = r->end - r->p;
+	}
+	r->p += len;
+}
+
+// One MTrk's notes and tempo changes, times in ticks from its start
+static int read_track(reader *r, seq_list *l) {
+	uint64_t tick = 0;
+	int status = 0;
+	while(r->p < r->end && !r->bad) {
+		seq_raw ev;
+		memset(&ev, 0, sizeof(seq_raw));
+		tick += varlen(r);
+		ev.time = tick;
+		int b = byte(r);
+		if(b & 0x80)
+			status = b;
+		else if(status) // running status, b is the first data byte
+			r->p--;
+		else
+			return -1;
+
+		if(0xff == b) { // meta
+			int type = byte(r);
+			uint32_t len = varlen(r);
+			if(0x51 == type && 3 == len) {
+				ev.tempo = be(r, 3);
+				if(ev.tempo)
+					add(l, &ev);
+			} else if(0x2f == type) {
+				return 0;
+			} else
+				skip(r, len);
+			status = 0;
+		} else if(0xf0 == b || 0xf7 == b) { // sysex
+			skip(r, varlen(r));
+			status = 0;
+		} else {
+			int kind = status & 0xf0;
+			int d1 = byte(r);
+			int d2 = 0xc0 == kind || 0xd0 == kind ? 0 : byte(r);
+			if(0x90 == kind || 0x80 == kind) {
+				ev.status = d2 && 0x90 == kind ? 0x90 : 0x80;
+				ev.note = d1 & 0x7f;
+				ev.velocity = d2 & 0x7f;
+				add(l, &ev);
+			}
+		}
+	}
+	return r->bad ? -1 : 0;
+}
+
+// Every track merged into one list in ticks, -1 if it isn't MIDI we can read
+static int read_midi(const unsigned char *buf, size_t len, seq_list *l,
+		int *division) {
+	reader r = {buf, buf + len, 0};
+	if(0 != memcmp(buf, "MThd", 4))
+		return -1;
+	r.p += 4;
+	uint32_t hlen = be(&r, 4);
+	const unsigned char *next = r.p + hlen;
+	int format = be(&r, 2);
+	int ntracks = be(&r, 2);
+	*division = be(&r, 2);
+	if(r.bad || hlen < 6 || hlen > len - 8 || format > 1 || 0 == *division)
+		return -1;
+	r.p = next;
+
+	while(ntracks && r.end - r.p >= 8) {
+		const unsigned char *id = r.p;
+		r.p += 4;
+		uint32_t clen = be(&r, 4);
+		if(clen > (uint32_t)(r.end - r.p))
+			return -1;
+		reader t = {r.p, r.p + clen, 0};
+		r.p += clen;
+		if(0 != memcmp(id, "MTrk", 4))
+			continue;
+		if(read_track(&t, l))
+			return -1;
+		ntracks--;
+	}
+	return 0;
+}
+
+// Ticks to frames along the tempo changes
+static void midi_frames(seq_list *l, int division, unsigned int rate) {
+	double us_per_tick;
+	int tempo = SEQ_DEFAULT_TEMPO;
+	if(division & 0x8000) { // SMPTE frames per second and ticks per frame
+		int fps = -(signed char)(division >> 8);
+		us_per_tick = 1e6 / ((29 == fps ? 29.97 : fps) * (division & 0xff));
+	} else
+		us_per_tick = (double)tempo / division;
+
+	uint64_t last = 0;
+	double us = 0;
+	for(int i = 0; i < l->n; i++) {
+		seq_raw *ev = &l->ev[i];
+		us += (ev->time - last) * us_per_tick;
+		last = ev->time;
+		if(ev->tempo && !(division & 0x8000)) {
+			tempo = ev->tempo;
+			us_per_tick = (double)tempo / division;
+		}
+		ev->time = (uint64_t)(us * rate / 1e6 + 0.5);
+	}
+}
+
+static int read_log(const unsigned char *buf, size_t len, seq_list *l,
+		unsigned int rate) {
+	if(len < SEQ_LOG_HEADER || 0 != memcmp(buf, SEQ_LOG_MAGIC, 4) ||
+			(len - SEQ_LOG_HEADER) % SEQ_LOG_EVENT)
+		return -1;
+	uint64_t log_rate = le32(buf + 4);
+	if(!log_rate)
+		return -1;
+	for(const unsigned char *p = buf + SEQ_LOG_HEADER; p < buf + len; p += SEQ_LOG_EVENT) {
+		seq_raw ev;
+		memset(&ev, 0, sizeof(seq_raw));
+		ev.time = le32(p) * (uint64_t)rate / log_rate;
+		ev.status = 0x90 == (p[4] & 0xf0) && p[6] ? 0x90 : 0x80;
+		ev.note = p[5] & 0x7f;
+		ev.velocity = p[6] & 0x7f;
+		if(0x90 == (p[4] & 0xf0) || 0x80 == (p[4] & 0xf0))
+			add(l, &ev);
+	}
+	return 0;
+}
+
+seq_event *seq_load(const char *path, unsigned int rate, int *nevents) {
+	FILE *f = fopen(path, "rb");
+	if(!f) {
+		printf("ERROR: Can't open sequence \"%s\"\n", path);
+		return NULL;
+	}
+	size_t cap = 4096, len = 0, got;
+	unsigned char *buf = malloc(cap);
+	while((got = fread(buf + len, 1, cap - len, f)) > 0)
+		if((len += got) == cap)
+			buf = realloc(buf, cap *= 2);
+	fclose(f);
+
+	seq_list l = {NULL, 0, 0};
+	int midi = len >= 4 && 0 == memcmp(buf, "MThd", 4), division = 0;
+	int err = midi ? read_midi(buf, len, &l, &division) : read_log(buf, len, &l, rate);
+	free(buf);
+	if(err) {
+		printf("ERROR: \"%s\" is not a %s\n", path,
+				midi ? "MIDI file we can read" : "MIDI file or event log");
+		free(l.ev);
+		return NULL;
+	}
+	if(l.n)
+		qsort(l.ev, l.n, sizeof(seq_raw), by_time);
+	if(midi)
+		midi_frames(&l, division, rate);
+
+	seq_event *out = malloc((l.n > 0 ? (size_t)l.n : 1) * sizeof(seq_event));
+	int n = 0;
+	for(int i = 0; i < l.n; i++) {
+		if(l.ev[i].tempo)
+			continue;
+		out[n].frame = l.ev[i].time;
+		out[n].note = l.ev[i].note;
+		out[n].velocity = 0x90 == l.ev[i].status ? l.ev[i].velocity / 127.0f : 0.0f;
+		n++;
+	}
+	free(l.ev);
+	*nevents = n;
+	return out;
+}
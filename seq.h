@@ -0,0 +1,25 @@
+#ifndef SEQ_H
+#define SEQ_H
+#include <stdint.h>
+
+/* Note sequences for SEQ, read from a Standard MIDI File (format 0 or 1,
+ * every channel) or from an event log. Either way they come out as note
+ * ons and offs sorted by frame, timed at the rate they are going to play
+ * at, events on the same frame kept in file order.
+ *
+ * An event log is "SEQ1", then the rate its frames count at as a little
+ * endian uint32, then 8 bytes per event: the frame as a little endian
+ * uint32, a MIDI status byte (0x9n on, 0x8n off), the note, the velocity
+ * and a 0. */
+
+#define SEQ_LOG_MAGIC "SEQ1"
+
+typedef struct seq_event {
+	uint64_t frame;
+	int note;
+	float velocity; // 0 to 1, 0 for a note off
+} seq_event;
+
+// NULL if it can't be read, MIDI if it starts with "MThd", else a log
+seq_event *seq_load(const char *path, unsigned int rate, int *nevents);
+#endif
@@ -0,0 +1,232 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+
+void stats_init(synth_stats *s, int nmods, unsigned rate, int block_size) {
+	memset(s, 0, sizeof(synth_stats));
+	s->rate = rate;
+	s->block_size = block_size;
+	s->nmods = nmods;
+	s->mods = calloc(nmods + 1, sizeof(stats_module));
+	s->ticks0 = stats_ticks();
+	clock_gettime(CLOCK_MONOTONIC, &s->time0);
+}
+
+void stats_free(synth_stats *s) {
+	free(s->mods);
+	s->mods = NULL;
+	s->nmods = 0;
+}
+
+// Should the next block time each step
+int stats_sampling(synth_stats *s) {
+	return 0 == s->blocks % STATS_SAMPLE_EVERY;
+}
+
+static void begin_write(synth_stats *s) {
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+static void end_write(synth_stats *s) {
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+void stats_block(synth_stats *s, uint64_t ticks, plan *p, int sampled) {
+	begin_write(s);
+	s->blocks++;
+	s->block_last = ticks;
+	s->block_total += ticks;
+	if(ticks > s->block_worst)
+		s->block_worst = ticks;
+
+	if(sampled) {
+		s->samples++;
+		for(int m = 0; m <= s->nmods; m++)
+			s->mods[m].last = 0;
+		// Conversions and feedback loops go in the extra slot
+		for(int i = 0; i < p->nsteps; i++) {
+			int m = p->steps[i].mod_id;
+			s->mods[m < 0 || m >= s->nmods ? s->nmods : m].last += p->ticks[i];
+		}
+		for(int m = 0; m <= s->nmods; m++) {
+			s->mods[m].total += s->mods[m].last;
+			if(s->mods[m].last > s->mods[m].worst)
+				s->mods[m].worst = s->mods[m].last;
+		}
+	}
+	end_write(s);
+}
+
+void stats_add_xrun(synth_stats *s, uint64_t frame) {
+	begin_write(s);
+	stats_xrun *x = &s->recent[s->xruns % STATS_MAX_XRUNS];
+	x->frame = frame;
+	clock_gettime(CLOCK_REALTIME, &x->when);
+	s->xruns++;
+	end_write(s);
+}
+
+void stats_add_dropped(synth_stats *s, uint64_t frames) {
+	begin_write(s);
+	s->dropped += frames;
+	end_write(s);
+}
+
+/* A new patch brings its own per module array, zeroed, with room for
+ * nmods + 1. The old one is handed back for the caller to free once no
+ * reader can still be looking at it. */
+stats_module *stats_swap_mods(synth_stats *s, stats_module *mods, int nmods) {
+	begin_write(s);
+	stats_module *old = s->mods;
+	s->mods = mods;
+	s->nmods = nmods;
+	s->samples = 0;
+	end_write(s);
+	return old;
+}
+
+void stats_read(synth_stats *s, synth_stats *copy, stats_module *mods, int cap) {
+	unsigned seq0, seq1;
+	do {
+		seq0 = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		memcpy(copy, s, sizeof(synth_stats));
+		if(mods && copy->mods)
+			memcpy(mods, copy->mods, (copy->nmods + 1 < cap ? copy->nmods + 1 : cap) *
+					sizeof(stats_module));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		seq1 = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+	} while((seq0 & 1) || seq0 != seq1);
+	copy->mods = mods;
+}
+
+double stats_ns_per_tick(synth_stats *s) {
+	struct timespec now;
+	uint64_t ticks = stats_ticks();
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double ns = (now.tv_sec - s->time0.tv_sec) * 1e9 + (now.tv_nsec - s->time0.tv_nsec);
+	return ticks > s->ticks0 ? ns / (double)(ticks - s->ticks0) : 1.;
+}
+
+/* JSON, written to a temporary file and renamed over path so anything
+ * watching it never sees half a dump. Times are in microseconds. */
+int stats_dump(synth_stats *s, const char *path, stats_type_fn type_of) {
+	synth_stats c;
+	int cap = s->nmods + 1;
+	stats_module *mods = malloc(cap * sizeof(stats_module));
+	stats_read(s, &c, mods, cap);
+	// The patch got bigger while we looked
+	while(c.nmods + 1 > cap) {
+		cap = c.nmods + 1;
+		mods = realloc(mods, cap * sizeof(stats_module));
+		stats_read(s, &c, mods, cap);
+	}
+	double us = stats_ns_per_tick(s) / 1000.;
+	double budget = 1e6 * c.block_size / c.rate;
+	double mean = c.blocks ? c.block_total * us / c.blocks : 0.;
+
+	char tmp[1024];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE *f = fopen(tmp, "w");
+	if(!f) {
+		printf("ERROR: Can't write stats to %s. %s\n", tmp, strerror(errno));
+		free(mods);
+		return -1;
+	}
+	fprintf(f, "{\n\"blocks\": %llu,\n\"block_size\": %i,\n\"budget_us\": %.2f,\n",
+			(unsigned long long)c.blocks, c.block_size, budget);
+	fprintf(f, "\"block_us\": {\"last\": %.2f, \"mean\": %.2f, \"worst\": %.2f},\n",
+			c.block_last * us, mean, c.block_worst * us);
+	fprintf(f, "\"headroom_us\": {\"last\": %.2f, \"least\": %.2f},\n",
+			budget - c.block_last * us, budget - c.block_worst * us);
+	fprintf(f, "\"load\": %.4f,\n\"dropped_frames\": %llu,\n\"xruns\": %llu,\n\"recent_xruns\": [",
+			c.block_last * us / budget, (unsigned long long)c.dropped,
+			(unsigned long long)c.xruns);
+	int nx = c.xruns < STATS_MAX_XRUNS ? c.xruns : STATS_MAX_XRUNS;
+	for(int i = 0; i < nx; i++) {
+		stats_xrun *x = &c.recent[(c.xruns - nx + i) % STATS_MAX_XRUNS];
+		fprintf(f, "%s\n{\"frame\": %llu, \"time\": %lld.%06ld}", i ? "," : "",
+				(unsigned long long)x->frame, (long long)x->when.tv_sec,
+				x->when.tv_nsec / 1000);
+	}
+	fprintf(f, "%s],\n\"modules\": [", nx ? "\n" : "");
+	for(int m = 0; m <= c.nmods; m++) {
+		fprintf(f, "%s\n{\"id\": %i, \"type\": \"%.3s\", \"last_us\": %.3f, "
+				"\"mean_us\": %.3f, \"worst_us\": %.3f}",
+				m ? "," : "", m < c.nmods ? m : -1,
+				m < c.nmods ? type_of(m) : "plan",
+				mods[m].last * us,
+				c.samples ? mods[m].total * us / c.samples : 0.,
+				mods[m].worst * us);
+	}
+	fprintf(f, "\n]\n}\n");
+	fclose(f);
+	free(mods);
+
+	if(rename(tmp, path)) {
+		printf("ERROR: Can't replace %s. %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*************************/
+// Dumping thread, keeps file IO off the audio thread
+
+static struct {
+	pthread_t thread;
+	int running;
+	synth_stats *stats;
+	char *path;
+	struct timespec interval;
+	stats_type_fn type_of;
+	stats_hold_fn hold;
+} dumper;
+
+static void *dump_loop(void *arg) {
+	(void)arg;
+	// File IO has no business at the audio thread's priority
+	struct sched_param normal = {0};
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &normal);
+	while(__atomic_load_n(&dumper.running, __ATOMIC_ACQUIRE)) {
+		nanosleep(&dumper.interval, NULL);
+		dumper.hold(1);
+		stats_dump(dumper.stats, dumper.path, dumper.type_of);
+		dumper.hold(0);
+	}
+	return NULL;
+}
+
+int stats_start_dump(synth_stats *s, const char *path, float secs,
+		stats_type_fn type_of, stats_hold_fn hold) {
+	if(secs <= 0.)
+		secs = 1.;
+	dumper.stats = s;
+	dumper.path = strdup(path);
+	dumper.type_of = type_of;
+	dumper.hold = hold;
+	dumper.interval.tv_sec = (time_t)secs;
+	dumper.interval.tv_nsec = (long)((secs - (time_t)secs) * 1e9);
+	dumper.running = 1;
+	if(pthread_create(&dumper.thread, NULL, dump_loop, NULL)) {
+		printf("ERROR: Can't start the stats thread\n");
+		dumper.running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+// Writes a last dump so the file covers the whole run
+void stats_stop_dump() {
+	if(!dumper.running)
+		return;
+	__atomic_store_n(&dumper.running, 0, __ATOMIC_RELEASE);
+	pthread_join(dumper.thread, NULL);
+	dumper.hold(1);
+	stats_dump(dumper.stats, dumper.path, dumper.type_of);
+	dumper.hold(0);
+	free(dumper.path);
+}
@@ -0,0 +1,89 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "plan.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+/* Always on timing of the audio thread. Every block records how long it
+ * took against the time it stands for, every STATS_SAMPLE_EVERY blocks
+ * each step of the plan gets timed too. Times are CPU timestamp counter
+ * ticks where there is one, converted to ns only when read.
+ *
+ * Only the audio thread writes. Readers take a consistent copy with
+ * stats_read, which retries if a block finished while it was copying
+ * instead of ever making the audio thread wait. */
+
+#define STATS_SAMPLE_EVERY 16 // blocks between per module samples
+#define STATS_MAX_XRUNS 16 // most recent xruns kept
+
+static inline uint64_t stats_ticks() {
+#if defined(__i386__) || defined(__x86_64__)
+	return __rdtsc();
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+#endif
+}
+
+typedef struct stats_module {
+	uint64_t last; // ticks in the last sampled block
+	uint64_t worst;
+	uint64_t total; // over all sampled blocks
+} stats_module;
+
+typedef struct stats_xrun {
+	uint64_t frame; // synth frame it happened at
+	struct timespec when; // wall clock
+} stats_xrun;
+
+typedef struct synth_stats {
+	unsigned seq; // odd while the audio thread is updating
+
+	unsigned rate;
+	int block_size;
+	uint64_t blocks;
+	uint64_t samples; // blocks with per module times
+	uint64_t block_last; // ticks
+	uint64_t block_worst;
+	uint64_t block_total;
+	uint64_t xruns;
+	stats_xrun recent[STATS_MAX_XRUNS]; // ring, xruns % STATS_MAX_XRUNS is next
+	uint64_t dropped; // frames the device had no room for
+
+	// Ticks to ns, from two readings of both clocks
+	uint64_t ticks0;
+	struct timespec time0;
+
+	int nmods;
+	stats_module *mods; // one per module, then one for conversions and loops
+} synth_stats;
+
+void stats_init(synth_stats *s, int nmods, unsigned rate, int block_size);
+void stats_free(synth_stats *s);
+int stats_sampling(synth_stats *s);
+void stats_block(synth_stats *s, uint64_t ticks, plan *p, int sampled);
+void stats_add_xrun(synth_stats *s, uint64_t frame);
+void stats_add_dropped(synth_stats *s, uint64_t frames);
+
+stats_module *stats_swap_mods(synth_stats *s, stats_module *mods, int nmods);
+
+// Reader side, mods gets the first cap of copy->nmods + 1
+void stats_read(synth_stats *s, synth_stats *copy, stats_module *mods, int cap);
+double stats_ns_per_tick(synth_stats *s);
+// type_of gives the 3 letter type of a module
+typedef char *(*stats_type_fn)(int mod_id);
+int stats_dump(synth_stats *s, const char *path, stats_type_fn type_of);
+/* The dump thread calls hold(1) before each dump and hold(0) after, so
+ * the patch it reads about can be kept alive meanwhile */
+typedef void (*stats_hold_fn)(int on);
+int stats_start_dump(synth_stats *s, const char *path, float secs,
+		stats_type_fn type_of, stats_hold_fn hold);
+void stats_stop_dump();
+#endif
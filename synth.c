@@ -1,9 +1,25 @@
+#define _POSIX_C_SOURCE 200809L
 #include "synth.h"
+#include "wav.h"
+#include "params.h"
+#include "plan.h"
+#include "dsp.h"
+#include "voice.h"
+#include "schedule.h"
+#include "stats.h"
+#include "patch.h"
+#include "watch.h"
+#include "native.h"
+#include "seq.h"
+#include "latency.h"
+#include "tap.h"
 #include <alsa/asoundlib.h>
 #include <stdio.h>
 #include <math.h>
 #include <time.h>
-#include <ctype.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 #define PCM_DEVICE "default"
 
@@ -28,13 +44,41 @@
 
 #define LINE_MAX_LEN 255
 #define NANO 1000000000
+#define RENDER_PERIOD 4096 // frames per write when rendering to a file
+#define RENDER_SECS 10.0 // when not told how long, and nothing is sequenced
+#define RENDER_TAIL_SECS 2.0 // after the last SEQ event, for the releases
+#define RELOAD_FADE_SECS 0.02 // crossfade between old and new patch
+#define PARAM_QUEUE_LEN 1024 // must be a power of 2
+#define REMOTE_QUEUE_LEN 8192 // must be a power of 2
+#define PREFAULT_STACK (256 * 1024) // bytes of audio thread stack touched up front
 
 unsigned int rate = 44100; // samples per second
+int block_size = DEFAULT_BLOCK_SIZE; // frames processed per module call
+int control_period = DEFAULT_CONTROL_PERIOD; // frames per control rate tick
+int optimize = 1; // prune and fuse when compiling plans
+int use_native = 0; // compile plans to native code
 struct timespec start_time;
 
 snd_pcm_t *pcm_handle;
 snd_pcm_hw_params_t *params;
-snd_pcm_uframes_t frames;
+snd_pcm_uframes_t frames; // period size, OUT writes this many at a time
+snd_pcm_uframes_t buffer_frames;
+snd_pcm_format_t pcm_format = SND_PCM_FORMAT_S16_LE;
+int pcm_mmap = 0; // OUT writes straight into the device buffer
+int pcm_dither = 0;
+uint32_t dither_state[DSP_DITHER_LANES];
+wav_file *render_file = NULL; // OUT writes here instead of ALSA when set
+
+// Frame position of the start of the block being processed. Written by the
+// audio thread, read by anyone timestamping parameter changes.
+uint64_t synth_frame = 0;
+param_event param_buf[PARAM_QUEUE_LEN];
+param_queue param_q = {param_buf, PARAM_QUEUE_LEN};
+// Changes from the control server, each queue has a single producer
+param_event remote_buf[REMOTE_QUEUE_LEN];
+param_queue remote_q = {remote_buf, REMOTE_QUEUE_LEN};
+voice_bank voices;
+synth_stats stats;
 
 long long int timespec_to_nsecs(struct timespec *t) {
 	return (long long int)t->tv_sec * (long long int)NANO +
@@ -51,44 +95,111 @@ static inline void timespec_diff(struct timespec *a, struct timespec *b, struct
 }
 
 /*************************/
-typedef struct mod {
-	char type[3];
-	struct mod **inputs;
-	int *input_idxs;
-	float *outputs;
-	void (*tick)(struct mod*);
-	void *data;
-} mod;
-
+// The live patch, only ever changed by the audio thread between blocks
 int nmods = 0;
 mod *mods = NULL;
-void init_mods(int n) {
-	nmods = n;
-	mods = malloc(n * sizeof(mod));
+plan *synth_plan = NULL;
+sched *synth_sched = NULL;
+native *synth_native = NULL; // runs synth_plan when set and not off
+int max_threads = 1;
+
+// A built patch waiting to go live, or one that has just been replaced
+typedef struct network {
+	int nmods;
+	mod *mods;
+	plan *plan;
+	sched *sched;
+	native *native; // NULL to interpret
+	stats_module *stats_mods; // nmods + 1, zeroed
+
+	// Modules whose state comes over from the live patch
+	int ncarry;
+	int *carry;
+	int *carry_size; // bytes of plan state, 0 to copy module data instead
+} network;
+// The wiring itself is filled in by build_network
+void make_ports(mod *m, int nins, int nouts) {
+	m->nins = nins;
+	m->nouts = nouts;
 }
 /*************************/
 
 
-float get_input(mod *m, int i) { return m->inputs[i]->outputs[m->input_idxs[i]]; }
+/* Kernels see their port buffers through the step's pool offsets. Each
+ * buffer holds nframes frames. */
+float *get_input(plan_step *s, float *pool, int i) { return pool + s->in[i]; }
+float *get_output(plan_step *s, float *pool, int i) { return pool + s->out[i]; }
 
 /* CONSTANT OUT VALUE */
+#define CST_MAX_EVENTS 16 // changes per block, extras collapse onto the last
+typedef struct cst_event {
+	int offset; // frame within the block
+	float val;
+} cst_event;
 typedef struct cst_data {
 	char label[LINE_MAX_LEN];
 	char type[3];
 	float init_val;
 	float val;
+
+	// Changes due in the current block, in frame order
+	cst_event events[CST_MAX_EVENTS];
+	int nevents;
+
+	// Linear ramp towards target to avoid zipper noise
+	int smooth_frames; // 0 jumps straight to new values
+	int ramp_left;
+	float target;
+	float step;
 } cst_data;
 
 #define CST_OUT_VAL 0
-void cst_tick(mod *m) {
-	m->outputs[CST_OUT_VAL] = ((cst_data*)m->data)->val;
+static void cst_apply(cst_data *data, float val) {
+	if(data->smooth_frames > 0) {
+		data->target = val;
+		data->step = (val - data->val) / (float)data->smooth_frames;
+		data->ramp_left = data->smooth_frames;
+	} else {
+		data->val = val;
+		data->ramp_left = 0;
+	}
+}
+/* At control rate each frame is a tick standing for stride frames, and
+ * event offsets are in ticks. Ones after the last tick take effect from
+ * the next block's first. */
+void cst_process(plan_step *s, float *pool, int nframes) {
+	cst_data *data = (cst_data*)s->data;
+	float *out = get_output(s, pool, CST_OUT_VAL);
+
+	if(0 == data->nevents && 0 == data->ramp_left) {
+		for(int f = 0; f < nframes; f++)
+			out[f] = data->val;
+		return;
+	}
+
+	int e = 0;
+	for(int f = 0; f < nframes; f++) {
+		while(e < data->nevents && data->events[e].offset <= f)
+			cst_apply(data, data->events[e++].val);
+		if(data->ramp_left > 0) {
+			data->val += data->step * s->stride;
+			if((data->ramp_left -= s->stride) <= 0) {
+				data->val = data->target;
+				data->ramp_left = 0;
+			}
+		}
+		out[f] = data->val;
+	}
+	while(e < data->nevents)
+		cst_apply(data, data->events[e++].val);
+	data->nevents = 0;
 }
 int make_cst(mod *m) {
 	memcpy(m->type, "CST", 3);
-	m->outputs = malloc(sizeof(float));
-	m->tick = &cst_tick;
-	m->data = malloc(sizeof(cst_data));
-	memset(m->data, 0, sizeof(cst_data));
+	make_ports(m, 0, 1);
+	m->process = &cst_process;
+	m->cost = 2;
+	m->data_size = sizeof(cst_data);
 	return 0;
 }
 void cst_set_val(mod *m, float val) {
@@ -98,14 +209,50 @@ void cst_set_init_val(mod *m, float val) {
 	((cst_data*)m->data)->init_val = val;
 	((cst_data*)m->data)->val = val;
 }
-void cst_set_type(mod *m, char *type) {
-	strncpy(((cst_data*)m->data)->type, type, 3);
+/* Queue a change for the block being set up, offset is within that block
+ * as the CST's kernel counts frames, see plan_frame_index */
+void cst_add_event(mod *m, int offset, float val) {
+	cst_data *data = (cst_data*)m->data;
+	if(data->nevents == CST_MAX_EVENTS) {
+		data->events[CST_MAX_EVENTS - 1].val = val;
+		return;
+	}
+	data->events[data->nevents].offset = offset;
+	data->events[data->nevents].val = val;
+	data->nevents++;
+}
+/* Values moved by hand run at control rate and fixed ones are constant.
+ * Frequencies and anything without a type run at audio rate. */
+int cst_rate(const char *type) {
+	if(0 == strncmp(type, "NDS", 3))
+		return PLAN_RATE_CONST;
+	if(0 == strncmp(type, "LFO", 3) || 0 == strncmp(type, "PER", 3))
+		return PLAN_RATE_CONTROL;
+	return PLAN_RATE_AUDIO;
 }
-void cst_set_label(mod *m, char *label) {
-	int pos = -1;
-
-	while('\n' != label[++pos])
-		((cst_data*)m->data)->label[pos] = label[pos];
+// Ramp time for values moved from outside, fixed ones never move
+static float cst_smooth_secs = 0;
+void set_cst_smoothing(float secs) {
+	cst_smooth_secs = secs > 0 ? secs : 0;
+}
+void cst_set_type(mod *m, const char *type) {
+	cst_data *data = (cst_data*)m->data;
+	// Three letters, not a string
+	memset(data->type, 0, 3);
+	memcpy(data->type, type, strnlen(type, 3));
+	data->smooth_frames = strncmp(type, "NDS", 3) ? cst_smooth_secs * rate : 0;
+}
+void cst_set_label(mod *m, const char *label) {
+	snprintf(((cst_data*)m->data)->label, LINE_MAX_LEN, "%s", label);
+}
+// Fixed values only change when set, native code may write them in
+static int cst_fixed(mod *m, float *val) {
+	cst_data *data = (cst_data*)m->data;
+	if(strncmp(m->type, "CST", 3) || strncmp(data->type, "NDS", 3) ||
+			data->nevents || data->ramp_left)
+		return 0;
+	*val = data->val;
+	return 1;
 }
 void cst_print(mod *m) {
 	cst_data *data =((cst_data*)m->data);
@@ -114,59 +261,153 @@ void cst_print(mod *m) {
 			data->type[0], data->type[1], data->type[2], 
 			data->label);
 }
+/* Threads besides the audio thread read the live patch's modules between
+ * synth_hold_patch and synth_release_patch. A patch that has been swapped
+ * out is only freed once wait_readers sees none of them left, so anything
+ * they got from it stays good until they let go. */
+static int patch_readers = 0;
+void synth_hold_patch() {
+	__atomic_add_fetch(&patch_readers, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+void synth_release_patch() {
+	__atomic_sub_fetch(&patch_readers, 1, __ATOMIC_RELEASE);
+}
+// After the old patch is out of mods, before freeing it
+static void wait_readers() {
+	struct timespec tick = {0, 1000000};
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&patch_readers, __ATOMIC_ACQUIRE))
+		nanosleep(&tick, NULL);
+}
+// NULL if there is no such module. nmods goes first, see exchange_network.
+static mod *live_mod(int mod_id) {
+	int n = __atomic_load_n(&nmods, __ATOMIC_ACQUIRE);
+	mod *m = __atomic_load_n(&mods, __ATOMIC_ACQUIRE);
+	return mod_id >= 0 && mod_id < n ? &m[mod_id] : NULL;
+}
+static cst_data *live_cst(int mod_id) {
+	mod *m = live_mod(mod_id);
+	return m && 0 == strncmp(m->type, "CST", 3) ? (cst_data*)m->data : NULL;
+}
+
+/* Called from outside the audio thread. The change is queued and picked up
+ * at the start of the next block. */
 void set_mod_cst_value(int mod_id, float val) {
-	cst_set_val(&mods[mod_id], val);
+	schedule_mod_cst_value(mod_id, val, get_synth_frame());
+}
+void schedule_mod_cst_value(int mod_id, float val, uint64_t frame) {
+	synth_hold_patch();
+	int cst = NULL != live_cst(mod_id);
+	synth_release_patch();
+	if(!cst) {
+		printf("ERROR: Module %i is not a CST\n", mod_id);
+		return;
+	}
+	param_event ev = {frame, PARAM_CST, mod_id, val, latency_stamp()};
+	if(param_queue_push(&param_q, &ev))
+		printf("Parameter queue full, dropped %i = %f\n", mod_id, val);
+}
+// Notes are MIDI note numbers, velocity 0 -> 1
+void schedule_note_on(int note, float velocity, uint64_t frame) {
+	param_event ev = {frame, PARAM_NOTE_ON, note, velocity, latency_stamp()};
+	if(param_queue_push(&param_q, &ev))
+		printf("Parameter queue full, dropped note on %i\n", note);
+}
+void schedule_note_off(int note, uint64_t frame) {
+	param_event ev = {frame, PARAM_NOTE_OFF, note, 0., latency_stamp()};
+	if(param_queue_push(&param_q, &ev))
+		printf("Parameter queue full, dropped note off %i\n", note);
+}
+/* From the one thread feeding changes besides the UI, see control.h. They
+ * all take effect at the start of the next block. */
+int queue_remote_params(param_event *evs, int n) {
+	uint64_t frame = get_synth_frame(), queued = latency_stamp();
+	for(int i = 0; i < n; i++) {
+		evs[i].frame = frame;
+		evs[i].queued = queued;
+	}
+	return param_queue_push_n(&remote_q, evs, n);
+}
+void synth_note_on(int note, float velocity) {
+	schedule_note_on(note, velocity, get_synth_frame());
+}
+void synth_note_off(int note) {
+	schedule_note_off(note, get_synth_frame());
 }
+int synth_is_polyphonic() {
+	int poly = 0;
+	synth_hold_patch();
+	mod *m;
+	for(int i = 0; !poly && (m = live_mod(i)); i++)
+		poly = 0 == strncmp(m->type, "KEY", 3);
+	synth_release_patch();
+	return poly;
+}
+uint64_t get_synth_frame() {
+	return __atomic_load_n(&synth_frame, __ATOMIC_ACQUIRE);
+}
+// These hand out the live patch's own memory, hold it while using them
 char* get_mod_cst_label(int mod_id) {
-	return ((cst_data*)mods[mod_id].data)->label;
+	cst_data *data = live_cst(mod_id);
+	return data ? data->label : "";
 }
 char* get_mod_cst_type(int mod_id) {
-	return ((cst_data*)mods[mod_id].data)->type;
+	cst_data *data = live_cst(mod_id);
+	return data ? data->type : "???";
 }
 float get_mod_cst_init_value(int mod_id) {
-	return ((cst_data*)mods[mod_id].data)->init_val;
+	cst_data *data = live_cst(mod_id);
+	return data ? data->init_val : 0;
 }
 char *get_mod_type(int mod_id) {
-	return mods[mod_id].type;
+	mod *m = live_mod(mod_id);
+	return m ? m->type : "???";
 }
-int get_nmods() { return nmods; }
+int get_nmods() { return __atomic_load_n(&nmods, __ATOMIC_ACQUIRE); }
 
 #define FAD_IN_SIG1 0
 #define FAD_IN_SIG2 1
 #define FAD_IN_MIX  2
 #define FAD_OUT_VAL 0
-void fad_tick(mod *m) {
-	float s1 = get_input(m, FAD_IN_SIG1); 
-	float s2 = get_input(m, FAD_IN_SIG2); 
-	float mix = get_input(m, FAD_IN_MIX); 
-	float out = s1 * (1 - mix) + s2 * mix;
-	debug_print("FAD %p - %f, %f @ %f%% = %f\n", (void*)m, s1, s2, mix, out);
-	m->outputs[FAD_OUT_VAL] = out;
+void fad_process(plan_step *s, float *pool, int nframes) {
+	float *s1 = get_input(s, pool, FAD_IN_SIG1); 
+	float *s2 = get_input(s, pool, FAD_IN_SIG2); 
+	float *mix = get_input(s, pool, FAD_IN_MIX); 
+	float *out = get_output(s, pool, FAD_OUT_VAL);
+	for(int f = 0; f < nframes * s->lanes; f++) {
+		out[f] = s1[f] * (1 - mix[f]) + s2[f] * mix[f];
+		debug_print("FAD %i - %f, %f @ %f%% = %f\n",
+				s->mod_id, s1[f], s2[f], mix[f], out[f]);
+	}
 }
 int make_fad(mod *m) {
 	memcpy(m->type, "FAD", 3);
-	m->inputs = malloc(3 * sizeof(mod*));
-	m->input_idxs = malloc(3 * sizeof(int));
-	m->outputs = malloc(sizeof(float));
-	m->tick = &fad_tick;
+	make_ports(m, 3, 1);
+	m->process = &fad_process;
+	m->cost = 3;
+	m->op = PLAN_OP_MIX;
 	return 0;
 }
 
 #define ADD_IN1 0
 #define ADD_IN2 1
 #define ADD_OUT_VAL 0
-void add_tick(mod *m) {
-	float a1 = get_input(m, ADD_IN1); 
-	float a2 = get_input(m, ADD_IN2); 
-	debug_print("ADD %p - %f + %f = %f\n", (void*)m, a1, a2, a1 + a2);
-	m->outputs[ADD_OUT_VAL] = a1 + a2;
+void add_process(plan_step *s, float *pool, int nframes) {
+	float *a1 = get_input(s, pool, ADD_IN1); 
+	float *a2 = get_input(s, pool, ADD_IN2); 
+	float *out = get_output(s, pool, ADD_OUT_VAL);
+	for(int f = 0; f < nframes * s->lanes; f++) {
+		out[f] = a1[f] + a2[f];
+		debug_print("ADD %i - %f + %f = %f\n", s->mod_id, a1[f], a2[f], out[f]);
+	}
 }
 int make_add(mod *m) {
 	memcpy(m->type, "ADD", 3);
-	m->inputs = malloc(2 * sizeof(mod*));
-	m->input_idxs = malloc(2 * sizeof(int));
-	m->outputs = malloc(sizeof(float));
-	m->tick = &add_tick;
+	make_ports(m, 2, 1);
+	m->process = &add_process;
+	m->cost = 2;
+	m->op = PLAN_OP_ADD;
 	return 0;
 }
 
@@ -175,56 +416,68 @@ int make_add(mod *m) {
 #define OCC_OUT_TRI 1
 #define OCC_OUT_SAW 2
 #define OCC_OUT_SQU 3
-void occ_tick(mod *m) { 
-	float freq_in = get_input(m, OCC_IN_FREQ); 
-
-	float phase = *(float*)m->data;
-	phase += freq_in * M_2PI / (float)rate;
-	phase += ((phase >= M_2PI) * -M_2PI) + ((phase < 0.0) * M_2PI);
-	//printf("%f %f %f\n", freq_in, freq_in * M_2PI / (float)rate, phase);
-	*(float*)m->data = phase;
-
-	float sample_sin = 0.5 + 0.5 * sin(phase);
-	float sample_tri = ((phase < M_PI) * phase / M_PI) +
-										 ((phase >= M_PI) * (2. - phase / M_PI));
-	float sample_saw = phase / M_2PI;
-	float sample_squ = (phase >= M_PI2 && phase < 3 * M_PI2);
-
-	//float sample = 0.5 + 0.5 * sin(theta * freq_in);
-	debug_print("OCC %p - %f @ %f = sin %f, tri %f, saw %f, squ %f\n",
-		 	(void*)m, phase, freq_in, sample_sin, sample_tri, sample_saw, sample_squ);
-	m->outputs[OCC_OUT_SIN] = sample_sin;
-	m->outputs[OCC_OUT_TRI] = sample_tri;
-	m->outputs[OCC_OUT_SAW] = sample_saw;
-	m->outputs[OCC_OUT_SQU] = sample_squ;
+// State is one fixed point phase per voice, see dsp_phase
+int occ_state_size(int lanes) { return lanes * sizeof(uint32_t); }
+/* Only the waveforms something is wired to get computed. The saw output
+ * is the phase itself so it always gets filled, and the other waveforms
+ * are shaped from it. */
+void occ_process(plan_step *s, float *pool, int nframes) { 
+	float *freq_in = get_input(s, pool, OCC_IN_FREQ); 
+	float *phase = get_output(s, pool, OCC_OUT_SAW);
+	uint32_t *state = (uint32_t*)s->data;
+	int n = nframes * s->lanes;
+
+	float dt = (float)s->stride / (float)rate;
+	if(s->lanes == 1)
+		dsp_phase(state, phase, freq_in, dt, nframes);
+	else
+		dsp_phase_lanes(state, phase, freq_in, dt, nframes, s->lanes);
+	if(s->used_outs & (1 << OCC_OUT_SIN))
+		dsp_sine(get_output(s, pool, OCC_OUT_SIN), phase, n);
+	if(s->used_outs & (1 << OCC_OUT_TRI))
+		dsp_triangle(get_output(s, pool, OCC_OUT_TRI), phase, n);
+	if(s->used_outs & (1 << OCC_OUT_SQU))
+		dsp_square(get_output(s, pool, OCC_OUT_SQU), phase, n);
+
+	for(int f = 0; DEBUG_VAL && f < n; f++)
+		debug_print("OCC %i - %f @ %f = sin %f, tri %f, saw %f, squ %f\n",
+				s->mod_id, phase[f] * M_2PI, freq_in[f],
+				get_output(s, pool, OCC_OUT_SIN)[f],
+				get_output(s, pool, OCC_OUT_TRI)[f],
+				phase[f],
+				get_output(s, pool, OCC_OUT_SQU)[f]);
 }
 int make_occ(mod *m) {
 	memcpy(m->type, "OCC", 3);
-	m->inputs = malloc(sizeof(mod*));
-	m->input_idxs = malloc(sizeof(int));
-	m->outputs = malloc(4 * sizeof(float));
-	m->data = malloc(sizeof(float));
-	memset(m->data, 0, sizeof(float));
-	m->tick = &occ_tick;
+	make_ports(m, 1, 4);
+	m->state_size = &occ_state_size;
+	// Slow when its pitch is, but a fixed pitch could be anything
+	m->rate = PLAN_RATE_CONTROL;
+	m->rate_if_const = PLAN_RATE_AUDIO;
+	m->process = &occ_process;
+	m->cost = 18;
 	return 0;
 }
 
 #define VCA_IN_CV 0
 #define VCA_IN_SIG 1
 #define VCA_OUT_SIG 0
-void vca_tick(mod *m) {
-	float in_cv = get_input(m, VCA_IN_CV);
-	float in_sig = get_input(m, VCA_IN_SIG);
-
-	debug_print("VCA %p - %f * %f = %f\n", (void*)m, in_cv, in_sig, in_cv * in_sig);
-	m->outputs[VCA_OUT_SIG] = in_cv * in_sig;
+void vca_process(plan_step *s, float *pool, int nframes) {
+	float *in_cv = get_input(s, pool, VCA_IN_CV);
+	float *in_sig = get_input(s, pool, VCA_IN_SIG);
+	float *out = get_output(s, pool, VCA_OUT_SIG);
+
+	for(int f = 0; f < nframes * s->lanes; f++) {
+		out[f] = in_cv[f] * in_sig[f];
+		debug_print("VCA %i - %f * %f = %f\n", s->mod_id, in_cv[f], in_sig[f], out[f]);
+	}
 }
 int make_vca(mod *m) {
 	memcpy(m->type, "VCA", 3);
-	m->inputs = malloc(2 * sizeof(mod*));
-	m->input_idxs = malloc(2 * sizeof(int));
-	m->outputs = malloc(sizeof(float));
-	m->tick = &vca_tick;
+	make_ports(m, 2, 1);
+	m->process = &vca_process;
+	m->cost = 2;
+	m->op = PLAN_OP_MUL;
 	return 0;
 }
 
@@ -232,43 +485,42 @@ int make_vca(mod *m) {
 #define VCF_IN_RES 1
 #define VCF_IN_SIG 2
 #define VCF_OUT_SIG 0
-#define vcf_stages 4
-typedef struct vcf_data {
-	float sn[vcf_stages]; // s(n)
-	float snm1[vcf_stages]; // s(n-1)
-} vcf_data;
-void vcf_tick(mod *m) {
-	float cut = get_input(m, VCF_IN_CUT);
-	float res = get_input(m, VCF_IN_RES);
-	float sig = get_input(m, VCF_IN_SIG);
-	vcf_data *data = (vcf_data*)m->data;
-
-	float tmp;
-	// Pull data from the last stage
-	for(int i = vcf_stages -1; i > 0; i--) {
-		tmp = data->sn[i];
-		data->sn[i] = data->sn[i-1] * cut + data->snm1[i] * (1.0f - cut);
-		data->snm1[i] = tmp;
-	}
-	tmp = data->sn[0];
-	data->sn[0] = sig * cut + data->snm1[0] * (1.0f - cut) + 
-		            data->snm1[vcf_stages-1] * res * -1. * cut;
-	data->snm1[0] = tmp;
-
-	debug_print("VCF cut %f, res %f, sig %f = %f\n", cut, res, sig,
-			data->sn[vcf_stages -1]);
-
-	m->outputs[VCF_OUT_SIG] = data->sn[vcf_stages -1];
+/* State is s(n) then s(n-1) for each stage, each of those holding one
+ * value per voice */
+int vcf_state_size(int lanes) { return 2 * DSP_LADDER_STAGES * lanes * sizeof(float); }
+void vcf_process(plan_step *s, float *pool, int nframes) {
+	float *cut = get_input(s, pool, VCF_IN_CUT);
+	float *res = get_input(s, pool, VCF_IN_RES);
+	float *sig = get_input(s, pool, VCF_IN_SIG);
+	float *out = get_output(s, pool, VCF_OUT_SIG);
+	dsp_ladder((float*)s->data, out, sig, cut, res, nframes, s->lanes);
+
+	for(int f = 0; DEBUG_VAL && f < nframes * s->lanes; f++)
+		debug_print("VCF cut %f, res %f, sig %f = %f\n", cut[f], res[f], sig[f], out[f]);
+}
+// Several mono VCFs, a lane each
+void vcf_batch(plan_step *s, float *pool, int nframes) {
+	plan_batch *b = (plan_batch*)s->data;
+	float *state[PLAN_MAX_BATCH], *out[PLAN_MAX_BATCH];
+	const float *sig[PLAN_MAX_BATCH], *cut[PLAN_MAX_BATCH], *res[PLAN_MAX_BATCH];
+	for(int k = 0; k < b->nmembers; k++) {
+		plan_step *v = &b->members[k];
+		state[k] = (float*)v->data;
+		out[k] = get_output(v, pool, VCF_OUT_SIG);
+		sig[k] = get_input(v, pool, VCF_IN_SIG);
+		cut[k] = get_input(v, pool, VCF_IN_CUT);
+		res[k] = get_input(v, pool, VCF_IN_RES);
+	}
+	dsp_ladder_instances(state, out, sig, cut, res, nframes, b->nmembers);
 }
 int make_vcf(mod *m) {
 	memcpy(m->type, "VCF", 3);
-	m->inputs = malloc(3 * sizeof(mod*));
-	m->input_idxs = malloc(3 * sizeof(int));
-	m->outputs = malloc(sizeof(float));
-	m->tick = &vcf_tick;
-	m->data = (void*)malloc(sizeof(vcf_data));
-	memset(m->data, 0, sizeof(vcf_data));
-
+	make_ports(m, 3, 1);
+	m->process = &vcf_process;
+	m->batch = &vcf_batch;
+	m->rate = PLAN_RATE_AUDIO;
+	m->cost = 70;
+	m->state_size = &vcf_state_size;
 	return 0;
 }
 
@@ -278,233 +530,847 @@ int make_vcf(mod *m) {
 #define ENV_IN_R 3
 #define ENV_IN_GATE 4
 #define ENV_OUT 0
-typedef struct env_data {
-	int ticks_since_gate_high;
-	int ticks_since_gate_low;
-} env_data;
-void env_tick(mod *m) {
-	float in_a = get_input(m, ENV_IN_A) + 0.00001; // prevent x/0
-	float in_d = get_input(m, ENV_IN_D) + 0.00001;
-	float in_s = get_input(m, ENV_IN_S);
-	float in_r = get_input(m, ENV_IN_R) + 0.00001;
-	float gate = get_input(m, ENV_IN_GATE);
-
-	// Start with just linear AD
-	env_data *data = (env_data*)m->data;
-	// last edge was falling
-	if(data->ticks_since_gate_low < data->ticks_since_gate_high) {
-		if(gate >= 0.9) { // Just got a rising edge
-			data->ticks_since_gate_high = 0;
-			m->outputs[ENV_OUT] = 0.0;
-		} else { // Falling output
-			float t = (float)data->ticks_since_gate_low / (float)rate;
-			m->outputs[ENV_OUT] = (t < in_r) * (1. - (t / in_r));
+#define ENV_IDLE 0
+#define ENV_ATTACK 1
+#define ENV_DECAY 2
+#define ENV_SUSTAIN 3
+#define ENV_RELEASE 4
+#define ENV_LINEAR 1
+#define ENV_EXP 2
+#define ENV_ATTACK_RATIO 0.3f // how far past 1 an exponential attack aims
+#define ENV_DECAY_RATIO 0.0001f // and how far past its end a decay or release aims
+#define ENV_FOREVER (1 << 30) // ticks left holding still
+/* Each segment is level = level * mul + add every tick, for left ticks,
+ * then the level lands on end and the next segment starts. Linear
+ * segments add, exponential ones multiply too. All of that is only worked
+ * out at gate edges, segment ends and input changes, the ticks in between
+ * are the same sum on every lane with no divisions or decisions. */
+typedef struct env_lanes {
+	float *level, *mul, *add, *end;
+	float *gated; // 1 since a rising edge, 0 since a falling one
+	float *a, *d, *s, *r; // inputs the segment was worked out for
+	int *stage, *left;
+} env_lanes;
+#define ENV_STATE_HEAD 16 // bytes, the curve the state was made for
+int env_state_size(int lanes) {
+	return ENV_STATE_HEAD + lanes * (9 * sizeof(float) + 2 * sizeof(int));
+}
+static int *env_map(void *state, int lanes, env_lanes *e) {
+	float *p = (float*)((char*)state + ENV_STATE_HEAD);
+	float **arrays[] = {&e->level, &e->mul, &e->add, &e->end, &e->gated,
+		&e->a, &e->d, &e->s, &e->r};
+	for(int i = 0; i < 9; i++, p += lanes)
+		*arrays[i] = p;
+	e->stage = (int*)p;
+	e->left = e->stage + lanes;
+	return (int*)state;
+}
+
+static int env_ticks(double n) {
+	return !(n > 1.0) ? 1 : n < ENV_FOREVER ? (int)ceil(n) : ENV_FOREVER;
+}
+static void env_segment(env_lanes *e, int v, int curve, float tick_secs) {
+	float sus = e->s[v] < 0.0f ? 0.0f : e->s[v] > 1.0f ? 1.0f : e->s[v];
+	float secs, from, to, ratio = ENV_DECAY_RATIO, level = e->level[v];
+	switch(e->stage[v]) {
+		case ENV_ATTACK:
+			secs = e->a[v]; from = 0.0f; to = 1.0f; ratio = -ENV_ATTACK_RATIO;
+			break;
+		case ENV_DECAY:
+			secs = e->d[v]; from = 1.0f; to = sus;
+			break;
+		case ENV_RELEASE:
+			secs = e->r[v]; from = level; to = 0.0f;
+			break;
+		default: // holding still
+			if(ENV_SUSTAIN == e->stage[v])
+				e->level[v] = sus;
+			e->mul[v] = 1.0f;
+			e->add[v] = 0.0f;
+			e->end[v] = e->level[v];
+			e->left[v] = ENV_FOREVER;
+			return;
+	}
+	float ticks = secs / tick_secs;
+	if(!(ticks > 1.0f))
+		ticks = 1.0f;
+	e->end[v] = to;
+	if(ENV_EXP == curve) {
+		// Towards a point past the end so it gets there in time
+		float aim = to - ratio;
+		float coef = expf(-logf((1.0f + fabsf(ratio)) / fabsf(ratio)) / ticks);
+		e->mul[v] = coef;
+		e->add[v] = aim * (1.0f - coef);
+		e->left[v] = env_ticks(log((to - aim) / (level - aim)) / log(coef));
+	} else {
+		e->mul[v] = 1.0f;
+		e->add[v] = (to - from) / ticks;
+		e->left[v] = e->add[v] ? env_ticks((to - level) / e->add[v]) : 1;
+	}
+}
+
+// Gate edges and input changes
+static inline int env_dirty(env_lanes *e, int v, float gate, float a, float d,
+		float s, float r) {
+	return ((e->gated[v] == 0.0f) & (gate >= 0.9f)) |
+		((e->gated[v] != 0.0f) & (gate <= 0.1f)) |
+		(a != e->a[v]) | (d != e->d[v]) | (s != e->s[v]) | (r != e->r[v]);
+}
+
+static inline void env_run(plan_step *s, float *pool, int nframes, int curve) {
+	float *a = get_input(s, pool, ENV_IN_A);
+	float *d = get_input(s, pool, ENV_IN_D);
+	float *sus = get_input(s, pool, ENV_IN_S);
+	float *r = get_input(s, pool, ENV_IN_R);
+	float *gate = get_input(s, pool, ENV_IN_GATE);
+	float *out = get_output(s, pool, ENV_OUT);
+	int lanes = s->lanes;
+	float tick_secs = (float)s->stride / (float)rate;
+	env_lanes e;
+	int *made_for = env_map(s->data, lanes, &e);
+
+	// Fresh state, or a reload changed the curve, everything gets worked out
+	if(*made_for != curve) {
+		*made_for = curve;
+		for(int v = 0; v < lanes; v++) {
+			e.a[v] = -1.0f;
+			e.left[v] = ENV_FOREVER;
+		}
+	}
+
+	for(int f = 0; f < nframes; f++) {
+		// Ticks before a segment ends or an input changes on any lane
+		int run = nframes - f;
+		for(int v = 0; v < lanes; v++)
+			if(e.left[v] - 1 < run)
+				run = e.left[v] - 1;
+		for(int g = f; g < f + run; g++) {
+			int dirty = 0;
+			for(int v = 0; v < lanes; v++) {
+				int x = g * lanes + v;
+				dirty |= env_dirty(&e, v, gate[x], a[x], d[x], sus[x], r[x]);
+			}
+			if(dirty)
+				run = g - f;
+		}
+		{
+			float *restrict level = e.level, *restrict o = out + f * lanes;
+			const float *restrict mul = e.mul, *restrict add = e.add;
+			for(int i = 0; i < run; i++)
+				for(int v = 0; v < lanes; v++)
+					o[i * lanes + v] = level[v] = level[v] * mul[v] + add[v];
 		}
-	} else { // last edge was rising
-		if(gate <= 0.1) { // Just got a falling edge
-			data->ticks_since_gate_low = 0;
-		} else { // Rising output
-			float t = (float)data->ticks_since_gate_high / (float)rate;
-			m->outputs[ENV_OUT] = (t < in_a) * (t / in_a) + (t > in_a) * 1.;
+		for(int v = 0; v < lanes; v++)
+			e.left[v] -= run;
+		if((f += run) == nframes)
+			break;
+
+		// Then one tick with each lane on its own
+		for(int v = 0; v < lanes; v++) {
+			int x = f * lanes + v;
+			if(env_dirty(&e, v, gate[x], a[x], d[x], sus[x], r[x])) {
+				if(e.gated[v] == 0.0f && gate[x] >= 0.9f) {
+					e.gated[v] = 1.0f;
+					e.stage[v] = ENV_ATTACK;
+				} else if(e.gated[v] != 0.0f && gate[x] <= 0.1f) {
+					e.gated[v] = 0.0f;
+					e.stage[v] = ENV_RELEASE;
+				}
+				e.a[v] = a[x];
+				e.d[v] = d[x];
+				e.s[v] = sus[x];
+				e.r[v] = r[x];
+				env_segment(&e, v, curve, tick_secs);
+			}
+			e.level[v] = e.level[v] * e.mul[v] + e.add[v];
+			if(--e.left[v] <= 0) {
+				e.level[v] = e.end[v];
+				e.stage[v] = ENV_ATTACK == e.stage[v] ? ENV_DECAY :
+					ENV_DECAY == e.stage[v] ? ENV_SUSTAIN : ENV_IDLE;
+				env_segment(&e, v, curve, tick_secs);
+			}
+			out[x] = e.level[v];
 		}
 	}
-	data->ticks_since_gate_high++;
-	data->ticks_since_gate_low++;
-	
-	debug_print("ENV %p - ->0 %i  ->1 %i, gate = %f,  ADSR = [%f %f %f %f] -> %f\n", 
-			(void*)m,
-			data->ticks_since_gate_low,
-			data->ticks_since_gate_high,
-			gate,
-			in_a, in_d, in_s, in_r,
-			m->outputs[ENV_OUT]
-			);
+}
+void env_process(plan_step *s, float *pool, int nframes) {
+	env_run(s, pool, nframes, ENV_LINEAR);
+}
+void env_exp_process(plan_step *s, float *pool, int nframes) {
+	env_run(s, pool, nframes, ENV_EXP);
 }
 int make_env(mod *m) {
 	memcpy(m->type, "ENV", 3);
-	m->inputs = malloc(5 * sizeof(mod*));
-	m->input_idxs = malloc(5 * sizeof(int));
-	m->outputs = malloc(sizeof(float));
-	m->data = malloc(sizeof(env_data));
-	m->tick = &env_tick;
+	make_ports(m, 5, 1);
+	m->state_size = &env_state_size;
+	m->rate = PLAN_RATE_CONTROL;
+	m->process = &env_process;
+	m->cost = 14;
+	return 0;
+}
+// 1 for exponential segments, before the plan is compiled
+void env_set_curve(mod *m, int exponential) {
+	m->process = exponential ? &env_exp_process : &env_process;
+}
+
+/* VOICE SOURCE: per voice gate, pitch in Hz and velocity from the notes
+ * being played. Everything downstream of it runs once per voice. */
+#define KEY_OUT_GATE 0
+#define KEY_OUT_PITCH 1
+#define KEY_OUT_VEL 2
+void key_process(plan_step *s, float *pool, int nframes) {
+	voice_render(&voices,
+			get_output(s, pool, KEY_OUT_GATE),
+			get_output(s, pool, KEY_OUT_PITCH),
+			get_output(s, pool, KEY_OUT_VEL),
+			nframes);
+}
+int make_key(mod *m) {
+	memcpy(m->type, "KEY", 3);
+	make_ports(m, 0, 3);
+	m->voicing = PLAN_VOICE_SOURCE;
+	m->rate = PLAN_RATE_AUDIO;
+	m->process = &key_process;
+	m->cost = 15;
 	return 0;
 }
 
+/* SEQUENCER: one line of notes from a file, see seq.h, as gate, pitch in
+ * Hz and velocity like KEY's but mono. Each event lands on its own frame.
+ * The newest held note plays, overlapping notes play legato, and a note
+ * starting on the frame the last one ended gets its gate a frame late so
+ * envelopes see the edge. */
+#define SEQ_OUT_GATE 0
+#define SEQ_OUT_PITCH 1
+#define SEQ_OUT_VEL 2
+#define SEQ_MAX_HELD 16
+typedef struct seq_data {
+	seq_event *events; // loaded by build_network, freed with the network
+	int nevents;
+	int next; // first event not played yet
+	uint64_t pos; // frames played
+	float gate, pitch, velocity;
+	int nheld;
+	int held[SEQ_MAX_HELD]; // notes down, the newest last
+} seq_data;
+
+static float seq_hz(int note) {
+	return 440.0f * powf(2.0f, (float)(note - 69) / 12.0f);
+}
+// 1 if the gate fell
+static int seq_apply(seq_data *d, seq_event *e) {
+	int i = 0;
+	while(i < d->nheld && d->held[i] != e->note)
+		i++;
+	if(i < d->nheld) {
+		memmove(&d->held[i], &d->held[i + 1], (d->nheld - i - 1) * sizeof(int));
+		d->nheld--;
+	}
+	if(e->velocity > 0.0f) {
+		if(d->nheld == SEQ_MAX_HELD)
+			memmove(&d->held[0], &d->held[1], --d->nheld * sizeof(int));
+		d->held[d->nheld++] = e->note;
+		d->gate = 1.0f;
+		d->pitch = seq_hz(e->note);
+		d->velocity = e->velocity;
+		return 0;
+	}
+	if(d->nheld) {
+		d->pitch = seq_hz(d->held[d->nheld - 1]);
+		return 0;
+	}
+	// Pitch and velocity stay put for the release
+	int fell = d->gate > 0.0f;
+	d->gate = 0.0f;
+	return fell;
+}
+void seq_process(plan_step *s, float *pool, int nframes) {
+	seq_data *d = (seq_data*)s->data;
+	float *gate = get_output(s, pool, SEQ_OUT_GATE);
+	float *pitch = get_output(s, pool, SEQ_OUT_PITCH);
+	float *vel = get_output(s, pool, SEQ_OUT_VEL);
+
+	for(int f = 0; f < nframes; f++) {
+		int fell = 0;
+		while(d->next < d->nevents && d->events[d->next].frame <= d->pos + f) {
+			seq_event *e = &d->events[d->next];
+			if(fell && e->velocity > 0.0f)
+				break;
+			fell |= seq_apply(d, e);
+			d->next++;
+		}
+		gate[f] = d->gate;
+		pitch[f] = d->pitch;
+		vel[f] = d->velocity;
+	}
+	d->pos += nframes;
+}
+int make_seq(mod *m) {
+	memcpy(m->type, "SEQ", 3);
+	make_ports(m, 0, 3);
+	m->voicing = PLAN_VOICE_NEVER;
+	m->rate = PLAN_RATE_AUDIO;
+	m->process = &seq_process;
+	m->cost = 5;
+	m->data_size = sizeof(seq_data);
+	return 0;
+}
+int seq_set_file(mod *m, const char *path) {
+	seq_data *d = (seq_data*)m->data;
+	if(!(d->events = seq_load(path, rate, &d->nevents)))
+		return -1;
+	d->pitch = d->nevents ? seq_hz(d->events[0].note) : 0.0f;
+	printf("SEQ %s, %i events\n", path, d->nevents);
+	return 0;
+}
+// Frames until the last event
+static uint64_t seq_frames(mod *m) {
+	seq_data *d = (seq_data*)m->data;
+	return d->nevents ? d->events[d->nevents - 1].frame : 0;
+}
+// Sequences belong to the modules, not the plan block
+static void free_seqs(mod *ms, int n) {
+	for(int i = 0; i < n; i++)
+		if(0 == strncmp(ms[i].type, "SEQ", 3) && ms[i].data)
+			free(((seq_data*)ms[i].data)->events);
+}
+
+/* PAN */
+#define PAN_IN_SIG 0
+#define PAN_IN_POS 1 // 0 all left, 1 all right
+#define PAN_OUT_L 0
+#define PAN_OUT_R 1
+// Equal power, so a sound keeps its loudness as it moves across
+void pan_process(plan_step *s, float *pool, int nframes) {
+	float *sig = get_input(s, pool, PAN_IN_SIG);
+	float *pos = get_input(s, pool, PAN_IN_POS);
+	float *l = get_output(s, pool, PAN_OUT_L);
+	float *r = get_output(s, pool, PAN_OUT_R);
+	for(int f = 0; f < nframes * s->lanes; f++) {
+		float p = pos[f] < 0.0f ? 0.0f : pos[f] > 1.0f ? 1.0f : pos[f];
+		l[f] = sig[f] * sqrtf(1.0f - p);
+		r[f] = sig[f] * sqrtf(p);
+	}
+}
+int make_pan(mod *m) {
+	memcpy(m->type, "PAN", 3);
+	make_ports(m, 2, 2);
+	m->process = &pan_process;
+	m->cost = 10;
+	return 0;
+}
+
+/* OUTPUT BUS. Every OUT mixes into one interleaved bus, OUTs on the same
+ * channel add up. The bus goes to the device or the render file in one
+ * write per period, or with mmap straight into the device's buffer after
+ * each block. */
+typedef struct out_bus {
+	int channels;
+	int i; // frames waiting for a whole period
+	int used; // something wrote to the bus this block
+	float *buf; // a period and a block of frames, zero where nothing wrote
+	void *dev; // a period in the device's format, floats are the widest
+	float *fade[2]; // a block of frames from each patch while crossfading
+	char *written; // per channel, whether an OUT wrote it this block
+} out_bus;
+out_bus bus;
+int out_channels = 0; // of the bus, 0 for as many as the patch uses
+
 #define OTP_IN 0
 typedef struct otp_data {
-	float *fbuf;
-	int16_t *ibuf;
-	int i;
+	int channel;
 } otp_data;
 struct timespec last_dump;
-void otp_tick(mod *m) {
-	unsigned int pcm;
-	float in = get_input(m, OTP_IN);
-	otp_data *data = (otp_data*)m->data;
-	data->fbuf[data->i++] = in;
-
-	//struct timespec now, elapsed;
-
-	// Time to dump the data into the audio buffer?
-	if(data->i == frames) {
-		//clock_gettime(CLOCK_REALTIME, &now);
-		//timespec_diff(&now, &start_time, &elapsed);
-		//printf("Dump at %fsecs\n", (float)elapsed.tv_sec + (float)elapsed.tv_nsec / (float)NANO);
-		//timespec_diff(&now, &last_dump, &elapsed);
-		//printf("Last dump %fsecs ago\n", (float)elapsed.tv_sec + (float)elapsed.tv_nsec / (float)NANO);
-		//memcpy(&last_dump, &now, sizeof(struct timespec));
-		for(int i = 0; i < frames; i++) {
-			data->ibuf[i] = (int16_t)(data->fbuf[i] * 32767.0f);
-			//printf("%f -> %i\n", data->fbuf[i], data->ibuf[i]);
+
+// Device format samples from floats, dst_stride in samples
+void pcm_convert(void *dst, int dst_stride, const float *in, int n) {
+	uint32_t *d = pcm_dither ? dither_state : NULL;
+	switch(pcm_format) {
+		case SND_PCM_FORMAT_FLOAT_LE:
+			for(int f = 0; f < n; f++)
+				((float*)dst)[f * dst_stride] = in[f];
+			break;
+		case SND_PCM_FORMAT_S32_LE:
+			dsp_to_s32((int32_t*)dst, dst_stride, in, n, DSP_S32_SCALE, d);
+			break;
+		case SND_PCM_FORMAT_S24_LE:
+			dsp_to_s32((int32_t*)dst, dst_stride, in, n, DSP_S24_SCALE, d);
+			break;
+		default:
+			dsp_to_s16((int16_t*)dst, dst_stride, in, n, d);
+	}
+}
+
+static void pcm_xrun(int err) {
+	if(-EPIPE == err)
+		stats_add_xrun(&stats, synth_frame);
+	if((err = snd_pcm_recover(pcm_handle, err, 1)) < 0)
+		printf("ERROR: Can't recover PCM device. %s\n", snd_strerror(err));
+}
+
+static void bus_free() {
+	free(bus.buf);
+	memset(&bus, 0, sizeof(out_bus));
+}
+// After the period size is known, before the first patch loads
+static void bus_init(int channels) {
+	bus_free();
+	bus.channels = channels;
+	size_t len = (size_t)(frames + block_size) * channels;
+	size_t fade = (size_t)block_size * channels;
+	bus.buf = calloc(1, (len + 2 * fade + frames * channels) * sizeof(float) + channels);
+	bus.fade[0] = bus.buf + len;
+	bus.fade[1] = bus.fade[0] + fade;
+	bus.dev = bus.fade[1] + fade;
+	bus.written = (char*)((float*)bus.dev + frames * channels);
+}
+
+// The first n frames of the bus out in one write
+static void bus_flush(int n) {
+	snd_pcm_sframes_t pcm;
+	int ch = bus.channels;
+
+	if(render_file) {
+		wav_write(render_file, bus.buf, n);
+	} else {
+		pcm_convert(bus.dev, 1, bus.buf, n * ch);
+		if ((pcm = snd_pcm_writei(pcm_handle, bus.dev, n)) < 0)
+			pcm_xrun(pcm);
+	}
+	bus.i -= n;
+	memmove(bus.buf, bus.buf + n * ch, bus.i * ch * sizeof(float));
+	memset(bus.buf + bus.i * ch, 0, n * ch * sizeof(float));
+}
+
+/* Straight into the device's ring, no copies of our own. The main loop
+ * only runs a block once there is room for it. Interleaved, so the
+ * frames are one run of samples like the bus. Should the ring be full
+ * anyway it gets up to a period to drain, after that the rest of the
+ * block is dropped and counted. */
+static void bus_mmap_write(const float *in, int nframes) {
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, n;
+	snd_pcm_sframes_t err;
+	int waited = 0;
+
+	while(nframes > 0) {
+		if((err = snd_pcm_avail_update(pcm_handle)) < 0) {
+			pcm_xrun(err);
+			return;
+		}
+		n = nframes;
+		if((err = snd_pcm_mmap_begin(pcm_handle, &areas, &offset, &n)) < 0) {
+			pcm_xrun(err);
+			return;
 		}
-		if ((pcm = snd_pcm_writei(pcm_handle, data->ibuf, frames)) == -EPIPE) {
-			printf("XRUN.\n");
-			snd_pcm_prepare(pcm_handle);
-		} else if (pcm < 0) {
-			printf("ERROR. Can't write to PCM device. %s\n", snd_strerror(pcm));
+		if(0 == n) {
+			if(waited) {
+				stats_add_dropped(&stats, nframes);
+				return;
+			}
+			waited = 1;
+			if((err = snd_pcm_wait(pcm_handle, 1 + frames * 1000 / rate)) < 0) {
+				pcm_xrun(err);
+				return;
+			}
+			continue;
 		}
-		data->i = 0;
+		char *dst = (char*)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+		pcm_convert(dst, 1, in, n * bus.channels);
+		if((err = snd_pcm_mmap_commit(pcm_handle, offset, n)) < 0) {
+			pcm_xrun(err);
+			return;
+		}
+		in += n * bus.channels;
+		nframes -= n;
+	}
+}
+
+// After the OUTs of a block have written it
+static void bus_advance(int nframes) {
+	if(!bus.used)
+		return;
+	bus.used = 0;
+	memset(bus.written, 0, bus.channels);
+	if(pcm_mmap && !render_file) {
+		bus_mmap_write(bus.buf, nframes);
+		memset(bus.buf, 0, nframes * bus.channels * sizeof(float));
+		return;
 	}
+	// Blocks need not line up with periods
+	bus.i += nframes;
+	while(bus.i >= frames)
+		bus_flush(frames);
+}
+
+// Set while crossfading patches, OUT adds into this instead of the bus
+float *otp_capture = NULL;
+
+void otp_process(plan_step *s, float *pool, int nframes) {
+	float *in = get_input(s, pool, OTP_IN);
+	int c = ((otp_data*)s->data)->channel, ch = bus.channels;
+	if(c >= ch)
+		return;
+
+	if(otp_capture) {
+		for(int f = 0; f < nframes; f++)
+			otp_capture[f * ch + c] += in[f];
+		return;
+	}
+	// The first OUT on a channel copies so one OUT plays exactly its input
+	float *out = bus.buf + bus.i * ch + c;
+	if(bus.written[c])
+		for(int f = 0; f < nframes; f++)
+			out[f * ch] += in[f];
+	else
+		for(int f = 0; f < nframes; f++)
+			out[f * ch] = in[f];
+	bus.written[c] = 1;
+	bus.used = 1;
 }
 int make_otp(mod *m) {
 	memcpy(m->type, "OTP", 3);
-	m->inputs = malloc(sizeof(mod*));
-	m->input_idxs = malloc(sizeof(int));
-	m->outputs = NULL;
-	m->tick = &otp_tick;
-	otp_data *data = (otp_data*)malloc(sizeof(otp_data));
-	data->fbuf = (float*)malloc(frames * sizeof(float));
-	data->ibuf = (int16_t*)malloc(frames * sizeof(int));
-	data->i = 0;
-	m->data = (void*)data;
+	make_ports(m, 1, 0);
+	m->voicing = PLAN_VOICE_NEVER;
+	m->rate = PLAN_RATE_AUDIO;
+	m->process = &otp_process;
+	m->cost = 20;
+	m->serial = 1;
+	m->data_size = sizeof(otp_data);
 	return 0;
 }
+void otp_set_channel(mod *m, int channel) {
+	if(channel >= bus.channels)
+		printf("WARNING: OUT on channel %i, there are only %i\n",
+				channel, bus.channels);
+	((otp_data*)m->data)->channel = channel;
+}
 
 /*************************/
-void freadline(char line[LINE_MAX_LEN], FILE *f) {
-	while(isspace(fgetc(f)));
-	if(feof(f)) return;
-	fseek(f, -1, SEEK_CUR); 
-	int i = 0;
-	line[i] = fgetc(f);
-	while(line[i] != '\n') 
-		line[++i] = fgetc(f);
+// Must be called before load_network, port buffers are sized from it.
+void set_block_size(int n) {
+	if(n < 1) n = 1;
+	if(n > MAX_BLOCK_SIZE) n = MAX_BLOCK_SIZE;
+	block_size = n;
 }
-void parse_input(mod *mods, int m, int input, char *line, int *pos) {
-		mods[m].inputs[input] = &mods[atoi(&line[*pos])];
-		while('/' != line[(*pos)++]);
-		mods[m].input_idxs[input] = atoi(&line[*pos]);
+int get_block_size() { return block_size; }
 
-		while(isdigit(line[(*pos)++]));
+// Frames per control rate tick before load_network, 1 for none
+void set_control_period(int n) {
+	control_period = n < 1 ? 1 : n > MAX_BLOCK_SIZE ? MAX_BLOCK_SIZE : n;
 }
-void parse_mod_line(mod *mods, char line[LINE_MAX_LEN]) {
-	int i = 0;
-	int n = atoi(line);
-	while(isdigit(line[i++]));
-	
-	if(0 == strncmp("CST", &line[i], 3)) {
-		make_cst(&mods[n]);
-		i += 4;
-		cst_set_val(&mods[n], atof(&line[i]));
-		cst_set_init_val(&mods[n], atof(&line[i]));
-		while(!isspace(line[i++]));
-
-		if(0 == strncmp("HFO", &line[i], 3) ||
-			 0 == strncmp("LFO", &line[i], 3) ||
-			 0 == strncmp("PER", &line[i], 3) ||
-		   0 == strncmp("NDS", &line[i], 3)) {
-			cst_set_type(&mods[n], &line[i]);
-			i += 4;
+
+// Whether plans get pruned and fused, before load_network
+void set_optimize(int on) {
+	optimize = on;
+}
+
+// Whether plans get compiled to native code, before load_network
+void set_native(int on) {
+	use_native = on;
+}
+
+// Bus channels before load_network, 0 for as many as the patch's OUTs use
+void set_channels(int n) {
+	out_channels = n < 0 ? 0 : n > MAX_CHANNELS ? MAX_CHANNELS : n;
+}
+int get_channels() { return bus.channels; }
+
+// Voices for patches with a KEY module, before load_network
+void set_voices(int n) {
+	voice_init(&voices, n > 0 ? n : DEFAULT_VOICES);
+}
+
+// Most threads a patch may run on, 0 for one per core
+void set_threads(int n) {
+	if(n < 1) n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n < 1) n = 1;
+	if(n > SCHED_MAX_WORKERS) n = SCHED_MAX_WORKERS;
+	max_threads = n;
+}
+
+// Keywords of the layout file, the parser checks wiring against these
+static const patch_type mod_types[] = {
+	{"CST", 0, 1, 1, 0, 0},
+	{"ADD", 2, 1, 0, 0, 0},
+	{"FAD", 3, 1, 0, 0, 0},
+	{"OCC", 1, 4, 0, 0, 0},
+	{"VCA", 2, 1, 0, 0, 0},
+	{"VCF", 3, 1, 0, 0, 0},
+	{"ENV", 5, 1, 0, 1, 0}, // then 1 for exponential curves
+	{"KEY", 0, 3, 0, 0, 0},
+	{"OUT", 1, 0, 0, 1, 0}, // then the channel, 0 if there is none
+	{"PAN", 2, 2, 0, 0, 0},
+	{"SEQ", 0, 3, 0, 0, 1},
+	{NULL, 0, 0, 0, 0, 0}
+};
+static int (*const mod_makers[])(mod *m) = {
+	make_cst, make_add, make_fad, make_occ, make_vca, make_vcf, make_env,
+	make_key, make_otp, make_pan, make_seq
+};
+
+/* Where parsed layouts are kept, NULL for $XDG_CACHE_HOME/synth and "" for
+ * nowhere. Nothing is cached until this is called. */
+static char cache_dir[1024];
+void set_patch_cache(const char *dir) {
+	if(dir) {
+		snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+	} else if(getenv("XDG_CACHE_HOME") && getenv("XDG_CACHE_HOME")[0]) {
+		snprintf(cache_dir, sizeof(cache_dir), "%s/synth", getenv("XDG_CACHE_HOME"));
+	} else if(getenv("HOME")) {
+		snprintf(cache_dir, sizeof(cache_dir), "%s/.cache/synth", getenv("HOME"));
+	} else {
+		cache_dir[0] = 0;
+	}
+}
+
+static void free_network(network *n) {
+	if(n->sched)
+		sched_free(n->sched);
+	native_free(n->native);
+	if(n->plan) {
+		free_seqs(n->mods, n->nmods);
+		plan_free(n->plan);
+	}
+	free(n->mods);
+	free(n->stats_mods);
+	free(n->carry);
+	free(n->carry_size);
+	free(n);
+}
+
+/* Modules from a parsed or mapped patch, then the plan to run them. The
+ * modules and their wiring are one block, everything the plan runs is
+ * another. */
+static network *build_network(patch *p) {
+	network *n = calloc(1, sizeof(network));
+	n->nmods = p->nmods;
+	n->mods = calloc(1, p->nmods * sizeof(mod) + 2 * p->ninputs * sizeof(int));
+	int *wires = (int*)(n->mods + p->nmods), nwires = 0;
+	printf("nmods : %i\n", n->nmods);
+
+	for(int i = 0; i < p->nmods; i++) {
+		patch_mod *pm = &p->mods[i];
+		mod *m = &n->mods[i];
+		if(!pm->type[0])
+			continue;
+		int t = 0;
+		while(mod_types[t].name && strncmp(mod_types[t].name, pm->type, 3))
+			t++;
+		if(!mod_types[t].name || pm->ninputs != mod_types[t].ninputs) {
+			printf("ERROR: Module %i has a bad type %.3s\n", i, pm->type);
+			free_network(n);
+			return NULL;
+		}
+		mod_makers[t](m);
+		if(0 == strncmp(m->type, "ENV", 3))
+			env_set_curve(m, pm->val);
+		if(m->nins != mod_types[t].ninputs || m->nouts != mod_types[t].noutputs) {
+			printf("ERROR: %s ports don't match mod_types\n", mod_types[t].name);
+			free_network(n);
+			return NULL;
+		}
+		if(nwires + m->nins > p->ninputs) {
+			printf("ERROR: Module %i has more inputs than the patch\n", i);
+			free_network(n);
+			return NULL;
+		}
+		if(mod_types[t].cst)
+			m->rate = pm->cst_type[0] ? cst_rate(pm->cst_type) : PLAN_RATE_AUDIO;
+		m->inputs = wires + 2 * nwires;
+		m->input_idxs = m->inputs + m->nins;
+		nwires += m->nins;
+		for(int j = 0; j < pm->ninputs; j++) {
+			m->inputs[j] = p->inputs[pm->first_input + j].mod;
+			m->input_idxs[j] = p->inputs[pm->first_input + j].port;
 		}
-		else 
-			printf("Bad CST UI Type in: %s\n", line);
-
-		cst_set_label(&mods[n], &line[i]);
-		cst_print(&mods[n]);
-	}
-	else if(0 == strncmp("ADD", &line[i], 3)) {
-		make_add(&mods[n]);
-		i += 4;
-		parse_input(mods, n, ADD_IN1, line, &i);
-		parse_input(mods, n, ADD_IN2, line, &i);
-	}
-	else if(0 == strncmp("FAD", &line[i], 3)) {
-		make_fad(&mods[n]);
-		i += 4;
-		parse_input(mods, n, FAD_IN_SIG1, line, &i);
-		parse_input(mods, n, FAD_IN_SIG2, line, &i);
-		parse_input(mods, n, FAD_IN_MIX, line, &i);
-	}
-	else if(0 == strncmp("OCC", &line[i], 3)) {
-		make_occ(&mods[n]);
-		i += 4;
-		parse_input(mods, n, OCC_IN_FREQ, line, &i);
-	}
-	else if(0 == strncmp("VCA", &line[i], 3)) {
-		make_vca(&mods[n]);
-		i += 4;
-		parse_input(mods, n, VCA_IN_CV, line, &i);
-		parse_input(mods, n, VCA_IN_SIG, line, &i);
-	}
-	else if(0 == strncmp("VCF", &line[i], 3)) {
-		make_vcf(&mods[n]);
-		i += 4;
-		parse_input(mods, n, VCF_IN_CUT, line, &i);
-		parse_input(mods, n, VCF_IN_RES, line, &i);
-		parse_input(mods, n, VCF_IN_SIG, line, &i);
-	}
-	else if(0 == strncmp("ENV", &line[i], 3)) {
-		make_env(&mods[n]);
-		i += 4;
-		parse_input(mods, n, ENV_IN_A, line, &i);
-		parse_input(mods, n, ENV_IN_D, line, &i);
-		parse_input(mods, n, ENV_IN_S, line, &i);
-		parse_input(mods, n, ENV_IN_R, line, &i);
-		parse_input(mods, n, ENV_IN_GATE, line, &i);
-	}
-	else if(0 == strncmp("OUT", &line[i], 3)) {
-		make_otp(&mods[n]);
-		i += 4;
-		parse_input(mods, n, OTP_IN, line, &i);
 	}
-	else
-		printf("Bad module type in: %s\n", line);
+
+	n->plan = plan_compile(n->mods, n->nmods, block_size, voices.nvoices,
+			control_period, optimize);
+	if(!n->plan) {
+		free_network(n);
+		return NULL;
+	}
+	// Settings live in the plan, so only now can they be set
+	for(int i = 0; i < p->nmods; i++) {
+		patch_mod *pm = &p->mods[i];
+		mod *m = &n->mods[i];
+		if(0 == strncmp(m->type, "OTP", 3))
+			otp_set_channel(m, pm->val);
+		if(0 == strncmp(m->type, "SEQ", 3) && seq_set_file(m, p->strings + pm->label)) {
+			free_network(n);
+			return NULL;
+		}
+		if(!m->type[0] || strncmp(m->type, "CST", 3))
+			continue;
+		cst_set_init_val(m, pm->val);
+		if(pm->cst_type[0])
+			cst_set_type(m, pm->cst_type);
+		cst_set_label(m, pm->label < 0 ? "" : p->strings + pm->label);
+		cst_print(m);
+	}
+	if(use_native)
+		n->native = native_build(n->plan, n->mods, cache_dir, &cst_fixed);
+	n->stats_mods = calloc(n->nmods + 1, sizeof(stats_module));
+	return n;
 }
-int load_network(char *filename) {
-	FILE * f = fopen(filename, "r");
-	// Go to the last line and get the highest mod number.
-	fseek(f, 1, SEEK_END);
-	// Ignore whitespace at the end
-	while(isspace(fgetc(f)))
-		fseek(f, -2, SEEK_CUR); 
-	// Move back past the \n
-	fseek(f, -1, SEEK_CUR); 
-	// Find the next carrige return
-	while(fgetc(f) != '\n')
-		fseek(f, -2, SEEK_CUR);
-	// Read the last line
-	char line[LINE_MAX_LEN] = {0,};
-	fread(line, 1, LINE_MAX_LEN, f);
-	// Get the number
-	init_mods(atoi(line) + 1); // Number from 0
-	printf("nmods : %i\n", nmods);
-
-	rewind(f);
-	while(!feof(f)) {
-		memset(line, 0, LINE_MAX_LEN);
-		freadline(line, f);
-		printf("%s--\n", line);
-		parse_mod_line(mods, line);
-	}
-	
+
+// Trade places with the live patch, n ends up holding the old one
+static void exchange_network(network *n) {
+	network old = {nmods, mods, synth_plan, synth_sched, synth_native};
+	// Anyone reading mods[i] for i < nmods stays in bounds
+	if(n->nmods > nmods) {
+		__atomic_store_n(&mods, n->mods, __ATOMIC_RELEASE);
+		__atomic_store_n(&nmods, n->nmods, __ATOMIC_RELEASE);
+	} else {
+		__atomic_store_n(&nmods, n->nmods, __ATOMIC_RELEASE);
+		__atomic_store_n(&mods, n->mods, __ATOMIC_RELEASE);
+	}
+	synth_plan = n->plan;
+	synth_sched = n->sched;
+	synth_native = n->native;
+	n->nmods = old.nmods;
+	n->mods = old.mods;
+	n->plan = old.plan;
+	n->sched = old.sched;
+	n->native = old.native;
+}
+
+// Channels the OUTs of p play on
+static int patch_channels(patch *p) {
+	int channels = 1;
+	for(int i = 0; i < p->nmods; i++)
+		if(0 == strncmp(p->mods[i].type, "OUT", 3) && p->mods[i].val >= channels)
+			channels = p->mods[i].val + 1;
+	return channels < MAX_CHANNELS ? channels : MAX_CHANNELS;
+}
+
+// The bus is sized by the first patch, reloads keep it
+int load_patch(patch *p) {
+	bus_init(out_channels ? out_channels : patch_channels(p));
+	network *n = build_network(p);
+	if(!n)
+		return -1;
+	n->sched = sched_create(n->plan, max_threads);
+	stats_init(&stats, n->nmods, rate, block_size);
+	exchange_network(n);
+	free_network(n);
 	return 0;
 }
+
+// All of f, with a 0 after it for the parser
+static char *read_all(FILE *f, size_t *len) {
+	size_t cap = 4096, n = 0, got;
+	char *buf = malloc(cap);
+	while((got = fread(buf + n, 1, cap - n - 1, f)) > 0) {
+		n += got;
+		if(n + 1 == cap)
+			buf = realloc(buf, cap *= 2);
+	}
+	buf[n] = 0;
+	*len = n;
+	return buf;
+}
+
+/* Layout text, or a .synb made from one. Text whose hash has a .synb in
+ * the cache loads from that, anything else is parsed and cached. */
+static patch *read_patch(const char *filename) {
+	size_t len = strlen(filename);
+	patch *p;
+	if(len > 5 && 0 == strcmp(filename + len - 5, ".synb")) {
+		if(!(p = patch_map(filename, 0))) {
+			printf("ERROR: Can't load compiled layout \"%s\"\n", filename);
+			return NULL;
+		}
+		printf("Loaded %s\n", filename);
+		return p;
+	}
+
+	FILE *f = fopen(filename, "r");
+	if(!f) {
+		printf("ERROR: Can't open layout \"%s\"\n", filename);
+		return NULL;
+	}
+	char *src = read_all(f, &len);
+	fclose(f);
+
+	char path[1100];
+	uint64_t hash = patch_hash(src, len);
+	p = NULL;
+	if(cache_dir[0]) {
+		patch_cache_path(path, sizeof(path), cache_dir, hash);
+		if((p = patch_map(path, hash)))
+			printf("Loaded %s from %s\n", filename, path);
+	}
+	if(!p) {
+		p = patch_parse(filename, src, len, mod_types);
+		if(p && cache_dir[0])
+			patch_save(p, path);
+	}
+	free(src);
+	return p;
+}
+int load_network(char *filename) {
+	patch *p = read_patch(filename);
+	if(!p)
+		return -1;
+	int ret = load_patch(p);
+	patch_free(p);
+	return ret;
+}
+// Layout text from any stream, never cached
+int load_network_from(FILE *f) {
+	size_t len;
+	char *src = read_all(f, &len);
+	patch *p = patch_parse("<stream>", src, len, mod_types);
+	free(src);
+	if(!p)
+		return -1;
+	int ret = load_patch(p);
+	patch_free(p);
+	return ret;
+}
+void unload_network() {
+	int n = nmods;
+	mod *m = mods;
+	__atomic_store_n(&nmods, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&mods, NULL, __ATOMIC_RELEASE);
+	wait_readers();
+	if(synth_sched)
+		sched_free(synth_sched);
+	native_free(synth_native);
+	synth_native = NULL;
+	if(synth_plan) {
+		free_seqs(m, n);
+		plan_free(synth_plan);
+	}
+	free(m);
+	stats_free(&stats);
+	synth_plan = NULL;
+	synth_sched = NULL;
+	bus_free();
+}
+// Channels a layout plays on, 1 if it doesn't load
+int layout_channels(const char *filename) {
+	patch *p = read_patch(filename);
+	if(!p)
+		return 1;
+	int channels = patch_channels(p);
+	patch_free(p);
+	return channels;
+}
+plan *get_synth_plan() { return synth_plan; }
+synth_stats *get_synth_stats() { return &stats; }
 /*************************/
 
 /*  ^^^^ 0.0 -> 1.0+  ^^^^ vvvv -32767 -> 32767 vvvv */
 
-void init_pcm() {
-	unsigned int pcm, tmp;
+/* period and periods of 0 leave the sizes to the device, which may also
+ * give other than the channels asked for. Returns the channels it has. */
+int init_pcm(int period, int periods, int dither, int channels) {
+	int pcm;
+	unsigned int tmp;
 
 	/* Open the PCM device in playback mode */
 	if ((pcm = snd_pcm_open(&pcm_handle, PCM_DEVICE,
@@ -516,23 +1382,49 @@ void init_pcm() {
 	snd_pcm_hw_params_alloca(&params);
 	snd_pcm_hw_params_any(pcm_handle, params);
 
-	/* Set parameters */
-	if ((pcm = snd_pcm_hw_params_set_access(pcm_handle, params,
-					SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) 
+	/* Set parameters, mmap if the device can */
+	pcm_mmap = 0 == snd_pcm_hw_params_test_access(pcm_handle, params,
+			SND_PCM_ACCESS_MMAP_INTERLEAVED);
+	if ((pcm = snd_pcm_hw_params_set_access(pcm_handle, params, pcm_mmap ?
+					SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) 
 		printf("ERROR: Can't set interleaved mode. %s\n", snd_strerror(pcm));
 
-	if ((pcm = snd_pcm_hw_params_set_format(pcm_handle, params,
-					SND_PCM_FORMAT_S16_LE)) < 0) 
+	/* Cheapest format first, floats need no conversion at all */
+	static const snd_pcm_format_t formats[] = {SND_PCM_FORMAT_FLOAT_LE,
+		SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S24_LE, SND_PCM_FORMAT_S16_LE};
+	pcm_format = SND_PCM_FORMAT_S16_LE;
+	for(int i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+		if(0 == snd_pcm_hw_params_test_format(pcm_handle, params, formats[i])) {
+			pcm_format = formats[i];
+			break;
+		}
+	if ((pcm = snd_pcm_hw_params_set_format(pcm_handle, params, pcm_format)) < 0) 
 		printf("ERROR: Can't set format. %s\n", snd_strerror(pcm));
+	pcm_dither = dither && pcm_format != SND_PCM_FORMAT_FLOAT_LE;
+	dsp_dither_init(dither_state);
 
 
-	/* mono only */
-	if ((pcm = snd_pcm_hw_params_set_channels(pcm_handle, params, 1)) < 0) 
+	tmp = channels;
+	if ((pcm = snd_pcm_hw_params_set_channels_near(pcm_handle, params, &tmp)) < 0) 
 		printf("ERROR: Can't set channels number. %s\n", snd_strerror(pcm));
 
 	if ((pcm = snd_pcm_hw_params_set_rate_near(pcm_handle, params, &rate, 0)) < 0) 
 		printf("ERROR: Can't set rate. %s\n", snd_strerror(pcm));
 
+	if (period > 0) {
+		frames = period;
+		if ((pcm = snd_pcm_hw_params_set_period_size_near(pcm_handle, params,
+						&frames, 0)) < 0)
+			printf("ERROR: Can't set period size. %s\n", snd_strerror(pcm));
+	}
+	if (periods > 0) {
+		snd_pcm_hw_params_get_period_size(params, &frames, 0);
+		buffer_frames = frames * periods;
+		if ((pcm = snd_pcm_hw_params_set_buffer_size_near(pcm_handle, params,
+						&buffer_frames)) < 0)
+			printf("ERROR: Can't set buffer size. %s\n", snd_strerror(pcm));
+	}
+
 	/* Write parameters */
 	if ((pcm = snd_pcm_hw_params(pcm_handle, params)) < 0)
 		printf("ERROR: Can't set harware parameters. %s\n", snd_strerror(pcm));
@@ -540,91 +1432,576 @@ void init_pcm() {
 	/* Resume information */
 	printf("PCM Sample size %i bits\n", snd_pcm_hw_params_get_sbits(params));
 
+	printf("PCM format: %s%s, %s\n", snd_pcm_format_name(pcm_format),
+			pcm_dither ? " dithered" : "", pcm_mmap ? "mmap" : "read/write");
+
 	printf("PCM name: '%s'\n", snd_pcm_name(pcm_handle));
 
 	printf("PCM state: %s\n", snd_pcm_state_name(snd_pcm_state(pcm_handle)));
 
 	snd_pcm_hw_params_get_channels(params, &tmp);
 	printf("channels: %i ", tmp);
+	channels = tmp;
 
 	if (tmp == 1)
 		printf("(mono)\n");
 	else if (tmp == 2)
 		printf("(stereo)\n");
+	else
+		printf("\n");
 
 	snd_pcm_hw_params_get_rate(params, &tmp, 0);
 	printf("rate: %d bps\n", tmp);
 
 	snd_pcm_hw_params_get_period_size(params, &frames, 0);
+	snd_pcm_hw_params_get_buffer_size(params, &buffer_frames);
 	unsigned int period_time;
 	int dir;
 	snd_pcm_hw_params_get_period_time(params, &period_time, &dir);
-	printf("Need %lu frames in %uus\n", frames, period_time);
+	printf("Need %lu frames in %uus, %lu frames buffered\n",
+			frames, period_time, buffer_frames);
+	return channels;
 }
 
-void *synth_main_loop(void *synth_data) {
+/* Wake once there is room for the periods a block can complete, start
+ * playing once the buffer is full. Returns the frames free at a wakeup. */
+int init_pcm_wakeup(int nframes) {
+	int pcm;
+	int wakeup = (nframes + frames - 1) / frames * frames;
+	snd_pcm_sw_params_t *sw;
+	snd_pcm_sw_params_alloca(&sw);
+	snd_pcm_sw_params_current(pcm_handle, sw);
+	snd_pcm_sw_params_set_avail_min(pcm_handle, sw, wakeup);
+	snd_pcm_sw_params_set_start_threshold(pcm_handle, sw, buffer_frames);
+	// Status timestamps on the clock the latency measurements use
+	snd_pcm_sw_params_set_tstamp_mode(pcm_handle, sw, SND_PCM_TSTAMP_ENABLE);
+	snd_pcm_sw_params_set_tstamp_type(pcm_handle, sw, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+	if ((pcm = snd_pcm_sw_params(pcm_handle, sw)) < 0)
+		printf("ERROR: Can't set software parameters. %s\n", snd_strerror(pcm));
+	return wakeup;
+}
 
-	synth_thread_data *thread_data = (synth_thread_data*)synth_data;
+/* SCHED_FIFO where permitted and no page faults once running. Done before
+ * the patch loads so its workers inherit the priority and its buffers get
+ * locked as they are allocated. */
+static void pre_fault_stack() {
+	volatile char stack[PREFAULT_STACK];
+	memset((char*)stack, 0, PREFAULT_STACK);
+}
+static int audio_policy = SCHED_OTHER; // for threads that work for the audio thread
+static struct sched_param audio_param;
+void init_realtime(int priority) {
+	if(priority == 0)
+		priority = DEFAULT_RT_PRIORITY;
+	if(priority > 0) {
+		struct sched_param sp;
+		int max = sched_get_priority_max(SCHED_FIFO);
+		sp.sched_priority = priority < max ? priority : max;
+		int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if(err) {
+			printf("Running without real time priority. %s\n", strerror(err));
+		} else {
+			printf("Real time priority %i\n", sp.sched_priority);
+			audio_policy = SCHED_FIFO;
+			audio_param = sp;
+		}
+	}
+	if(mlockall(MCL_CURRENT | MCL_FUTURE))
+		printf("Running without locked memory. %s\n", strerror(errno));
+	pre_fault_stack();
+}
 
-	init_pcm();
-	unsigned int period_time; // microseconds
-	int dir;
-	snd_pcm_hw_params_get_period_time(params, &period_time, &dir);
+// Frames the bus is holding on to until it has a whole period, -1 without an OUT
+int otp_buffered() {
+	for(int i = 0; i < nmods; i++)
+		if(0 == strncmp(mods[i].type, "OTP", 3))
+			return bus.i;
+	return -1;
+}
 
-	load_network("layout.dat");
+// Hand queued parameter changes that fall in this block to their CSTs
+static void apply_param(param_event *ev, uint64_t start) {
+	int offset = ev->frame > start ? ev->frame - start : 0;
+	if(ev->queued)
+		latency_applied(start + offset, ev->queued);
+	// Queued against an older patch maybe
+	int cst = ev->mod_id >= 0 && ev->mod_id < nmods &&
+			0 == strncmp(mods[ev->mod_id].type, "CST", 3);
+	// Constant ones only rerun when touched, a ramp would stop part way
+	if(PARAM_CST_SMOOTH == ev->kind && cst) {
+		if(PLAN_RATE_CONST != synth_plan->rate[ev->mod_id])
+			((cst_data*)mods[ev->mod_id].data)->smooth_frames = ev->val * rate;
+	} else if(PARAM_CST == ev->kind && cst) {
+		cst_add_event(&mods[ev->mod_id],
+				plan_frame_index(synth_plan, ev->mod_id, offset), ev->val);
+		if(PLAN_RATE_CONST == synth_plan->rate[ev->mod_id])
+			plan_touch(synth_plan);
+		if(synth_native)
+			native_touch(synth_native, ev->mod_id);
+	} else if(PARAM_NOTE_ON == ev->kind)
+		voice_note_on(&voices, offset, ev->mod_id, ev->val);
+	else if(PARAM_NOTE_OFF == ev->kind)
+		voice_note_off(&voices, offset, ev->mod_id);
+}
 
-	//setup_network();
+// Both queues' changes for the block, in frame order
+void synth_apply_params(int nframes) {
+	uint64_t start = synth_frame, end = start + nframes;
+	for(;;) {
+		param_event *ev = param_queue_peek(&param_q);
+		param_event *rev = param_queue_peek(&remote_q);
+		if(ev && ev->frame >= end)
+			ev = NULL;
+		if(rev && rev->frame >= end)
+			rev = NULL;
+		if(!ev && !rev)
+			break;
+		if(ev && (!rev || ev->frame <= rev->frame)) {
+			apply_param(ev, start);
+			param_queue_pop(&param_q);
+		} else {
+			apply_param(rev, start);
+			param_queue_pop(&remote_q);
+		}
+	}
+}
 
-	// Init complete, signal the UI thread
-	char alive = 1;
-	pthread_mutex_lock(&thread_data->alive_mtx);
- 	thread_data->alive = alive;
-	pthread_mutex_unlock(&thread_data->alive_mtx);
+// The stats thread reads module types and per module times of the patch
+static void hold_for_stats(int on) {
+	if(on)
+		synth_hold_patch();
+	else
+		synth_release_patch();
+}
+
+/*************************/
+/* Hot reload. A new patch is parsed, built and compiled on the watcher's
+ * thread, then handed over through pending_net. The audio thread picks
+ * it up between blocks, copies over the running state of modules that
+ * kept their number and type, and swaps it in. For RELOAD_FADE_SECS both
+ * patches run with OUT captured, and the mix goes out on the bus. Nothing
+ * on the audio thread parses or allocates. */
+static char *reload_path = NULL;
+static network *pending_net = NULL; // built, waiting for a block boundary
+static network *fading_net = NULL; // replaced, still being faded out
+static network *retired_net = NULL; // faded out, freed on the next reload once unheld
+static int reload_quit = 0;
+static int fade_len, fade_left;
+static unsigned generation = 0;
+
+static int lanes_of(plan *p, int m) { return p->voiced[m] ? p->lanes : 1; }
+
+// Which modules of n can take over the state of the live ones
+static void plan_carry(network *n) {
+	int most = n->nmods < nmods ? n->nmods : nmods;
+	n->carry = malloc(most * sizeof(int));
+	n->carry_size = malloc(most * sizeof(int));
+	n->ncarry = 0;
+	for(int m = 0; m < most; m++) {
+		mod *new = &n->mods[m], *old = &mods[m];
+		if(!new->type[0] || memcmp(new->type, old->type, 3))
+			continue;
+		int size = 0;
+		if(new->state_size) {
+			int lanes = lanes_of(n->plan, m);
+			if(lanes != lanes_of(synth_plan, m) || !n->plan->states[m])
+				continue;
+			size = new->state_size(lanes);
+		} else if(0 == strncmp(new->type, "CST", 3)) {
+			// Edited values win, otherwise keep whatever the UI set
+			if(((cst_data*)new->data)->init_val != ((cst_data*)old->data)->init_val)
+				continue;
+		} else if(strncmp(new->type, "SEQ", 3)) {
+			continue;
+		}
+		n->carry[n->ncarry] = m;
+		n->carry_size[n->ncarry++] = size;
+	}
+}
+
+static void carry_state(network *n) {
+	for(int i = 0; i < n->ncarry; i++) {
+		int m = n->carry[i];
+		if(n->carry_size[i]) {
+			memcpy(n->plan->states[m], synth_plan->states[m], n->carry_size[i]);
+		} else if(0 == strncmp(mods[m].type, "CST", 3)) {
+			cst_data *new = n->mods[m].data, *old = mods[m].data;
+			new->val = old->val;
+			new->target = old->target;
+			new->step = old->step;
+			new->ramp_left = old->ramp_left;
+		} else {
+			// Carries on from the same frame, with the old notes held
+			seq_data *new = n->mods[m].data, *old = mods[m].data;
+			int lo = 0, hi = new->nevents;
+			while(lo < hi) {
+				int mid = (lo + hi) / 2;
+				if(new->events[mid].frame < old->pos)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			new->next = lo;
+			new->pos = old->pos;
+			new->gate = old->gate;
+			new->pitch = old->pitch;
+			new->velocity = old->velocity;
+			new->nheld = old->nheld;
+			memcpy(new->held, old->held, sizeof(old->held));
+		}
+	}
+}
+
+static int has_otp(mod *ms, int n) {
+	for(int i = 0; i < n; i++)
+		if(0 == strncmp(ms[i].type, "OTP", 3))
+			return 1;
+	return 0;
+}
+
+// At a block boundary on the audio thread
+static void swap_network(network *n) {
+	carry_state(n);
+	if(n->native)
+		native_check_fixed(n->native, n->mods, &cst_fixed);
+	n->stats_mods = stats_swap_mods(&stats, n->stats_mods, n->nmods);
+	exchange_network(n);
+	fade_len = fade_left = RELOAD_FADE_SECS * rate;
+	__atomic_store_n(&fading_net, n, __ATOMIC_RELEASE);
+	__atomic_store_n(&generation, generation + 1, __ATOMIC_RELEASE);
+}
 
-	uint32_t frames_calced = 0;
-	float sound_secs;
-	struct timespec now, elapsed, pause, sound;
-	long int max_sync_diff = 3 * period_time * 1000; // convert to nanoseconds
+// Both patches into the fade buffers, then one mix out on the bus
+static void crossfade_block(int nframes) {
+	int ch = bus.channels;
+	float *old = bus.fade[0], *new = bus.fade[1];
+	float *out = bus.buf + bus.i * ch;
+	memset(old, 0, 2 * block_size * ch * sizeof(float));
+	otp_capture = old;
+	sched_run(fading_net->sched, nframes);
+	otp_capture = new;
+	sched_run(synth_sched, nframes);
+	otp_capture = NULL;
+
+	for(int f = 0; f < nframes; f++) {
+		float g = (float)(fade_len - fade_left + f) / (float)fade_len;
+		g = g < 1.0f ? g : 1.0f;
+		for(int c = 0; c < ch; c++)
+			out[f * ch + c] = old[f * ch + c] + g * (new[f * ch + c] - old[f * ch + c]);
+	}
+	bus.used = 1;
+
+	fade_left -= nframes;
+	if(fade_left <= 0)
+		__atomic_store_n(&fading_net, NULL, __ATOMIC_RELEASE);
+}
 
-	clock_gettime(CLOCK_REALTIME, &start_time);
+// On the watcher's thread
+static void reload_network(void *unused) {
+	(void)unused;
+	struct timespec tick = {0, 1000000};
 
-	while(alive) {
-	
+	if(retired_net) {
+		wait_readers();
+		free_network(retired_net);
+		retired_net = NULL;
+	}
+	patch *p = read_patch(reload_path);
+	network *n = p ? build_network(p) : NULL;
+	if(p)
+		patch_free(p);
+	if(n && !has_otp(n->mods, n->nmods)) {
+		printf("ERROR: %s has no OUT\n", reload_path);
+		free_network(n);
+		n = NULL;
+	}
+	if(!n) {
+		printf("Keeping the patch that is playing\n");
+		return;
+	}
+	// Workers take the priority of the thread that makes them
+	struct sched_param normal = {0};
+	pthread_setschedparam(pthread_self(), audio_policy, &audio_param);
+	n->sched = sched_create(n->plan, max_threads);
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &normal);
+	plan_carry(n);
+
+	// Wait for it to go live and the old one to fade out
+	__atomic_store_n(&pending_net, n, __ATOMIC_RELEASE);
+	while(__atomic_load_n(&pending_net, __ATOMIC_ACQUIRE) ||
+			__atomic_load_n(&fading_net, __ATOMIC_ACQUIRE)) {
+		// The audio thread has stopped, n is whichever patch it left out
+		if(__atomic_load_n(&reload_quit, __ATOMIC_ACQUIRE)) {
+			if(!pending_net)
+				retired_net = n;
+			return;
+		}
+		nanosleep(&tick, NULL);
+	}
+	retired_net = n;
+	printf("Reloaded %s\n", reload_path);
+}
+
+// Reload the layout now, as if it had changed
+void synth_reload() { watch_poke(); }
+unsigned get_synth_generation() {
+	return __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+}
+
+static void start_reloading(char *filename, int watch) {
+	reload_path = filename;
+	reload_quit = 0;
+	watch_start(watch ? filename : NULL, reload_network, NULL);
+}
+static void stop_reloading() {
+	__atomic_store_n(&reload_quit, 1, __ATOMIC_RELEASE);
+	watch_stop();
+	if(pending_net)
+		free_network(pending_net);
+	if(retired_net) {
+		wait_readers();
+		free_network(retired_net);
+	}
+	pending_net = fading_net = retired_net = NULL;
+}
+
+void synth_process_block(int nframes) {
+	int sampled = stats_sampling(&stats);
+	uint64_t t0 = stats_ticks();
+	network *n;
+	if(!fading_net && (n = __atomic_exchange_n(&pending_net, NULL, __ATOMIC_ACQ_REL)))
+		swap_network(n);
+	synth_apply_params(nframes);
+
+	synth_plan->timed = sampled;
+	// Stats sample blocks through the interpreter, it times each step
+	if(fading_net)
+		crossfade_block(nframes);
+	else if(synth_native && !synth_native->off && !sampled)
+		native_run(synth_native, synth_plan, nframes);
+	else
+		sched_run(synth_sched, nframes);
+	tap_block(synth_plan, mods, nmods, nframes);
+	bus_advance(nframes);
+	voice_end_block(&voices, nframes);
+	stats_block(&stats, stats_ticks() - t0, synth_plan, sampled);
+
+	__atomic_store_n(&synth_frame, synth_frame + nframes, __ATOMIC_RELEASE);
+}
+
+// Push out whatever is left on the bus
+void synth_flush_outputs() {
+	if(bus.i > 0)
+		bus_flush(bus.i);
+}
+
+/* The bus writes to w instead of the sound card. The bus gets sized for
+ * offline use so this goes before load_network. */
+void set_render_file(wav_file *w) {
+	render_file = w;
+	frames = RENDER_PERIOD;
+}
+unsigned int get_rate() { return rate; }
+
+char *layout_name(synth_thread_data *thread_data) {
+	return thread_data->layout ? thread_data->layout : "layout.dat";
+}
+
+/* Offline rendering: no ALSA, no wall clock pacing, just run the graph
+ * as fast as possible and stream OUT into a file. */
+int synth_render(synth_thread_data *thread_data) {
+	struct timespec t0, t1;
+
+	if(thread_data->block_size > 0)
+		set_block_size(thread_data->block_size);
+	if(thread_data->control_period > 0)
+		set_control_period(thread_data->control_period);
+	set_optimize(!thread_data->no_optimize);
+	set_cst_smoothing(thread_data->smooth_secs);
+	set_native(thread_data->native);
+	set_voices(thread_data->voices);
+	set_threads(thread_data->threads);
+	set_patch_cache(thread_data->cache);
+	set_channels(thread_data->channels);
+	set_render_file(NULL);
+
+	if(load_network(layout_name(thread_data)))
+		return -1;
+
+	render_file = wav_open(thread_data->render_path, rate, bus.channels);
+	if(!render_file) {
+		unload_network();
+		return -1;
+	}
+	if(thread_data->stats_path)
+		stats_start_dump(&stats, thread_data->stats_path, thread_data->stats_secs,
+				&get_mod_type, &hold_for_stats);
+
+	// Sequenced patches render to the end of their sequences by default
+	long long int total = (long long int)(thread_data->render_secs * rate);
+	if(thread_data->render_secs <= 0.) {
+		uint64_t end = 0;
 		for(int i = 0; i < nmods; i++)
-			mods[i].tick(&mods[i]);
-
-		frames_calced++;
-		clock_gettime(CLOCK_REALTIME, &now);
-		timespec_diff(&now, &start_time, &elapsed);
-		
-		sound_secs = (float)frames_calced / (float)rate;
-		sound.tv_sec = (time_t)sound_secs;
-		sound.tv_nsec = (long)((sound_secs - floor(sound_secs)) * (float)NANO);
-		timespec_diff(&sound, &elapsed, &pause);
-		//printf("calced %fsecs of sound in %fsecs\n",
-		//		sound_secs, (float)elapsed.tv_sec + (float)elapsed.tv_nsec / (float)NANO);
-
-		if(pause.tv_sec > 3) {
-			printf("Clock too far out of sync\n");
-			abort();
+			if(0 == strncmp(mods[i].type, "SEQ", 3) && seq_frames(&mods[i]) > end)
+				end = seq_frames(&mods[i]);
+		total = end ? end + (long long int)(RENDER_TAIL_SECS * rate) :
+			(long long int)(RENDER_SECS * rate);
+	}
+	long long int done = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while(done < total) {
+		int n = total - done < block_size ? total - done : block_size;
+		synth_process_block(n);
+		done += n;
+	}
+	synth_flush_outputs();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	stats_stop_dump();
+
+	int ret = wav_close(render_file);
+	render_file = NULL;
+	unload_network();
+
+	float sound_secs = (float)done / (float)rate;
+	float calc_secs = (float)(timespec_to_nsecs(&t1) - timespec_to_nsecs(&t0)) /
+		(float)NANO;
+	printf("Rendered %.2fs of sound in %.3fs (%.1fx real time) to %s\n",
+			sound_secs, calc_secs, sound_secs / calc_secs,
+			thread_data->render_path);
+	return ret;
+}
+
+// Compiles the layout as it would play and prints the plan, headless
+int synth_dump_plan(synth_thread_data *thread_data) {
+	if(thread_data->block_size > 0)
+		set_block_size(thread_data->block_size);
+	if(thread_data->control_period > 0)
+		set_control_period(thread_data->control_period);
+	set_optimize(!thread_data->no_optimize);
+	set_cst_smoothing(thread_data->smooth_secs);
+	set_native(thread_data->native);
+	set_voices(thread_data->voices);
+	set_threads(thread_data->threads);
+	set_patch_cache(thread_data->cache);
+	set_channels(thread_data->channels);
+	set_render_file(NULL);
+
+	if(load_network(layout_name(thread_data)))
+		return -1;
+	plan_dump(synth_plan, mods, stdout);
+	unload_network();
+	return 0;
+}
+
+/* What has gone to the card so far and how far it is from the DAC, for
+ * the latency measurements */
+static void pcm_played(snd_pcm_status_t *status) {
+	snd_htimestamp_t t;
+	snd_pcm_status_get_htstamp(status, &t);
+	uint64_t at = (uint64_t)t.tv_sec * NANO + t.tv_nsec;
+	latency_played(synth_frame - otp_buffered(), snd_pcm_status_get_delay(status),
+			at ? at : latency_now());
+}
+
+/* Paced by the sound card: sleep in snd_pcm_wait until a period is free,
+ * then compute exactly as much as fits so the OUT writes never block. */
+void *synth_main_loop(void *synth_data) {
+
+	synth_thread_data *thread_data = (synth_thread_data*)synth_data;
+
+	// The device is opened with as many channels as the layout plays on
+	set_patch_cache(thread_data->cache);
+	int channels = thread_data->channels > 0 ? thread_data->channels :
+		layout_channels(layout_name(thread_data));
+	set_channels(init_pcm(thread_data->period, thread_data->periods,
+				thread_data->dither, channels));
+	init_realtime(thread_data->rt_priority);
+
+	if(thread_data->block_size > 0)
+		set_block_size(thread_data->block_size);
+	if(thread_data->control_period > 0)
+		set_control_period(thread_data->control_period);
+	set_optimize(!thread_data->no_optimize);
+	set_cst_smoothing(thread_data->smooth_secs);
+	set_native(thread_data->native);
+	// A block and a part period have to fit in the free space at once
+	if(block_size > (int)(buffer_frames - frames))
+		set_block_size(buffer_frames - frames);
+	printf("Block size: %i frames\n", block_size);
+	int wakeup = init_pcm_wakeup(block_size);
+	int measure = NULL != thread_data->latency_path;
+	if(measure)
+		latency_start(rate, wakeup, buffer_frames);
+	set_voices(thread_data->voices);
+	set_threads(thread_data->threads);
+	set_patch_cache(thread_data->cache);
+
+	int failed = load_network(layout_name(thread_data));
+	// Nothing else paces the loop
+	if(!failed && otp_buffered() < 0) {
+		printf("ERROR: %s has no OUT\n", layout_name(thread_data));
+		unload_network();
+		failed = 1;
+	}
+	if(failed) {
+		snd_pcm_close(pcm_handle);
+		__atomic_store_n(&thread_data->alive, -1, __ATOMIC_RELEASE);
+		return NULL;
+	}
+	if(thread_data->stats_path)
+		stats_start_dump(&stats, thread_data->stats_path, thread_data->stats_secs,
+				&get_mod_type, &hold_for_stats);
+	start_reloading(layout_name(thread_data), !thread_data->no_watch);
+
+	// Init complete, signal the UI thread
+	int alive = 1;
+	__atomic_store_n(&thread_data->alive, alive, __ATOMIC_RELEASE);
+
+	snd_pcm_status_t *status;
+	snd_pcm_status_alloca(&status);
+	while(alive) {
+		int err = snd_pcm_wait(pcm_handle, 1000);
+		if(measure)
+			latency_wakeup(SND_PCM_STATE_RUNNING == snd_pcm_state(pcm_handle) ?
+					latency_now() : 0);
+		snd_pcm_sframes_t avail = err < 0 ? err : snd_pcm_avail_update(pcm_handle);
+		if(avail < 0) {
+			if(-EPIPE == avail)
+				stats_add_xrun(&stats, synth_frame);
+			if((err = snd_pcm_recover(pcm_handle, avail, 1)) < 0) {
+				printf("ERROR: Can't recover PCM device. %s\n", snd_strerror(err));
+				break;
+			}
+			avail = buffer_frames;
 		}
-		if(pause.tv_nsec > max_sync_diff) {
-			//printf("calced %fsecs of sound in %fsecs\n",
-			//		sound_secs, (float)elapsed.tv_sec + (float)elapsed.tv_nsec / (float)NANO);
-			// Always leave 2 periods in the output buffer
-			// This avoids the possibility of sleeping through the buffer interupt
-			pause.tv_nsec -=  2 * max_sync_diff / 3;
-			printf("Audio calculation too far ahead sleep for %li = %fs\n",
-					pause.tv_nsec,
-				 	(float)pause.tv_nsec / (float)NANO);
-			nanosleep(&pause, NULL);
+
+		// Only run blocks whose writes fit in the space there is. With mmap
+		// each block goes out as it is, otherwise the bus writes whole periods.
+		int buffered = otp_buffered();
+		for(;;) {
+			snd_pcm_sframes_t written = pcm_mmap ? block_size :
+				(buffered + block_size) / frames * frames;
+			if(written > avail)
+				break;
+			synth_process_block(block_size);
+			avail -= written;
+			buffered = (buffered + block_size) % frames;
 		}
+		// Blocks that don't divide the buffer may never quite fill it
+		if(SND_PCM_STATE_PREPARED == snd_pcm_state(pcm_handle))
+			snd_pcm_start(pcm_handle);
+		if(measure && 0 == snd_pcm_status(pcm_handle, status))
+			pcm_played(status);
 
-		pthread_mutex_lock(&thread_data->alive_mtx);
-		alive = thread_data->alive;
-		pthread_mutex_unlock(&thread_data->alive_mtx);
+		alive = __atomic_load_n(&thread_data->alive, __ATOMIC_ACQUIRE);
 	}
 	printf("Closing synth\n");
+	stop_reloading();
+	stats_stop_dump();
+	unload_network();
+	if(measure)
+		latency_report(thread_data->latency_path);
 
 	snd_pcm_drain(pcm_handle);
 	snd_pcm_close(pcm_handle);
@@ -1,18 +1,102 @@
 #ifndef SYNTH_H
 #define SYNTH_H
 #include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "plan.h"
+#include "params.h"
+#include "wav.h"
+#include "stats.h"
+
+#define DEFAULT_BLOCK_SIZE 64
+#define MAX_BLOCK_SIZE 4096
+#define MAX_CHANNELS 64 // of the output bus
+#define DEFAULT_CONTROL_PERIOD 32 // frames per tick for slow moving modules
+#define DEFAULT_RT_PRIORITY 70 // SCHED_FIFO priority of the audio thread
 
 typedef struct synth_thread_data {
-	char alive;
-	pthread_mutex_t alive_mtx;
+	int alive; // -1 if it couldn't start, only ever accessed with __atomic builtins
+
+	int block_size; // frames per module call, 0 for the default
+	int control_period; // frames per control rate tick, 0 for the default
+	int voices; // for patches with a KEY module, 0 for the default
+	int threads; // most threads to run the patch on, 0 for one per core
+	char *layout; // NULL for layout.dat, text or a compiled .synb
+	char *cache; // compiled layouts, NULL for the default, "" for none
+	int no_watch; // don't reload the layout when it changes
+	int no_optimize; // keep every module in a step of its own
+	int dump_plan; // print the compiled plan and exit
+	int native; // compile the patch to native code, see native.h
+	int channels; // of the output, 0 for as many as the layout's OUTs use
+	float smooth_secs; // CSTs ramp to new values over this, 0 jumps
+
+	// Sound card, 0 leaves it to the device
+	int period; // frames per period
+	int periods; // periods in the buffer
+	int rt_priority; // 0 for DEFAULT_RT_PRIORITY, -ve to stay SCHED_OTHER
+	int dither; // TPDF dither when the device wants integers
+
+	// Offline rendering
+	char *render_path; // .wav or raw float
+	float render_secs; // 0 for to the end of the sequences, or 10s
 
+	// Timing stats written out every stats_secs while running
+	char *stats_path;
+	float stats_secs;
+
+	// Latency and jitter histograms written here on exit, NULL for none
+	char *latency_path;
+
+	// Remote control, see control.h
+	int daemon; // no UI, runs until SIGINT or SIGTERM
+	char *control_socket; // UNIX socket path, NULL for none
+	int osc_port; // UDP port on localhost, 0 for none
 } synth_thread_data;
 void *synth_main_loop(void *synth_data);
+int synth_render(synth_thread_data *thread_data);
+int synth_dump_plan(synth_thread_data *thread_data);
+void set_block_size(int n);
+int get_block_size();
+void set_control_period(int n);
+void set_optimize(int on);
+void set_cst_smoothing(float secs);
+void set_native(int on);
+void set_channels(int n);
+int get_channels();
+int layout_channels(const char *filename);
+void set_threads(int n);
+void set_voices(int n);
+void set_patch_cache(const char *dir);
 void set_mod_cst_value(int mod_id, float val);
+void schedule_mod_cst_value(int mod_id, float val, uint64_t frame);
+uint64_t get_synth_frame();
+void synth_note_on(int note, float velocity);
+void synth_note_off(int note);
+void schedule_note_on(int note, float velocity, uint64_t frame);
+void schedule_note_off(int note, uint64_t frame);
+int queue_remote_params(param_event *evs, int n);
+int synth_is_polyphonic();
+void synth_reload();
+unsigned get_synth_generation(); // goes up each time a new patch goes live
 char* get_mod_cst_label(int mod_id);
 char* get_mod_cst_type(int mod_id);
 float get_mod_cst_init_value(int mod_id);
 
 char *get_mod_type(int mod_id);
 int get_nmods();
+/* Other threads hold the live patch while they use what the get_mod_*
+ * calls hand out, a reload won't free it under them */
+void synth_hold_patch();
+void synth_release_patch();
+unsigned int get_rate();
+
+// Driving the engine directly, for tools like the benchmark
+int load_network(char *filename);
+int load_network_from(FILE *f);
+void unload_network();
+plan *get_synth_plan();
+synth_stats *get_synth_stats();
+void set_render_file(wav_file *w);
+void synth_process_block(int nframes);
+void synth_flush_outputs();
 #endif
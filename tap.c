@@ -0,0 +1,163 @@
+#include "tap.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+typedef struct tap {
+	// Set by the UI
+	int spec; // mod_id * PLAN_MAX_PORTS + port + 1, 0 when off
+	int decimate;
+	// Audio thread only
+	int seen_spec, seen_decimate; // what the ring holds
+	double sum; // of the frames since the last sample
+	int count;
+	// Published by the audio thread
+	int status;
+	unsigned head; // samples ever written
+	unsigned since; // head when the ring started on seen_spec
+	float ring[TAP_RING_LEN];
+} tap;
+
+static tap taps[TAP_MAX];
+
+void tap_set(int slot, int mod_id, int port, int decimate) {
+	if(slot < 0 || slot >= TAP_MAX || mod_id < 0 || port < 0 || port >= PLAN_MAX_PORTS)
+		return;
+	decimate = decimate < 1 ? 1 : decimate > TAP_MAX_DECIMATE ? TAP_MAX_DECIMATE : decimate;
+	__atomic_store_n(&taps[slot].decimate, decimate, __ATOMIC_RELAXED);
+	__atomic_store_n(&taps[slot].spec, mod_id * PLAN_MAX_PORTS + port + 1, __ATOMIC_RELEASE);
+}
+
+void tap_clear(int slot) {
+	if(slot >= 0 && slot < TAP_MAX)
+		__atomic_store_n(&taps[slot].spec, 0, __ATOMIC_RELEASE);
+}
+
+int tap_status(int slot) {
+	if(slot < 0 || slot >= TAP_MAX)
+		return TAP_OFF;
+	return __atomic_load_n(&taps[slot].status, __ATOMIC_ACQUIRE);
+}
+
+int tap_read(int slot, float *out, int n) {
+	if(slot < 0 || slot >= TAP_MAX)
+		return 0;
+	tap *t = &taps[slot];
+	unsigned head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+	unsigned since = __atomic_load_n(&t->since, __ATOMIC_ACQUIRE);
+	int avail = (int)(head - since);
+	avail = avail < 0 ? 0 : avail > TAP_RING_LEN ? TAP_RING_LEN : avail;
+	avail = avail < n ? avail : n;
+	unsigned from = head - avail;
+	for(int i = 0; i < avail; i++)
+		out[i] = t->ring[(from + i) & (TAP_RING_LEN - 1)];
+	// The writer may have come round onto what was copied, leave it for next time
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	unsigned now = __atomic_load_n(&t->head, __ATOMIC_RELAXED);
+	if(now - from > TAP_RING_LEN)
+		return 0;
+	return avail;
+}
+
+/* Averages the port's buffer into the ring. Frames before the block's
+ * first tick belong to the last block's, those get tick 0 which is near
+ * enough for looking at. */
+static void tap_write(tap *t, plan *p, int m, float *buf, int nframes) {
+	int voices = p->voiced[m] ? p->voices : 1, lanes = p->voiced[m] ? p->lanes : 1;
+	int first = p->phase ? p->control_period - p->phase : 0;
+	unsigned head = t->head;
+	for(int f = 0; f < nframes; f++) {
+		int k = 0;
+		if(PLAN_RATE_AUDIO == p->rate[m])
+			k = f;
+		else if(PLAN_RATE_CONTROL == p->rate[m] && f >= first && p->nticks > 0) {
+			k = (f - first) / p->control_period;
+			k = k < p->nticks ? k : p->nticks - 1;
+		}
+		float v = 0;
+		for(int i = 0; i < voices; i++)
+			v += buf[k * lanes + i];
+		t->sum += v;
+		if(++t->count == t->seen_decimate) {
+			t->ring[head++ & (TAP_RING_LEN - 1)] = t->sum / t->seen_decimate;
+			t->sum = 0;
+			t->count = 0;
+		}
+	}
+	__atomic_store_n(&t->head, head, __ATOMIC_RELEASE);
+}
+
+void tap_block(plan *p, mod *mods, int nmods, int nframes) {
+	for(int i = 0; i < TAP_MAX; i++) {
+		tap *t = &taps[i];
+		int spec = __atomic_load_n(&t->spec, __ATOMIC_ACQUIRE);
+		int decimate = __atomic_load_n(&t->decimate, __ATOMIC_RELAXED);
+		if(spec != t->seen_spec || decimate != t->seen_decimate) {
+			t->seen_spec = spec;
+			t->seen_decimate = decimate;
+			t->sum = 0;
+			t->count = 0;
+			__atomic_store_n(&t->since, t->head, __ATOMIC_RELEASE);
+		}
+		if(!spec) {
+			__atomic_store_n(&t->status, TAP_OFF, __ATOMIC_RELEASE);
+			continue;
+		}
+		int m = (spec - 1) / PLAN_MAX_PORTS, port = (spec - 1) % PLAN_MAX_PORTS;
+		int off = -1;
+		// Modules may skip working out ports nothing reads
+		if(p && m < nmods && port < mods[m].nouts && p->used_outs[m] & (1 << port))
+			off = plan_port_offset(p, m, port);
+		__atomic_store_n(&t->status, off < 0 ? TAP_UNAVAILABLE : TAP_OK, __ATOMIC_RELEASE);
+		if(off >= 0)
+			tap_write(t, p, m, p->pool + off, nframes);
+	}
+}
+
+// In place radix 2 FFT
+static void fft(float *re, float *im, int n) {
+	for(int i = 1, j = 0; i < n; i++) {
+		int bit = n >> 1;
+		for(; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if(i < j) {
+			float r = re[i], s = im[i];
+			re[i] = re[j]; im[i] = im[j];
+			re[j] = r; im[j] = s;
+		}
+	}
+	for(int len = 2; len <= n; len <<= 1) {
+		double a = -2 * M_PI / len;
+		for(int i = 0; i < n; i += len)
+			for(int j = 0; j < len / 2; j++) {
+				float wr = cos(a * j), wi = sin(a * j);
+				float *ur = &re[i + j], *ui = &im[i + j];
+				float *vr = &re[i + j + len / 2], *vi = &im[i + j + len / 2];
+				float xr = *vr * wr - *vi * wi, xi = *vr * wi + *vi * wr;
+				*vr = *ur - xr; *vi = *ui - xi;
+				*ur += xr; *ui += xi;
+			}
+	}
+}
+
+// 0dB is a full scale sine, the Hann window halves its peak
+void tap_spectrum(const float *in, float *db, int n) {
+	float *re = malloc(2 * n * sizeof(float)), *im = re + n;
+	if(!re)
+		return;
+	for(int i = 0; i < n; i++) {
+		re[i] = in[i] * (0.5 - 0.5 * cos(2 * M_PI * i / n));
+		im[i] = 0;
+	}
+	fft(re, im, n);
+	for(int k = 0; k < n / 2; k++) {
+		float mag = sqrtf(re[k] * re[k] + im[k] * im[k]) / (n / 4.0f);
+		db[k] = 20 * log10f(mag + 1e-10f);
+	}
+	free(re);
+}
@@ -0,0 +1,38 @@
+#ifndef TAP_H
+#define TAP_H
+#include "plan.h"
+
+/* Taps for looking at signals in a running patch. The UI points a tap at
+ * a module's output port, and after every block the audio thread averages
+ * that buffer down to one sample per decimate frames into the tap's ring.
+ * Voices are summed, control rate ports are held from tick to tick. The
+ * audio thread never allocates or waits, it only writes the ring and
+ * moves its head on. The UI copies out the newest samples whenever it
+ * draws, and tries again later if the ring went round under it.
+ *
+ * A tap follows the module id across reloads. Ports nothing in the patch
+ * reads, and ones with no buffer of their own because the optimizer pruned
+ * or fused the module, show as unavailable. --no-optimize keeps the fused
+ * ones. */
+
+#define TAP_MAX 4
+#define TAP_RING_LEN 16384 // samples kept per tap, a power of 2
+#define TAP_MAX_DECIMATE 1024
+
+// What the audio thread last found at a tap's port
+#define TAP_OFF 0
+#define TAP_OK 1
+#define TAP_UNAVAILABLE 2 // no such port, or nothing there to read
+
+// UI side
+void tap_set(int slot, int mod_id, int port, int decimate);
+void tap_clear(int slot);
+int tap_status(int slot);
+// The newest n samples or fewer, only ones since the tap was last set
+int tap_read(int slot, float *out, int n);
+// Power in dB of each of the n / 2 bins of a Hann windowed FFT, n a power of 2
+void tap_spectrum(const float *in, float *db, int n);
+
+// Audio thread, after each block has run
+void tap_block(plan *p, mod *mods, int nmods, int nframes);
+#endif
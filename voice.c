@@ -0,0 +1,128 @@
+#include "voice.h"
+#include <math.h>
+#include <string.h>
+
+int voice_lanes(int nvoices) {
+	return (nvoices + VOICE_LANE_WIDTH - 1) / VOICE_LANE_WIDTH * VOICE_LANE_WIDTH;
+}
+
+void voice_init(voice_bank *b, int nvoices) {
+	memset(b, 0, sizeof(voice_bank));
+	if(nvoices < 1) nvoices = 1;
+	if(nvoices > MAX_VOICES) nvoices = MAX_VOICES;
+	b->nvoices = nvoices;
+	b->lanes = voice_lanes(nvoices);
+	for(int v = 0; v < MAX_VOICES; v++)
+		b->note[v] = -1;
+}
+
+// Keeps the list sorted by offset, a retrigger can land one frame later
+static void add_event(voice_bank *b, int offset, int lane, float gate,
+		float pitch, float velocity) {
+	if(b->nevents == VOICE_MAX_EVENTS)
+		return;
+	int i = b->nevents++;
+	for(; i > 0 && b->events[i - 1].offset > offset; i--)
+		b->events[i] = b->events[i - 1];
+	voice_event *e = &b->events[i];
+	e->offset = offset;
+	e->lane = lane;
+	e->gate = gate;
+	e->pitch = pitch;
+	e->velocity = velocity;
+	b->last_gate[lane] = gate;
+}
+
+static float note_to_hz(int note) {
+	return 440.0f * powf(2.0f, (float)(note - 69) / 12.0f);
+}
+
+/* Prefer the voice already playing this note, then the voice released
+ * longest ago, then steal the oldest held voice. */
+static int allocate(voice_bank *b, int note) {
+	int best = -1;
+	for(int v = 0; v < b->nvoices; v++)
+		if(b->held[v] && b->note[v] == note)
+			return v;
+	for(int v = 0; v < b->nvoices; v++)
+		if(!b->held[v] && (best < 0 || b->age[v] < b->age[best]))
+			best = v;
+	if(best >= 0)
+		return best;
+	for(int v = 0; v < b->nvoices; v++)
+		if(best < 0 || b->age[v] < b->age[best])
+			best = v;
+	return best;
+}
+
+// Events must arrive in frame order
+void voice_note_on(voice_bank *b, int offset, int note, float velocity) {
+	int v = allocate(b, note);
+	float pitch = note_to_hz(note);
+
+	b->note[v] = note;
+	b->held[v] = 1;
+	b->age[v] = ++b->counter;
+	// A voice taken over while its gate is up needs a falling edge first
+	if(b->last_gate[v] > 0.5f) {
+		add_event(b, offset, v, 0.0f, -1.0f, -1.0f);
+		offset++;
+	}
+	add_event(b, offset, v, 1.0f, pitch, velocity);
+}
+
+void voice_note_off(voice_bank *b, int offset, int note) {
+	for(int v = 0; v < b->nvoices; v++) {
+		if(!b->held[v] || b->note[v] != note) continue;
+		b->held[v] = 0;
+		add_event(b, offset, v, 0.0f, -1.0f, -1.0f);
+	}
+}
+
+// Outputs are interleaved, frame f of voice v is at f * lanes + v
+void voice_render(voice_bank *b, float *gate, float *pitch, float *velocity,
+		int nframes) {
+	float g[MAX_VOICES], p[MAX_VOICES], vel[MAX_VOICES];
+	int lanes = b->lanes;
+	int e = 0;
+
+	memcpy(g, b->gate, lanes * sizeof(float));
+	memcpy(p, b->pitch, lanes * sizeof(float));
+	memcpy(vel, b->velocity, lanes * sizeof(float));
+	for(int f = 0; f < nframes; f++) {
+		for(; e < b->nevents && b->events[e].offset <= f; e++) {
+			voice_event *ev = &b->events[e];
+			g[ev->lane] = ev->gate;
+			// Releases keep the pitch and velocity the note played at
+			if(ev->pitch >= 0.0f) {
+				p[ev->lane] = ev->pitch;
+				vel[ev->lane] = ev->velocity;
+			}
+		}
+		for(int v = 0; v < lanes; v++) {
+			gate[f * lanes + v] = g[v];
+			pitch[f * lanes + v] = p[v];
+			velocity[f * lanes + v] = vel[v];
+		}
+	}
+}
+
+/* Commit this block's events. Anything pushed past the end of the block
+ * by a retrigger moves into the next one. */
+void voice_end_block(voice_bank *b, int nframes) {
+	int carried = 0;
+	for(int e = 0; e < b->nevents; e++) {
+		voice_event *ev = &b->events[e];
+		if(ev->offset >= nframes) {
+			ev->offset -= nframes;
+			b->events[carried++] = *ev;
+			continue;
+		}
+		b->gate[ev->lane] = ev->gate;
+		if(ev->pitch >= 0.0f) {
+			b->pitch[ev->lane] = ev->pitch;
+			b->velocity[ev->lane] = ev->velocity;
+		}
+	}
+	b->nevents = carried;
+}
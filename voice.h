@@ -0,0 +1,49 @@
+#ifndef VOICE_H
+#define VOICE_H
+#include <stdint.h>
+
+/* Voice allocation for polyphonic patches. Everything downstream of a KEY
+ * module is run once per voice, with the voices interleaved frame by frame
+ * so a kernel can work on several voices per SIMD instruction. The bank
+ * hands notes to voices and renders the per-voice gate, pitch and
+ * velocity signals that KEY outputs. */
+
+#define MAX_VOICES 64
+#define DEFAULT_VOICES 8
+#define VOICE_LANE_WIDTH 4 // voice count is padded to a multiple of this
+#define VOICE_MAX_EVENTS 128 // note changes per block
+
+typedef struct voice_event {
+	int offset; // frame within the block
+	int lane;
+	float gate;
+	float pitch;
+	float velocity;
+} voice_event;
+
+typedef struct voice_bank {
+	int nvoices;
+	int lanes;
+	int note[MAX_VOICES]; // -1 until first used
+	char held[MAX_VOICES];
+	uint64_t age[MAX_VOICES]; // when the voice was last allocated
+	uint64_t counter;
+
+	// Values at the start of the block, and as of the last queued event
+	float gate[MAX_VOICES];
+	float pitch[MAX_VOICES];
+	float velocity[MAX_VOICES];
+	float last_gate[MAX_VOICES];
+
+	voice_event events[VOICE_MAX_EVENTS];
+	int nevents;
+} voice_bank;
+
+int voice_lanes(int nvoices);
+void voice_init(voice_bank *b, int nvoices);
+void voice_note_on(voice_bank *b, int offset, int note, float velocity);
+void voice_note_off(voice_bank *b, int offset, int note);
+void voice_render(voice_bank *b, float *gate, float *pitch, float *velocity,
+		int nframes);
+void voice_end_block(voice_bank *b, int nframes);
+#endif
@@ -0,0 +1,128 @@
+#define _POSIX_C_SOURCE 200809L
+#include "watch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+
+static struct {
+	pthread_t thread;
+	int running;
+	int inotify; // -1 when only poked
+	int pipe[2]; // pokes and the stop request
+	char *dir;
+	char *name;
+	watch_fn fn;
+	void *arg;
+} watcher = {.running = 0, .inotify = -1};
+
+// Any event in the buffer for our file
+static int names_file(char *buf, ssize_t len) {
+	for(char *p = buf; p < buf + len; ) {
+		struct inotify_event *ev = (struct inotify_event*)p;
+		if(ev->len && 0 == strcmp(ev->name, watcher.name))
+			return 1;
+		p += sizeof(struct inotify_event) + ev->len;
+	}
+	return 0;
+}
+
+static void *watch_loop(void *unused) {
+	(void)unused;
+	// Not real time even if whoever started it is
+	struct sched_param normal = {0};
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &normal);
+
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[2] = {{watcher.pipe[0], POLLIN, 0}, {watcher.inotify, POLLIN, 0}};
+	int nfds = watcher.inotify < 0 ? 1 : 2;
+
+	for(;;) {
+		int changed = 0;
+		int timeout = -1;
+		// Once something happens keep reading until it goes quiet
+		while(poll(fds, nfds, timeout) > 0) {
+			if(fds[0].revents) {
+				char c;
+				if(read(watcher.pipe[0], &c, 1) <= 0 || 'q' == c)
+					return NULL;
+				changed = 1;
+			}
+			if(nfds > 1 && fds[1].revents) {
+				ssize_t len = read(watcher.inotify, buf, sizeof(buf));
+				if(len > 0 && names_file(buf, len))
+					changed = 1;
+			}
+			if(changed)
+				timeout = WATCH_SETTLE_MS;
+		}
+		if(changed)
+			watcher.fn(watcher.arg);
+	}
+	return NULL;
+}
+
+int watch_start(const char *path, watch_fn fn, void *arg) {
+	if(watcher.running)
+		watch_stop();
+	if(pipe(watcher.pipe)) {
+		printf("ERROR: Can't make the reload pipe. %s\n", strerror(errno));
+		return -1;
+	}
+	watcher.fn = fn;
+	watcher.arg = arg;
+	watcher.inotify = -1;
+	watcher.dir = NULL;
+	watcher.name = NULL;
+
+	if(path) {
+		const char *slash = strrchr(path, '/');
+		watcher.dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+		watcher.name = strdup(slash ? slash + 1 : path);
+		watcher.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if(watcher.inotify < 0 ||
+				inotify_add_watch(watcher.inotify, watcher.dir, WATCH_EVENTS) < 0) {
+			printf("Not watching %s for changes. %s\n", path, strerror(errno));
+			if(watcher.inotify >= 0)
+				close(watcher.inotify);
+			watcher.inotify = -1;
+		}
+	}
+
+	if(pthread_create(&watcher.thread, NULL, watch_loop, NULL)) {
+		printf("ERROR: Can't start the reload thread\n");
+		watch_stop();
+		return -1;
+	}
+	watcher.running = 1;
+	return 0;
+}
+
+void watch_poke() {
+	if(watcher.running && write(watcher.pipe[1], "r", 1) < 0)
+		printf("ERROR: Can't ask for a reload. %s\n", strerror(errno));
+}
+
+void watch_stop() {
+	if(watcher.running) {
+		if(write(watcher.pipe[1], "q", 1) == 1)
+			pthread_join(watcher.thread, NULL);
+		watcher.running = 0;
+	}
+	if(watcher.inotify >= 0)
+		close(watcher.inotify);
+	close(watcher.pipe[0]);
+	close(watcher.pipe[1]);
+	free(watcher.dir);
+	free(watcher.name);
+	watcher.inotify = -1;
+	watcher.dir = NULL;
+	watcher.name = NULL;
+}
@@ -0,0 +1,17 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+/* Calls fn on a thread of its own whenever the file at path is written
+ * or replaced, and whenever watch_poke is called. Editors that save by
+ * writing a new file and renaming it over the old one are caught as the
+ * directory is watched rather than the file. Changes arriving while fn
+ * runs, or within WATCH_SETTLE_MS of each other, make one call. */
+
+#define WATCH_SETTLE_MS 50
+
+typedef void (*watch_fn)(void *arg);
+// path NULL just waits for pokes
+int watch_start(const char *path, watch_fn fn, void *arg);
+void watch_poke();
+void watch_stop();
+#endif
@@ -0,0 +1,133 @@
+#define _POSIX_C_SOURCE 200809L
+#include "wav.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define WAVE_FORMAT_IEEE_FLOAT 3
+#define WAV_HEADER_LEN 58
+
+static void put_u16(unsigned char *p, uint16_t v) {
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+}
+static void put_u32(unsigned char *p, uint32_t v) {
+	put_u16(p, v & 0xffff);
+	put_u16(p + 2, v >> 16);
+}
+static uint16_t get_u16(const unsigned char *p) { return p[0] | p[1] << 8; }
+static uint32_t get_u32(const unsigned char *p) {
+	return get_u16(p) | (uint32_t)get_u16(p + 2) << 16;
+}
+
+// RIFF header with fmt and fact chunks for non-PCM data
+static int wav_write_header(wav_file *w) {
+	unsigned char h[WAV_HEADER_LEN];
+	uint32_t data_len = w->frames_written * w->channels * sizeof(float);
+
+	memcpy(h, "RIFF", 4);
+	put_u32(h + 4, WAV_HEADER_LEN - 8 + data_len);
+	memcpy(h + 8, "WAVE", 4);
+
+	memcpy(h + 12, "fmt ", 4);
+	put_u32(h + 16, 18);
+	put_u16(h + 20, WAVE_FORMAT_IEEE_FLOAT);
+	put_u16(h + 22, w->channels);
+	put_u32(h + 24, w->rate);
+	put_u32(h + 28, w->rate * w->channels * sizeof(float));
+	put_u16(h + 32, w->channels * sizeof(float));
+	put_u16(h + 34, 8 * sizeof(float));
+	put_u16(h + 36, 0);
+
+	memcpy(h + 38, "fact", 4);
+	put_u32(h + 42, 4);
+	put_u32(h + 46, w->frames_written);
+
+	memcpy(h + 50, "data", 4);
+	put_u32(h + 54, data_len);
+
+	rewind(w->f);
+	return fwrite(h, 1, WAV_HEADER_LEN, w->f) == WAV_HEADER_LEN ? 0 : -1;
+}
+
+wav_file *wav_open(const char *filename, unsigned int rate, int channels) {
+	FILE *f = fopen(filename, "wb");
+	if(!f) {
+		printf("ERROR: Can't open \"%s\" for writing\n", filename);
+		return NULL;
+	}
+
+	wav_file *w = malloc(sizeof(wav_file));
+	memset(w, 0, sizeof(wav_file));
+	w->f = f;
+	w->rate = rate;
+	w->channels = channels;
+
+	int len = strlen(filename);
+	w->is_wav = len > 4 && 0 == strcmp(&filename[len - 4], ".wav");
+	// Placeholder until we know how long the data is
+	if(w->is_wav)
+		wav_write_header(w);
+	return w;
+}
+
+wav_file *wav_open_memory(char **buf, size_t *bytes, unsigned int rate, int channels) {
+	FILE *f = open_memstream(buf, bytes);
+	if(!f) {
+		printf("ERROR: Can't open a render buffer\n");
+		return NULL;
+	}
+
+	wav_file *w = malloc(sizeof(wav_file));
+	memset(w, 0, sizeof(wav_file));
+	w->f = f;
+	w->rate = rate;
+	w->channels = channels;
+	return w;
+}
+
+int wav_write(wav_file *w, const float *samples, int nframes) {
+	size_t n = (size_t)nframes * w->channels;
+	if(fwrite(samples, sizeof(float), n, w->f) != n) {
+		printf("ERROR: Short write to render file\n");
+		return -1;
+	}
+	w->frames_written += nframes;
+	return 0;
+}
+
+int wav_close(wav_file *w) {
+	int ret = 0;
+	if(w->is_wav)
+		ret = wav_write_header(w);
+	if(fclose(w->f))
+		ret = -1;
+	free(w);
+	return ret;
+}
+
+float *wav_load(const char *filename, int *channels, uint32_t *nframes) {
+	FILE *f = fopen(filename, "rb");
+	if(!f) {
+		printf("ERROR: Can't open \"%s\"\n", filename);
+		return NULL;
+	}
+	unsigned char h[WAV_HEADER_LEN];
+	if(fread(h, 1, WAV_HEADER_LEN, f) != WAV_HEADER_LEN || memcmp(h, "RIFF", 4) ||
+			memcmp(h + 8, "WAVE", 4) || memcmp(h + 50, "data", 4) ||
+			WAVE_FORMAT_IEEE_FLOAT != get_u16(h + 20) || 0 == get_u16(h + 22)) {
+		printf("ERROR: \"%s\" is not a float .wav written by wav_open\n", filename);
+		fclose(f);
+		return NULL;
+	}
+	*channels = get_u16(h + 22);
+	size_t n = get_u32(h + 54) / sizeof(float);
+	float *samples = malloc((n ? n : 1) * sizeof(float));
+	if(fread(samples, sizeof(float), n, f) != n) {
+		printf("ERROR: \"%s\" is shorter than its header says\n", filename);
+		free(samples);
+		samples = NULL;
+	}
+	fclose(f);
+	*nframes = n / *channels;
+	return samples;
+}
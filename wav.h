@@ -0,0 +1,25 @@
+#ifndef WAV_H
+#define WAV_H
+#include <stdio.h>
+#include <stdint.h>
+
+/* Float output files for offline rendering. Names ending in .wav get a
+ * 32 bit IEEE float RIFF/WAVE header, anything else is written as raw
+ * native float samples. */
+typedef struct wav_file {
+	FILE *f;
+	int is_wav;
+	unsigned int rate;
+	int channels;
+	uint32_t frames_written;
+} wav_file;
+
+wav_file *wav_open(const char *filename, unsigned int rate, int channels);
+/* Raw floats into a buffer that grows as it's written. *buf and *bytes
+ * are only up to date after wav_close, then *buf is the caller's to free */
+wav_file *wav_open_memory(char **buf, size_t *bytes, unsigned int rate, int channels);
+int wav_write(wav_file *w, const float *samples, int nframes);
+int wav_close(wav_file *w);
+// Samples of a .wav wav_open wrote, interleaved, NULL if it can't be read
+float *wav_load(const char *filename, int *channels, uint32_t *nframes);
+#endif